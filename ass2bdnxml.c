@@ -18,52 +18,58 @@
  * The same agreement notice applies.
  */
 
+#include <errno.h>
 #include <getopt.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "common.h"
+#include "checkpoint.h"
+#include "report.h"
+#include "server.h"
 
 #define A2B_VERSION_STRING "0.7f"
-
-frate_t frates[] = {
-    {"23.976",24, 24000, 1001},
-    {"24", 24, 24, 1},
-    {"25", 25, 25, 1},
-    {"29.97", 30, 30000, 1001},
-    {"50", 50, 50, 1},
-    {"59.94", 60, 60000, 1001},
-    {"60", 60, 60, 1},
-    {NULL, 0, 0, 0}
-};
-
-typedef struct vfmt_s {
-    char *name;
-    int w_frame_anamorphic;
-    int w_frame_fullscreen;
-    int w_scaled;
-    int w;
-    int h;
-} vfmt_t;
-
-vfmt_t vfmts[] = {
-    {"1080p", 1920, 1440, -1, 1920, 1080},
-    {"1080i", 1920, 1440, -1, 1920, 1080},
-    {"720p",  1280, 960,  -1, 1280, 720},
-    {"576p",  1024, 720, 768, 720,  576}, //Secondary videostream only
-    {"576i",  1024, 720, 768, 720,  576},
-    {"480p",  852,  720, 640, 720,  480}, //Secondary videostream only
-    {"480i",  852,  720, 640, 720,  480},
-    {"2160p", 3840, 2160, -1, 3840, 2160},//Illegal, provided out of sympathy
-    {NULL, 0, 0, 0, 0, 0}
-};
+#define SERVE_WORKER_MIN_MB (128)
+#define PROGRESS_INTERVAL_MS (1000)
+#define MAX_FRAME_RATES (4)
 
 enum opts_short_e {
+    //A2B slicing
+    OPT_ARG_START          = 960,
+    OPT_ARG_END,
+    OPT_ARG_INDEXBASE,
+    OPT_ARG_MERGE,
+    OPT_ARG_PROFILE,
+    //A2B resources
+    OPT_ARG_MEMLIMIT       = 965,
+    OPT_ARG_CHECKPOINT,
+    OPT_ARG_RESUME,
+    //A2B event merging
+    OPT_ARG_MERGETHR       = 970,
+    OPT_ARG_MERGEMAX,
     //A2B general
     OPT_ARG_VERSION        = 975,
+    //A2B monitoring
+    OPT_ARG_PROGRESSFD     = 977,
+    OPT_ARG_METRICS,
+    OPT_ARG_TRACE,
+    //A2B server
+    OPT_ARG_SERVE          = 980,
+    OPT_ARG_WORKERS,
+    //A2B reporting
+    OPT_ARG_REPORT         = 985,
+    OPT_ARG_CHECKREPORT,
+    OPT_ARG_CHECKTOL,
+    OPT_ARG_ANALYZE,
+    OPT_ARG_EVINDEX,
     //A2B renderer
     OPT_ARG_DIM            = 990,
     OPT_ARG_SQUAREPIX,
@@ -73,10 +79,16 @@ enum opts_short_e {
     OPT_ARG_HINTING,
     OPT_ARG_KEEPDUPES,
     OPT_ARG_FULLBITMAPS,
+    OPT_ARG_COLORSPACE,
+    OPT_ARG_NITS,
     //LIQ
     OPT_LIQ_SPEED          = 1000,
     OPT_LIQ_DITHER,
-    OPT_LIQ_MAXQUAL
+    OPT_LIQ_MAXQUAL,
+    OPT_LIQ_RLEBUDGET,
+    OPT_LIQ_TIMEBUDGET,
+    OPT_LIQ_MAXSPEED,
+    OPT_LIQ_MINQUAL
 };
 
 static void die_usage(const char *name)
@@ -85,6 +97,12 @@ static void die_usage(const char *name)
     exit(1);
 }
 
+//Library messages go to stdout with the tool output.
+static void log_message(void *priv, int level, const char *msg)
+{
+    printf(A2B_LOG_PREFIX "%s\n", msg);
+}
+
 static void tc_to_tcarray(char *buf, uint8_t *vals)
 {
     uint8_t hits = 0;
@@ -119,6 +137,17 @@ static uint64_t tcarray_to_frame(uint8_t *vals, frate_t *fps)
     return offset;
 }
 
+//BDN XML of an additional frame rate: the main name with the rate appended, e.g. bdn_25.xml.
+static void rate_xml_name(char *buf, size_t size, const char *bdnfile, const frate_t *frate)
+{
+    const char *base = bdnfile ? bdnfile : "bdn.xml";
+    const char *ext = strrchr(base, '.');
+
+    if (ext == NULL || strchr(ext, '/'))
+        ext = base + strlen(base);
+    snprintf(buf, size, "%.*s_%s%s", (int)(ext - base), base, frate->name, *ext ? ext : ".xml");
+}
+
 static void parse_margins(char *buf, uint16_t *margins) 
 {
     uint8_t k = 0;
@@ -139,87 +168,118 @@ static void parse_margins(char *buf, uint16_t *margins)
     }
 }
 
-static void frame_to_tc(uint64_t frames, frate_t *fps, char *buf)
+//Parse an output profile: comma separated key=value encoding options, on top of the main ones.
+static void parse_profile(char *spec, opts_t *args, liqopts_t *liqargs, char **xmlfile, uint8_t *liq_params,
+                          vfmt_t **vfmt, uint32_t *check_every)
 {
-    frames--;
-    uint8_t  frame = frames % fps->rate;
-    uint64_t ts = frames/fps->rate;
-    uint8_t  sec = ts % 60;
-    ts /= 60;
-    uint8_t m = ts % 60;
-    ts /= 60;
-    if (ts > 99) {
-        fprintf(stderr, "timestamp overflow (more than 99 hours).\n");
-        exit(1);
-    } else if (snprintf(buf, 12, "%02d:%02d:%02d:%02d", (uint8_t)ts, m, sec, frame) != 11) {
-        fprintf(stderr, "Timecode lead to invalid format: %s\n", buf);
-        exit(1);
-    }
-}
-
-void write_xml(eventlist_t *evlist, vfmt_t *vfmt, frate_t *frate, char *bdnfile,
-               char *track_name, char *language, opts_t *args)
-{
-    int x_margin = args->render_w < args->frame_w ? (args->frame_w-args->render_w) >> 1 : 0;
-    int y_margin = args->render_h < args->frame_h ? (args->frame_h-args->render_h) >> 1 : 0;
-
+    char *key, *val, *end;
     int i;
-    char buf_in[12], buf_out[12];
-    FILE *of;
-    if (bdnfile == NULL) {
-        of = fopen("bdn.xml", "w");
-    } else {
-        of = fopen(bdnfile, "w");
-    }
 
-    if (of == NULL) {
-        perror("Error opening output XML file.");
-        exit(1);
-    }
+    *xmlfile = NULL;
+    *liq_params = 0;
+    *check_every = 0;
+    args->outdir = NULL;
+    args->digest = 0;
 
-    frame_to_tc(evlist->events[0]->in + args->offset, frate, buf_in);
-    frame_to_tc(evlist->events[evlist->nmemb - 1]->out + args->offset, frate, buf_out);
-
-    fprintf(of, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-                "<BDN Version=\"0.93\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:noNamespaceSchemaLocation=\"BD-03-006-0093b BDN File Format.xsd\">\n"
-                "  <Description>\n"
-                "    <Name Title=\"%s\" Content=\"\"/>\n"
-                "    <Language Code=\"%s\"/>\n"
-                "    <Format VideoFormat=\"%s\" FrameRate=\"%s\" DropFrame=\"False\"/>\n"
-                "    <Events LastEventOutTC=\"%s\" FirstEventInTC=\"%s\" ",
-            track_name, language, vfmt->name, frate->name, buf_out, buf_in);
-
-    //No idea what this ContentInTC truly means.
-    if (args->offset > 0)
-        frame_to_tc(1 + args->offset, frate, buf_in);
-
-    fprintf(of, "ContentInTC=\"%s\" ContentOutTC=\"%s\" NumberofEvents=\"%d\" Type=\"Graphic\"/>\n"
-                "  </Description>\n"
-                "  <Events>\n", buf_in, buf_out, evlist->nmemb);
-
-    for (i = 0; i < evlist->nmemb; i++) {
-        image_t *img = evlist->events[i];
-        frame_to_tc(img->in + args->offset, frate, buf_in);
-        frame_to_tc(img->out + args->offset, frate, buf_out);
-
-        fprintf(of, "    <Event Forced=\"False\" InTC=\"%s\" OutTC=\"%s\">\n",
-                buf_in, buf_out);
-        if (img->crops[0].x1 & 0xFF000000) {
-            fprintf(of, "      <Graphic Width=\"%d\" Height=\"%d\" X=\"%d\" Y=\"%d\">%08d.png</Graphic>\n",
-                    img->subx2 - img->subx1 + 1, img->suby2 - img->suby1 + 1,
-                    img->subx1+x_margin, img->suby1+y_margin, i);
-        } else {
-            for (uint8_t ki = 0; ki < 2; ki++) {
-                fprintf(of, "      <Graphic Width=\"%d\" Height=\"%d\" X=\"%d\" Y=\"%d\">%08d_%d.png</Graphic>\n",
-                    img->crops[ki].x2 - img->crops[ki].x1 + 1, img->crops[ki].y2 - img->crops[ki].y1 + 1,
-                    img->crops[ki].x1+x_margin, img->crops[ki].y1+y_margin, i, ki);
+    for (key = strtok(spec, ","); key; key = strtok(NULL, ",")) {
+        val = strchr(key, '=');
+        if (val)
+            *val++ = 0;
+        if (!strcmp(key, "rleopt")) {
+            args->rle_optimise = val == NULL || strtol(val, NULL, 10) > 0;
+            continue;
+        } else if (val == NULL || *val == 0) {
+            printf("Invalid output profile parameter: %s.\n", key);
+            exit(1);
+        }
+
+        if (!strcmp(key, "dir")) {
+            args->outdir = val;
+        } else if (!strcmp(key, "xml")) {
+            *xmlfile = val;
+        } else if (!strcmp(key, "quantize")) {
+            args->quantize = (uint16_t)strtol(val, &end, 10);
+            if (*end || args->quantize > 256) {
+                printf("Colours must be within [0; 256] incl.\n");
+                exit(1);
+            }
+            args->quantize += (1 == args->quantize);
+        } else if (!strcmp(key, "split")) {
+            args->split = (uint8_t)strtol(val, &end, 10);
+            if (*end || args->split > 4) {
+                printf("Invalid split mode.\n");
+                exit(1);
+            }
+        } else if (!strcmp(key, "splitmargin")) {
+            args->splitmargin[0] = args->splitmargin[1] = 0;
+            parse_margins(val, args->splitmargin);
+        } else if (!strcmp(key, "liq-speed")) {
+            liqargs->speed = (uint8_t)strtol(val, NULL, 10);
+            if (liqargs->speed == 0 || liqargs->speed > 10) {
+                printf("Invalid libimagequant speed setting. Must be within [1; 10] incl.\n");
+                exit(1);
+            }
+            *liq_params = 1;
+        } else if (!strcmp(key, "liq-quality")) {
+            liqargs->max_quality = (uint8_t)strtol(val, NULL, 10);
+            if (liqargs->max_quality == 0 || liqargs->max_quality > 100) {
+                printf("Invalid libimagequant max quality setting. Must be within [1; 100] incl.\n");
+                exit(1);
+            }
+            *liq_params = 1;
+        } else if (!strcmp(key, "liq-max-speed")) {
+            liqargs->max_speed = (uint8_t)strtol(val, NULL, 10);
+            if (liqargs->max_speed == 0 || liqargs->max_speed > 10) {
+                printf("Invalid libimagequant max speed setting. Must be within [1; 10] incl.\n");
+                exit(1);
+            }
+            *liq_params = 1;
+        } else if (!strcmp(key, "liq-min-quality")) {
+            liqargs->min_quality = (uint8_t)strtol(val, NULL, 10);
+            if (liqargs->min_quality == 0 || liqargs->min_quality > 100) {
+                printf("Invalid libimagequant min quality setting. Must be within [1; 100] incl.\n");
+                exit(1);
             }
+            *liq_params = 1;
+        } else if (!strcmp(key, "liq-dither")) {
+            liqargs->dither = (float)strtod(val, NULL);
+            if (liqargs->dither > 1.0f || liqargs->dither < 0.0f) {
+                printf("Dithering level must be within [0.0; 1.0] incl.\n");
+                exit(1);
+            }
+            *liq_params = 1;
+        } else if (!strcmp(key, "format")) {
+            for (i = 0; vfmts[i].name != NULL && strcasecmp(vfmts[i].name, val); i++);
+            if (vfmts[i].name == NULL) {
+                printf("Invalid output profile video format: %s.\n", val);
+                exit(1);
+            }
+            //The geometry is derived from the format by a2b_setup_opts().
+            *vfmt = &vfmts[i];
+            args->render_w = args->render_h = 0;
+            args->storage_w = args->storage_h = 0;
+        } else if (!strcmp(key, "check")) {
+            *check_every = (uint32_t)strtol(val, &end, 10);
+            if (*end || *check_every == 0) {
+                printf("Invalid native render check interval.\n");
+                exit(1);
+            }
+        } else if (!strcmp(key, "rle-budget")) {
+            args->rle_budget = (uint32_t)strtol(val, &end, 10);
+            if (*end || args->rle_budget < 1024 || args->rle_budget > 16777215) {
+                printf("RLE budget must be within [1024; 16777215] bytes incl.\n");
+                exit(1);
+            }
+        } else {
+            printf("Unknown output profile parameter: %s.\n", key);
+            exit(1);
         }
-        fprintf(of, "    </Event>\n");
     }
 
-    fprintf(of, "  </Events>\n</BDN>\n");
-    fclose(of);
+    if (args->outdir == NULL) {
+        printf("Output profiles require an output directory (dir=...).\n");
+        exit(1);
+    }
 }
 
 int main(int argc, char *argv[])
@@ -230,21 +290,60 @@ int main(int argc, char *argv[])
     char *language = "und";
     char *video_format = "1080p";
     char *frame_rate = "23.976";
-    int i;
+    char *sockpath = NULL;
+    char *mergefile = NULL;
+    char *cpfile = NULL;
+    char *planfile = NULL;
+    char *metricsfile = NULL;
+    char *tracefile = NULL;
+    int progress_fd = -1;
+    progress_t progress;
+    trace_t trace;
+    a2b_trace_t tracer;
+    a2b_monitor_t monitor;
+    a2b_stats_t stats;
+    checkpoint_t cp;
+    opts_t rargs;
+    char *profile_specs[A2B_MAX_PROFILES];
+    char *profile_xml[A2B_MAX_PROFILES];
+    vfmt_t *profile_vfmt[A2B_MAX_PROFILES];
+    int nspecs = 0;
+    long opt_val;
+    char *reportfile = NULL;
+    char *baselinefile = NULL;
+    double tolerance = 10.0;
+    struct timespec t_start, t_end;
+    int workers = 0;
+    int i, r;
     frate_t *frate = NULL;
+    frate_t *rates[MAX_FRAME_RATES];
+    opts_t rate_args[MAX_FRAME_RATES];
+    int nrates = 0;
+    uint16_t merge_max;
     vfmt_t *vfmt = NULL;
-    eventlist_t *evlist;
+    eventlist_t *evlists[A2B_MAX_PROFILES];
+    a2b_ctx_t *ctx;
+    a2b_sink_t sinks[A2B_MAX_PROFILES];
+    a2b_profile_t profiles[A2B_MAX_PROFILES];
+    char xmlpath[FILENAME_MAX];
+    int err;
 
     uint8_t liq_params = 0;
     uint8_t copy_name = 0;
     uint8_t negative_offset = 0;
+    uint8_t has_range = 0;
+    uint8_t resume = 0;
     uint8_t offset_vals[4];
+    uint8_t start_vals[4];
+    uint8_t end_vals[4];
     memset(offset_vals, 0, sizeof(offset_vals));
 
     opts_t args;
     liqopts_t liqargs = {.dither=1.0f, .speed=4, .max_quality=99};
+    const a2b_logger_t logger = {.message = log_message};
 
     memset(&args, 0, sizeof(args));
+    a2b_set_logger(&logger);
 
     if (argc < 2) {
         die_usage(argv[0]);
@@ -275,10 +374,36 @@ int main(int argc, char *argv[])
         {"hinting",      no_argument,       0, OPT_ARG_HINTING},
         {"keep-dupes",   no_argument,       0, OPT_ARG_KEEPDUPES},
         {"full-bitmaps", no_argument,       0, OPT_ARG_FULLBITMAPS},
+        {"colorspace",   required_argument, 0, OPT_ARG_COLORSPACE},
+        {"nits",         required_argument, 0, OPT_ARG_NITS},
+        {"memory-limit", required_argument, 0, OPT_ARG_MEMLIMIT},
+        {"checkpoint",   required_argument, 0, OPT_ARG_CHECKPOINT},
+        {"resume",       no_argument,       0, OPT_ARG_RESUME},
+        {"merge-threshold", required_argument, 0, OPT_ARG_MERGETHR},
+        {"merge-max-frames", required_argument, 0, OPT_ARG_MERGEMAX},
+        {"start",        required_argument, 0, OPT_ARG_START},
+        {"end",          required_argument, 0, OPT_ARG_END},
+        {"index-base",   required_argument, 0, OPT_ARG_INDEXBASE},
+        {"merge",        required_argument, 0, OPT_ARG_MERGE},
+        {"profile",      required_argument, 0, OPT_ARG_PROFILE},
+        {"serve",        required_argument, 0, OPT_ARG_SERVE},
+        {"workers",      required_argument, 0, OPT_ARG_WORKERS},
+        {"report",       required_argument, 0, OPT_ARG_REPORT},
+        {"check-report", required_argument, 0, OPT_ARG_CHECKREPORT},
+        {"check-tolerance", required_argument, 0, OPT_ARG_CHECKTOL},
+        {"analyze",      required_argument, 0, OPT_ARG_ANALYZE},
+        {"event-index",  no_argument,       0, OPT_ARG_EVINDEX},
+        {"progress-fd",  required_argument, 0, OPT_ARG_PROGRESSFD},
+        {"metrics",      required_argument, 0, OPT_ARG_METRICS},
+        {"trace",        required_argument, 0, OPT_ARG_TRACE},
         {"version",      no_argument,       0, OPT_ARG_VERSION},
         {"liq-dither",   required_argument, 0, OPT_LIQ_DITHER},
         {"liq-quality",  required_argument, 0, OPT_LIQ_MAXQUAL},
         {"liq-speed",    required_argument, 0, OPT_LIQ_SPEED},
+        {"rle-budget",   required_argument, 0, OPT_LIQ_RLEBUDGET},
+        {"time-budget",  required_argument, 0, OPT_LIQ_TIMEBUDGET},
+        {"liq-max-speed", required_argument, 0, OPT_LIQ_MAXSPEED},
+        {"liq-min-quality", required_argument, 0, OPT_LIQ_MINQUAL},
         {0, 0, 0, 0}
     };
 
@@ -318,6 +443,24 @@ int main(int argc, char *argv[])
                     args.dimf = MAX(0.0f, MIN(1.0f, 1.0f - (args.dimf/100.0f)));
                 }
                 break;
+            case OPT_ARG_COLORSPACE:
+                for (i = 0; colorspaces[i] != NULL; i++)
+                    if (!strcasecmp(colorspaces[i], optarg))
+                        break;
+                if (colorspaces[i] == NULL) {
+                    printf("Invalid colour space, expected bt709, bt2020, bt2020-pq or bt2020-hlg.\n");
+                    exit(1);
+                }
+                args.colorspace = i;
+                break;
+            case OPT_ARG_NITS:
+                opt_val = strtol(optarg, NULL, 10);
+                if (opt_val < 48 || opt_val > 1000) {
+                    printf("Graphics white level must be within [48; 1000] nits incl.\n");
+                    exit(1);
+                }
+                args.nits = (uint16_t)opt_val;
+                break;
             case OPT_ARG_SQUAREPIX:
                 args.square_px = 1;
                 break;
@@ -330,6 +473,106 @@ int main(int argc, char *argv[])
             case OPT_ARG_FULLBITMAPS:
                 args.full_bitmaps = 1;
                 break;
+            case OPT_ARG_MEMLIMIT:
+                opt_val = strtol(optarg, NULL, 10);
+                if (opt_val < 64 || opt_val > 1048576) {
+                    printf("Memory limit must be within [64; 1048576] MiB.\n");
+                    exit(1);
+                }
+                args.memory_limit = (uint32_t)opt_val;
+                break;
+            case OPT_ARG_CHECKPOINT:
+                cpfile = optarg;
+                break;
+            case OPT_ARG_RESUME:
+                resume = 1;
+                break;
+            case OPT_ARG_MERGETHR:
+                opt_val = strtol(optarg, NULL, 10);
+                if (opt_val < 0 || opt_val > 255) {
+                    printf("Merge threshold must be within [0; 255] incl.\n");
+                    exit(1);
+                }
+                args.merge_threshold = (uint8_t)opt_val;
+                break;
+            case OPT_ARG_MERGEMAX:
+                opt_val = strtol(optarg, NULL, 10);
+                if (opt_val <= 0 || opt_val > 65535) {
+                    printf("Invalid maximum merge duration.\n");
+                    exit(1);
+                }
+                args.merge_max = (uint16_t)opt_val;
+                break;
+            case OPT_ARG_START:
+                tc_to_tcarray(optarg, start_vals);
+                has_range |= 1;
+                break;
+            case OPT_ARG_END:
+                tc_to_tcarray(optarg, end_vals);
+                has_range |= 2;
+                break;
+            case OPT_ARG_INDEXBASE:
+                args.index_base = (uint32_t)strtoul(optarg, NULL, 10);
+                if (args.index_base > 9999999) {
+                    printf("Invalid index base.\n");
+                    exit(1);
+                }
+                break;
+            case OPT_ARG_MERGE:
+                mergefile = optarg;
+                break;
+            case OPT_ARG_PROFILE:
+                if (nspecs >= A2B_MAX_PROFILES - 1) {
+                    printf("Too many output profiles (max: %d).\n", A2B_MAX_PROFILES - 1);
+                    exit(1);
+                }
+                profile_specs[nspecs++] = optarg;
+                break;
+            case OPT_ARG_SERVE:
+                sockpath = optarg;
+                break;
+            case OPT_ARG_REPORT:
+                reportfile = optarg;
+                args.digest = 1;
+                break;
+            case OPT_ARG_ANALYZE:
+                planfile = optarg;
+                args.analyze = 1;
+                break;
+            case OPT_ARG_EVINDEX:
+                args.bdn_index = 1;
+                break;
+            case OPT_ARG_PROGRESSFD:
+                opt_val = strtol(optarg, NULL, 10);
+                if (opt_val < 1 || opt_val > 65535 || fcntl((int)opt_val, F_GETFD) < 0) {
+                    printf("Invalid progress file descriptor.\n");
+                    exit(1);
+                }
+                progress_fd = (int)opt_val;
+                break;
+            case OPT_ARG_METRICS:
+                metricsfile = optarg;
+                break;
+            case OPT_ARG_TRACE:
+                tracefile = optarg;
+                break;
+            case OPT_ARG_CHECKREPORT:
+                baselinefile = optarg;
+                break;
+            case OPT_ARG_CHECKTOL:
+                tolerance = strtod(optarg, NULL);
+                if (tolerance < 0) {
+                    printf("Invalid report tolerance.\n");
+                    exit(1);
+                }
+                break;
+            case OPT_ARG_WORKERS:
+                workers = (int)strtol(optarg, NULL, 10);
+                if (workers <= 0 || workers > 256) {
+                    printf("Invalid worker count.\n");
+                    exit(1);
+                }
+                break;
             case 't':
                 track_name = optarg;
                 break;
@@ -441,6 +684,40 @@ int main(int argc, char *argv[])
                 }
                 liq_params |= 1;
                 break;
+            case OPT_LIQ_RLEBUDGET:
+                opt_val = strtol(optarg, NULL, 10);
+                if (opt_val < 1024 || opt_val > 16777215) {
+                    printf("RLE budget must be within [1024; 16777215] bytes incl.\n");
+                    exit(1);
+                }
+                args.rle_budget = (uint32_t)opt_val;
+                break;
+            case OPT_LIQ_TIMEBUDGET:
+            {
+                double budget = strtod(optarg, NULL);
+                if (budget <= 0.0 || budget > 86400.0) {
+                    printf("Time budget must be within ]0; 86400] seconds.\n");
+                    exit(1);
+                }
+                args.time_budget = (uint32_t)(budget*1000 + 0.5);
+                break;
+            }
+            case OPT_LIQ_MAXSPEED:
+                liqargs.max_speed = (uint8_t)strtol(optarg, NULL, 10);
+                if (liqargs.max_speed == 0 || liqargs.max_speed > 10) {
+                    printf("Invalid libimagequant max speed setting. Must be within [1; 10] incl. Default: 10.\n");
+                    exit(1);
+                }
+                liq_params |= 1;
+                break;
+            case OPT_LIQ_MINQUAL:
+                liqargs.min_quality = (uint8_t)strtol(optarg, NULL, 10);
+                if (liqargs.min_quality == 0 || liqargs.min_quality > 100) {
+                    printf("Invalid libimagequant min quality setting. Must be within [1; 100] incl. Default: max quality.\n");
+                    exit(1);
+                }
+                liq_params |= 1;
+                break;
             case OPT_ARG_VERSION:
                 printf("ass2bdnxml v" A2B_VERSION_STRING " (c) 2015 mia-0, (c) 2024 cubicibo\n");
                 exit(0);
@@ -451,6 +728,29 @@ int main(int argc, char *argv[])
         }
     }
 
+    if (mergefile) {
+        if (argc - optind < 1) {
+            printf("No BDN fragment to merge.\n");
+            exit(1);
+        }
+        return merge_xml(mergefile, (const char **)&argv[optind], argc - optind) ? 1 : 0;
+    }
+
+    if (sockpath) {
+        if (argc - optind != 0) {
+            printf("No input file allowed with --serve.\n");
+            exit(1);
+        }
+        if (workers == 0)
+            workers = MAX(1, (int)sysconf(_SC_NPROCESSORS_ONLN));
+        //The memory limit is shared by the workers, run fewer of them rather than starving each.
+        if (args.memory_limit) {
+            workers = MAX(1, MIN(workers, (int)(args.memory_limit / SERVE_WORKER_MIN_MB)));
+            args.memory_limit /= workers;
+        }
+        return serve(sockpath, workers, &args, &liqargs) ? 1 : 0;
+    }
+
     if (argc - optind == 1) {
         subfile = argv[optind];
     } else {
@@ -480,17 +780,35 @@ int main(int argc, char *argv[])
         bdnfile[len - i - 1] = 0;
     }
 
-    i = 0;
-    while (frates[i].name != NULL) {
-        if (!strcasecmp(frates[i].name, frame_rate))
-            frate = &frates[i];
-        i++;
-    }
+    //Comma separated rates, the first one is the main output.
+    for (const char *name = frame_rate; ; name++) {
+        const size_t len = strcspn(name, ",");
 
-    if (frate == NULL) {
-        printf("Invalid framerate.\n");
-        exit(1);
+        frate = NULL;
+        for (i = 0; frates[i].name != NULL; i++) {
+            if (strlen(frates[i].name) == len && !strncasecmp(frates[i].name, name, len))
+                frate = &frates[i];
+        }
+        if (frate == NULL) {
+            printf("Invalid framerate.\n");
+            exit(1);
+        }
+        for (i = 0; i < nrates; i++) {
+            if (rates[i] == frate) {
+                printf("Frame rate %s given twice.\n", frate->name);
+                exit(1);
+            }
+        }
+        if (nrates == MAX_FRAME_RATES) {
+            printf("At most %d frame rates.\n", MAX_FRAME_RATES);
+            exit(1);
+        }
+        rates[nrates++] = frate;
+        name += len;
+        if (*name == 0)
+            break;
     }
+    frate = rates[0];
 
     i = 0;
     while (vfmts[i].name != NULL) {
@@ -506,86 +824,207 @@ int main(int argc, char *argv[])
         printf("WARNING " A2B_LOG_PREFIX "2160p is NOT a valid BDN format. It is only provided for exotic exports like DCPs!\n");
     }
 
-    //frame_x is the normalized BD video container dimension
-    args.frame_h = vfmt->h;
-    args.frame_w = vfmt->w;
+    //Compute timing offset
+    args.offset = tcarray_to_frame(offset_vals, frate);
+    if (negative_offset)
+        args.offset *= -1;
+
+    //Tolerant merges extend events by one second at most unless specified
+    merge_max = args.merge_max;
+    if (args.merge_threshold && args.merge_max == 0)
+        args.merge_max = frate->rate;
 
-    uint8_t storage_set = args.storage_w != 0 || args.storage_h != 0;
-    if (args.anamorphic && (args.par > 0 || storage_set || args.square_px)) {
-        printf("Conflicting parameters: anamorphic flag set along PAR and/or storage dimension.\n");
-        exit(1);
-    } else if ((args.par > 0 && (storage_set || args.square_px)) || (storage_set && args.square_px)) {
-        printf("Conflicting parameters: storage dimension and pixel aspect ratio both configured.\n");
-        exit(1);
-    }
+    //Slice of the timeline to render, TC 00:00:00:00 is frame 1
+    if (has_range & 1)
+        args.start_frame = tcarray_to_frame(start_vals, frate) + 1;
+    if (has_range & 2)
+        args.end_frame = tcarray_to_frame(end_vals, frate) + 1;
 
-    if (vfmt->h <= 576) {
-        if (args.anamorphic) {
-            args.storage_w = vfmt->w_frame_anamorphic;
+    //Output profiles start from the main options, before those are validated.
+    for (i = 1; i <= nspecs; i++) {
+        uint8_t profile_liq_params;
+
+        profiles[i].args = args;
+        profiles[i].liqargs = liqargs;
+        profile_vfmt[i] = vfmt;
+        parse_profile(profile_specs[i-1], &profiles[i].args, &profiles[i].liqargs, &profile_xml[i], &profile_liq_params,
+                      &profile_vfmt[i], &profiles[i].check_every);
+        if (a2b_setup_opts(&profiles[i].args, &profiles[i].liqargs, profile_vfmt[i], profile_liq_params))
+            exit(1);
+        if (profiles[i].check_every && profile_vfmt[i] == vfmt) {
+            printf("Native render checks only apply to profiles of another video format.\n");
+            exit(1);
         }
-        if (args.square_px) {
-            args.par = vfmt->w / (double)vfmt->w_scaled;
+        if (mkdir(profiles[i].args.outdir, 0755) && errno != EEXIST) {
+            perror("Error creating output profile directory.");
+            exit(1);
         }
-    } else if (args.anamorphic || args.square_px) {
-        printf("Pixel stretch on non-SD output, aborting.\nUse \"--width-store DISPLAY_W --width-render SQUEEZED_W\" if absolutely needed.\n");
+    }
+
+    if (a2b_setup_opts(&args, &liqargs, vfmt, liq_params))
         exit(1);
+    profiles[0].args = args;
+    profiles[0].liqargs = liqargs;
+    profiles[0].check_every = 0;
+    profile_xml[0] = bdnfile;
+    profile_vfmt[0] = vfmt;
+
+    //Other frame rates: the same options with the timing in frames of the rate.
+    rate_args[0] = args;
+    for (r = 1; r < nrates; r++) {
+        rate_args[r] = args;
+        rate_args[r].offset = tcarray_to_frame(offset_vals, rates[r]);
+        if (negative_offset)
+            rate_args[r].offset *= -1;
+        if (args.merge_threshold && merge_max == 0)
+            rate_args[r].merge_max = rates[r]->rate;
+        rate_args[r].start_frame = (has_range & 1) ? tcarray_to_frame(start_vals, rates[r]) + 1 : 0;
+        rate_args[r].end_frame = (has_range & 2) ? tcarray_to_frame(end_vals, rates[r]) + 1 : 0;
     }
 
-    // render_size is ASS frame_size
-    if (args.render_w == 0)
-        args.render_w = args.fullscreen ? vfmt->w_frame_fullscreen : args.frame_w;
-    if (args.render_h == 0)
-        args.render_h = args.frame_h;
-    if (args.render_h > args.frame_h || args.render_w > args.frame_w) {
-        printf("Cannot render to dimensions larger than container format (%dx%d) > (%dx%d).\n", args.render_w, args.render_h, args.frame_w, args.frame_h);
+    if (baselinefile && !reportfile) {
+        printf("--check-report requires --report.\n");
+        exit(1);
+    }
+    if (resume && !cpfile) {
+        printf("--resume requires --checkpoint.\n");
+        exit(1);
+    } else if (cpfile && nspecs) {
+        printf("--checkpoint cannot be used with output profiles.\n");
         exit(1);
+    } else if (planfile && (cpfile || nspecs || reportfile)) {
+        printf("--analyze does not write any output, it excludes --checkpoint, --profile and --report.\n");
+        exit(1);
+    } else if (nrates > 1 && (cpfile || nspecs || planfile)) {
+        printf("Several frame rates cannot be combined with --checkpoint, --profile or --analyze.\n");
+        exit(1);
+    }
+    //Each rate is rendered again, only the PNGs of events with identical pixels are shared.
+    args.shared_pngs = nrates > 1;
+    rate_args[0].shared_pngs = args.shared_pngs;
+    for (r = 1; r < nrates; r++)
+        rate_args[r].shared_pngs = 1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    for (i = 0; i < MAX(nspecs + 1, nrates); i++) {
+        evlists[i] = calloc(1, sizeof(eventlist_t));
+        sinks[i].event = eventlist_sink;
+        sinks[i].priv = evlists[i];
+        profiles[i].sink = &sinks[i];
     }
 
-    if ((args.splitmargin[1] > (args.render_h*3)/4) || (args.splitmargin[0] > (args.render_w*3)/4)) {
-        printf("Excessive split margin(s), should be less than 3/4 of video height or width.\n");
+    //The render continues after the checkpointed events, the XML is written with the user options.
+    rargs = args;
+    if (cpfile) {
+        if (resume && (err = checkpoint_load(cpfile, subfile, &args, evlists[0])) < 0) {
+            printf(A2B_LOG_PREFIX "resume failed: %s.\n", a2b_strerror(err));
+            exit(1);
+        }
+        if (evlists[0]->nmemb) {
+            rargs.start_frame = MAX(rargs.start_frame, evlists[0]->events[evlists[0]->nmemb - 1]->out);
+            rargs.index_base += evlists[0]->nmemb;
+        }
+        if (checkpoint_open(&cp, cpfile, subfile, &args, evlists[0]))
+            exit(1);
+        sinks[0].event = checkpoint_sink;
+        sinks[0].priv = &cp;
+    }
+
+    ctx = a2b_init(&rargs, &liqargs, &err);
+    if (ctx == NULL) {
+        printf(A2B_LOG_PREFIX "initialisation failed: %s.\n", a2b_strerror(err));
         exit(1);
     }
 
-    //1:1 to render size unless specified otherwise
-    if (args.storage_h == 0) {
-        args.storage_h = args.render_h;
+    if (progress_fd >= 0) {
+        //The reader may go away, the conversion goes on.
+        signal(SIGPIPE, SIG_IGN);
+        progress_init(&progress, progress_fd, frate, args.offset);
+        monitor.progress = progress_write;
+        monitor.priv = &progress;
+        monitor.interval_ms = PROGRESS_INTERVAL_MS;
+        a2b_set_monitor(ctx, &monitor);
     }
-    if (args.storage_w == 0) {
-        args.storage_w = args.render_w;
+    if (tracefile) {
+        if (trace_open(&trace, tracefile, nspecs + 1))
+            exit(1);
+        tracer.span = trace_write;
+        tracer.priv = &trace;
+        a2b_set_trace(ctx, &tracer);
     }
 
-    //Compute timing offset
-    args.offset = tcarray_to_frame(offset_vals, frate);
-    if (negative_offset)
-        args.offset *= -1;
+    //Every profile is encoded from the same render and event detection.
+    if (nspecs)
+        err = render_subs_profiles(ctx, subfile, frate, profiles, nspecs + 1);
+    else
+        err = render_subs(ctx, subfile, frate, &sinks[0]);
+    a2b_get_stats(ctx, &stats);
 
-    //The bdn encodes the squeeze
-    if (args.par > 0)
-        args.par = 1.0/args.par;
+    //Full conversion at each other rate, the PNG numbers follow those of the previous one and events
+    //already encoded keep theirs.
+    for (r = 1; r < nrates && err == A2B_OK; r++) {
+        a2b_stats_t rate_stats;
 
-    if (args.quantize) {
-        //RLE optimise discard palette entry zero, we have one less usable entry, ensure we don't overshoot the 8-bit id
-        if (args.rle_optimise && args.quantize >= 256) {
-            args.quantize -= 1;
-            printf(A2B_LOG_PREFIX "RLE optimisation enabled, only using %d colors.\n", args.quantize);
-        }
-        liqargs.max_quality = MAX(0, MIN(100, liqargs.max_quality));
-    } else if (liq_params) {
-        printf("Set up libimagequant parameters but not using --quantize.\n");
-        exit(1);
+        rate_args[r].index_base = rate_args[r-1].index_base + evlists[r-1]->nmemb;
+        progress.frate = rates[r];
+        progress.offset = rate_args[r].offset;
+        err = a2b_configure(ctx, &rate_args[r], &liqargs);
+        if (err == A2B_OK)
+            err = render_subs(ctx, subfile, rates[r], &sinks[r]);
+        a2b_get_stats(ctx, &rate_stats);
+        stats.frames += rate_stats.frames;
+        stats.images += rate_stats.images;
+        stats.bytes += rate_stats.bytes;
     }
+    a2b_done(ctx);
+    if (cpfile)
+        checkpoint_close(&cp);
+    if (tracefile && trace_close(&trace) && err == A2B_OK)
+        err = A2B_ERR_REPORT;
 
-    evlist = render_subs(subfile, frate, &args, &liqargs);
+    //Analysis only: the plan replaces the BDN.
+    if (planfile && err == A2B_OK)
+        err = write_plan(evlists[0], planfile, subfile, vfmt, frate, &args, &stats);
+
+    for (i = 0; i <= nspecs && err == A2B_OK && !planfile; i++) {
+        if (i && profile_xml[i] == NULL) {
+            snprintf(xmlpath, sizeof(xmlpath), "%s/bdn.xml", profiles[i].args.outdir);
+            profile_xml[i] = xmlpath;
+        }
+        err = write_xml(evlists[i], profile_vfmt[i], frate, profile_xml[i], track_name, language, &profiles[i].args);
+    }
+    for (r = 1; r < nrates && err == A2B_OK; r++) {
+        rate_xml_name(xmlpath, sizeof(xmlpath), bdnfile, rates[r]);
+        err = write_xml(evlists[r], vfmt, rates[r], xmlpath, track_name, language, &rate_args[r]);
+    }
 
-    write_xml(evlist, vfmt, frate, bdnfile, track_name, language, &args);
+    if (err == A2B_OK && reportfile) {
+        clock_gettime(CLOCK_MONOTONIC, &t_end);
+        err = write_report(evlists[0], &args, reportfile, (t_end.tv_sec - t_start.tv_sec)*1000 + (t_end.tv_nsec - t_start.tv_nsec)/1000000,
+                           report_peak_rss_kb());
+        if (err == A2B_OK && baselinefile)
+            err = check_report(reportfile, baselinefile, tolerance);
+    }
 
-    for (i = 0; i < evlist->nmemb; i++) {
-        free(evlist->events[i]);
+    if (metricsfile) {
+        clock_gettime(CLOCK_MONOTONIC, &t_end);
+        if (write_metrics(metricsfile, subfile, &stats, (t_end.tv_sec - t_start.tv_sec)*1000 + (t_end.tv_nsec - t_start.tv_nsec)/1000000,
+                          report_peak_rss_kb(), err) && err == A2B_OK)
+            err = A2B_ERR_REPORT;
     }
 
-    free(evlist);
+    for (i = 0; i < MAX(nspecs + 1, nrates); i++)
+        eventlist_free(evlists[i]);
+
+    if (args.memory_limit)
+        printf(A2B_LOG_PREFIX "peak memory usage: %ld MiB (limit: %u MiB).\n", report_peak_rss_kb() / 1024, args.memory_limit);
     if (bdnfile)
         free(bdnfile);
 
+    if (err != A2B_OK) {
+        printf(A2B_LOG_PREFIX "conversion failed: %s.\n", a2b_strerror(err));
+        return 1;
+    }
     return 0;
 }
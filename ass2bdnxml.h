@@ -0,0 +1,238 @@
+#ifndef ASS2BDNXML_H
+#define ASS2BDNXML_H
+
+#include <stdint.h>
+
+#define A2B_MAX_PROFILES (8)
+
+typedef struct BoundingBox_s {
+    int x1;
+    int x2;
+    int y1;
+    int y2;
+} BoundingBox_t;
+
+typedef struct frate_s {
+    char *name;
+    int rate;
+    uint64_t num;
+    uint64_t denom;
+} frate_t;
+
+typedef struct vfmt_s {
+    char *name;
+    int w_frame_anamorphic;
+    int w_frame_fullscreen;
+    int w_scaled;
+    int w;
+    int h;
+} vfmt_t;
+
+typedef struct image_s {
+    int width, height, stride;
+    int subx1, suby1, subx2, suby2;
+    uint64_t in, out;
+    BoundingBox_t crops[2];
+    uint8_t *buffer;
+    uint8_t *alpha;    //alpha of buffer as a plane, width bytes per row
+    int *spans;        //first and last visible x of each row, width and -1 if none
+    uint64_t digest[2];
+    uint32_t rendered; //frames sampled over the event duration
+    uint32_t opaque;   //visible pixels, only computed with args->analyze
+    uint32_t ref;      //events back to the one whose PNGs are shown moved, 0: own PNGs
+} image_t;
+
+typedef struct eventlist_s {
+    int size, nmemb;
+    image_t **events;
+} eventlist_t;
+
+typedef struct opts_s {
+    double par;
+    float dimf;
+    int64_t offset;
+    uint64_t start_frame; //first rendered frame, 0: start of the track
+    uint64_t end_frame;   //frame at which rendering stops, 0: end of the track
+    uint32_t index_base;  //number of the first PNG
+    uint32_t memory_limit; //MiB, sizes the libass caches and buffers, 0: libass defaults
+    uint32_t rle_budget;   //max estimated PGS RLE bytes per object, quantized output only, 0: no limit
+    uint32_t time_budget;  //ms of wall time for the conversion, the quantizer effort adapts to it, 0: fixed effort
+    int frame_w;
+    int frame_h;
+    int render_w;
+    int render_h;
+    int storage_w;
+    int storage_h;
+    uint16_t quantize;
+    uint16_t splitmargin[2];
+    uint8_t merge_threshold; //max per-channel error to extend an event, 0: exact
+    uint16_t merge_max;      //max number of frames an event is extended over with merge_threshold, 0: unbounded
+    uint16_t nits;           //graphics white level of PQ and HLG output, 0: 203 (BT.2408)
+    uint32_t hinting      : 1;
+    uint32_t split        : 4;
+    uint32_t rle_optimise : 1;
+    uint32_t keep_dupes   : 1;
+    uint32_t anamorphic   : 1; //8
+    uint32_t fullscreen   : 1;
+    uint32_t square_px    : 1;
+    uint32_t downsampled  : 4;
+    uint32_t dim_flag     : 1;
+    uint32_t full_bitmaps : 1; //8
+    uint32_t digest       : 1;
+    uint32_t analyze      : 1;
+    uint32_t colorspace   : 2; //a2b_colorspace_t
+    uint32_t shared_pngs  : 1; //render_subs(): new events identical to one encoded before on the context reuse its PNGs, a2b_configure() forgets them on another outdir or a lower index_base
+    uint32_t bdn_index    : 1; //write_xml(): also write the binary event index, next to the BDN XML with the .idx extension
+    uint32_t _bpad1       : 10;
+    const char *fontdir;
+    const char *outdir;
+} opts_t;
+
+//Output colour space of the bitmaps, the subtitles are authored in BT.709.
+typedef enum a2b_colorspace_e {
+    A2B_CS_BT709      = 0,
+    A2B_CS_BT2020     = 1, //SDR, BT.1886 transfer
+    A2B_CS_BT2020_PQ  = 2, //SMPTE ST 2084
+    A2B_CS_BT2020_HLG = 3, //ARIB STD-B67
+} a2b_colorspace_t;
+
+typedef struct liqopts_s {
+    float dither;
+    uint8_t speed;
+    uint8_t max_quality;
+    uint8_t max_speed;   //time budget bounds: fastest speed, 0: 10
+    uint8_t min_quality; //lowest max quality, 0: max_quality
+} liqopts_t;
+
+typedef enum a2b_error_e {
+    A2B_OK           = 0,
+    A2B_ERR_ALLOC    = -1,
+    A2B_ERR_ARGS     = -2,
+    A2B_ERR_LIBASS   = -3,
+    A2B_ERR_TRACK    = -4,
+    A2B_ERR_QUANTIZE = -5,
+    A2B_ERR_PNG      = -6,
+    A2B_ERR_XML      = -7,
+    A2B_ERR_SINK     = -8,
+    A2B_ERR_REPORT   = -9,
+} a2b_error_t;
+
+//Receives every event once its timing is final, in increasing index order.
+//A non-zero return value aborts the rendering with A2B_ERR_SINK.
+typedef struct a2b_sink_s {
+    int (*event)(void *priv, const image_t *ev, int index);
+    void *priv;
+} a2b_sink_t;
+
+//Output variant encoded from the shared render of render_subs_profiles().
+//Only the encoding options are used: quantize, split, splitmargin, rle_optimise,
+//rle_budget, digest, outdir and index_base. The rendering options are those of the context.
+//A smaller render_w and render_h derive the variant by downscaling the render, e.g. 1080p from 2160p.
+typedef struct a2b_profile_s {
+    opts_t args;
+    liqopts_t liqargs;
+    a2b_sink_t *sink;
+    uint32_t check_every; //derived variants: compare every Nth event to a native render, 0: never
+} a2b_profile_t;
+
+//Renderer state (libass, libimagequant), one per concurrent conversion.
+typedef struct a2b_ctx_s a2b_ctx_t;
+
+//Counters of the last render_subs() call.
+typedef struct a2b_stats_s {
+    uint64_t frames;
+    uint64_t events;
+    uint64_t images;
+    uint64_t bytes;
+} a2b_stats_t;
+
+//Position of the last render_subs() call, see a2b_monitor_t.
+typedef struct a2b_progress_s {
+    uint64_t frame;    //current frame, numbered like start_frame
+    uint64_t first;    //first frame of the rendered range
+    uint64_t last;     //end of the timeline: end_frame, or the end of the last event of the track
+    a2b_stats_t stats; //counters so far, images and bytes over all outputs
+    int done;          //final report, sent once the last event is emitted
+} a2b_progress_t;
+
+//Called from the rendering thread at most every interval_ms, then once when done.
+typedef struct a2b_monitor_s {
+    void (*progress)(void *priv, const a2b_progress_t *progress);
+    void *priv;
+    uint32_t interval_ms;
+} a2b_monitor_t;
+
+//Stages timed by a2b_trace_t.
+typedef enum a2b_stage_e {
+    A2B_STAGE_FRAME    = 0, //one sampled frame: render, blend and diff
+    A2B_STAGE_RENDER   = 1, //ass_render_frame()
+    A2B_STAGE_BLEND    = 2,
+    A2B_STAGE_DIFF     = 3, //comparison to the previous event
+    A2B_STAGE_ENCODE   = 4, //one event of one output variant
+    A2B_STAGE_SPLIT    = 5,
+    A2B_STAGE_QUANTIZE = 6, //palette, quantization and RLE budget
+    A2B_STAGE_WRITE    = 7, //PNG files of the event
+} a2b_stage_t;
+
+//One timed call, see a2b_trace_t.
+typedef struct a2b_span_s {
+    uint64_t start_us; //CLOCK_MONOTONIC
+    uint64_t frame;    //sampled frame, numbered like start_frame, or first frame of the encoded event
+    uint32_t dur_us;
+    uint32_t stage;    //a2b_stage_t
+    int32_t event;     //index of the event, -1: none
+    int32_t variant;   //output variant of the encoding stages, -1: shared render
+    int32_t w, h;      //event area, 0 if empty
+} a2b_span_t;
+
+//Called from the rendering thread. The spans of a frame are reported once its event is known,
+//those of the encoding threads once every variant has encoded the event.
+typedef struct a2b_trace_s {
+    void (*span)(void *priv, const a2b_span_t *span);
+    void *priv;
+} a2b_trace_t;
+
+//Severity of a library message, see a2b_logger_t.
+typedef enum a2b_log_level_e {
+    A2B_LOG_ERROR = 0,
+    A2B_LOG_WARN  = 1,
+    A2B_LOG_INFO  = 2,
+} a2b_log_level_t;
+
+//Receives the diagnostics of the library, one line without a trailing newline per call.
+//Called from the rendering and encoding threads.
+typedef struct a2b_logger_s {
+    void (*message)(void *priv, int level, const char *msg);
+    void *priv;
+} a2b_logger_t;
+
+extern frate_t frates[];
+extern vfmt_t vfmts[];
+extern const char *colorspaces[];
+extern const char *a2b_stages[];
+
+//Process wide, set it before any other call. Messages are discarded until a logger is set, NULL removes it.
+void a2b_set_logger(const a2b_logger_t *logger);
+
+a2b_ctx_t *a2b_init(opts_t *args, liqopts_t *liqargs, int *err);
+int a2b_configure(a2b_ctx_t *ctx, opts_t *args, liqopts_t *liqargs);
+void a2b_get_stats(a2b_ctx_t *ctx, a2b_stats_t *stats);
+void a2b_set_monitor(a2b_ctx_t *ctx, const a2b_monitor_t *monitor);
+void a2b_set_trace(a2b_ctx_t *ctx, const a2b_trace_t *trace);
+void a2b_done(a2b_ctx_t *ctx);
+const char *a2b_strerror(int err);
+int a2b_setup_opts(opts_t *args, liqopts_t *liqargs, vfmt_t *vfmt, uint8_t liq_params);
+
+int render_subs(a2b_ctx_t *ctx, const char *subfile, frate_t *frate, a2b_sink_t *sink);
+int render_subs_profiles(a2b_ctx_t *ctx, const char *subfile, frate_t *frate, a2b_profile_t *profiles, int nprofiles);
+
+int eventlist_set(eventlist_t *list, const image_t *ev, int index);
+int eventlist_sink(void *priv, const image_t *ev, int index);
+void eventlist_free(eventlist_t *list);
+
+int frame_to_tc(uint64_t frames, frate_t *fps, char *buf);
+int write_xml(eventlist_t *evlist, vfmt_t *vfmt, frate_t *frate, const char *bdnfile,
+              const char *track_name, const char *language, opts_t *args);
+int merge_xml(const char *bdnfile, const char **fragments, int nfrags);
+
+#endif
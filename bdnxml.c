@@ -0,0 +1,654 @@
+/*
+ * Copyright © 2015, Martin Herkt <lachs0r@srsfckn.biz>
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or  without fee is hereby granted,  provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH  REGARD  TO  THIS  SOFTWARE  INCLUDING  ALL  IMPLIED  WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL,  DIRECT,  INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING  FROM LOSS OF USE,  DATA OR PROFITS,  WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Additional changes: Copyright © 2024, cubicibo
+ * The same agreement notice applies.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+frate_t frates[] = {
+    {"23.976",24, 24000, 1001},
+    {"24", 24, 24, 1},
+    {"25", 25, 25, 1},
+    {"29.97", 30, 30000, 1001},
+    {"50", 50, 50, 1},
+    {"59.94", 60, 60000, 1001},
+    {"60", 60, 60, 1},
+    {NULL, 0, 0, 0}
+};
+
+vfmt_t vfmts[] = {
+    {"1080p", 1920, 1440, -1, 1920, 1080},
+    {"1080i", 1920, 1440, -1, 1920, 1080},
+    {"720p",  1280, 960,  -1, 1280, 720},
+    {"576p",  1024, 720, 768, 720,  576}, //Secondary videostream only
+    {"576i",  1024, 720, 768, 720,  576},
+    {"480p",  852,  720, 640, 720,  480}, //Secondary videostream only
+    {"480i",  852,  720, 640, 720,  480},
+    {"2160p", 3840, 2160, -1, 3840, 2160},//Illegal, provided out of sympathy
+    {NULL, 0, 0, 0, 0, 0}
+};
+
+//Indexed by a2b_colorspace_t
+const char *colorspaces[] = {"bt709", "bt2020", "bt2020-pq", "bt2020-hlg", NULL};
+
+//Indexed by a2b_stage_t
+const char *a2b_stages[] = {"frame", "render", "blend", "diff", "encode", "split", "quantize", "write", NULL};
+
+#define LOG_LINE_LENGTH (1024)
+
+static a2b_logger_t logger;
+
+void a2b_set_logger(const a2b_logger_t *lg)
+{
+    if (lg)
+        logger = *lg;
+    else
+        memset(&logger, 0, sizeof(logger));
+}
+
+void a2b_vlog(int level, const char *fmt, va_list va)
+{
+    char msg[LOG_LINE_LENGTH];
+
+    if (logger.message == NULL)
+        return;
+    vsnprintf(msg, sizeof(msg), fmt, va);
+    logger.message(logger.priv, level, msg);
+}
+
+void a2b_log(int level, const char *fmt, ...)
+{
+    va_list va;
+
+    va_start(va, fmt);
+    a2b_vlog(level, fmt, va);
+    va_end(va);
+}
+
+//Derive the rendering geometry from the BDN video format and validate the options.
+int a2b_setup_opts(opts_t *args, liqopts_t *liqargs, vfmt_t *vfmt, uint8_t liq_params)
+{
+    //frame_x is the normalized BD video container dimension
+    args->frame_h = vfmt->h;
+    args->frame_w = vfmt->w;
+
+    uint8_t storage_set = args->storage_w != 0 || args->storage_h != 0;
+    if (args->anamorphic && (args->par > 0 || storage_set || args->square_px)) {
+        a2b_log(A2B_LOG_ERROR, "Conflicting parameters: anamorphic flag set along PAR and/or storage dimension.");
+        return A2B_ERR_ARGS;
+    } else if ((args->par > 0 && (storage_set || args->square_px)) || (storage_set && args->square_px)) {
+        a2b_log(A2B_LOG_ERROR, "Conflicting parameters: storage dimension and pixel aspect ratio both configured.");
+        return A2B_ERR_ARGS;
+    }
+
+    if (vfmt->h <= 576) {
+        if (args->anamorphic) {
+            args->storage_w = vfmt->w_frame_anamorphic;
+        }
+        if (args->square_px) {
+            args->par = vfmt->w / (double)vfmt->w_scaled;
+        }
+    } else if (args->anamorphic || args->square_px) {
+        a2b_log(A2B_LOG_ERROR, "Pixel stretch on non-SD output, aborting.\nUse \"--width-store DISPLAY_W --width-render SQUEEZED_W\" if absolutely needed.");
+        return A2B_ERR_ARGS;
+    }
+
+    if (args->nits && args->colorspace < A2B_CS_BT2020_PQ) {
+        a2b_log(A2B_LOG_ERROR, "A graphics white level is only used with PQ or HLG output.");
+        return A2B_ERR_ARGS;
+    }
+
+    if (args->end_frame && args->end_frame <= MAX(1, args->start_frame)) {
+        a2b_log(A2B_LOG_ERROR, "Slice end must be after its start.");
+        return A2B_ERR_ARGS;
+    }
+
+    // render_size is ASS frame_size
+    if (args->render_w == 0)
+        args->render_w = args->fullscreen ? vfmt->w_frame_fullscreen : args->frame_w;
+    if (args->render_h == 0)
+        args->render_h = args->frame_h;
+    if (args->render_h > args->frame_h || args->render_w > args->frame_w) {
+        a2b_log(A2B_LOG_ERROR, "Cannot render to dimensions larger than container format (%dx%d) > (%dx%d).", args->render_w, args->render_h, args->frame_w, args->frame_h);
+        return A2B_ERR_ARGS;
+    }
+
+    if ((args->splitmargin[1] > (args->render_h*3)/4) || (args->splitmargin[0] > (args->render_w*3)/4)) {
+        a2b_log(A2B_LOG_ERROR, "Excessive split margin(s), should be less than 3/4 of video height or width.");
+        return A2B_ERR_ARGS;
+    }
+
+    //1:1 to render size unless specified otherwise
+    if (args->storage_h == 0) {
+        args->storage_h = args->render_h;
+    }
+    if (args->storage_w == 0) {
+        args->storage_w = args->render_w;
+    }
+
+    //The bdn encodes the squeeze
+    if (args->par > 0)
+        args->par = 1.0/args->par;
+
+    if (args->quantize) {
+        //RLE optimise discard palette entry zero, we have one less usable entry, ensure we don't overshoot the 8-bit id
+        if (args->rle_optimise && args->quantize >= 256) {
+            args->quantize -= 1;
+            a2b_log(A2B_LOG_INFO, "RLE optimisation enabled, only using %d colors.", args->quantize);
+        }
+        liqargs->max_quality = MAX(0, MIN(100, liqargs->max_quality));
+        //Effort bounds of the time budget, the configured effort is the best one.
+        liqargs->max_speed = liqargs->max_speed ? MAX(liqargs->max_speed, liqargs->speed) : 10;
+        liqargs->min_quality = liqargs->min_quality ? MIN(liqargs->min_quality, liqargs->max_quality) : liqargs->max_quality;
+    } else if (liq_params) {
+        a2b_log(A2B_LOG_ERROR, "Set up libimagequant parameters but not using --quantize.");
+        return A2B_ERR_ARGS;
+    } else if (args->rle_budget) {
+        a2b_log(A2B_LOG_ERROR, "RLE budget requires --quantize.");
+        return A2B_ERR_ARGS;
+    } else if (args->time_budget) {
+        a2b_log(A2B_LOG_ERROR, "Time budget requires --quantize.");
+        return A2B_ERR_ARGS;
+    }
+    return A2B_OK;
+}
+
+int frame_to_tc(uint64_t frames, frate_t *fps, char *buf)
+{
+    frames--;
+    uint8_t  frame = frames % fps->rate;
+    uint64_t ts = frames/fps->rate;
+    uint8_t  sec = ts % 60;
+    ts /= 60;
+    uint8_t m = ts % 60;
+    ts /= 60;
+    if (ts > 99) {
+        a2b_log(A2B_LOG_ERROR, "timestamp overflow (more than 99 hours).");
+        return A2B_ERR_XML;
+    } else if (snprintf(buf, 12, "%02d:%02d:%02d:%02d", (uint8_t)ts, m, sec, frame) != 11) {
+        a2b_log(A2B_LOG_ERROR, "Timecode lead to invalid format: %s", buf);
+        return A2B_ERR_XML;
+    }
+    return A2B_OK;
+}
+
+//Binary event index (opts_t.bdn_index), little-endian, fixed size records sorted by in frame:
+//header: magic[8] version:u16 header_size:u16 record_size:u16 flags:u16 nevents:u32 index_base:u32
+//        fps_num:u64 fps_denom:u64 offset:i64 frame_w:u16 frame_h:u16, padded to INDEX_HEADER_SIZE
+//record: in:u64 out:u64 (frames from TC 0) hash:u64 png:u32 size[2]:u32 {x y w h}[2]:u16 ngraphics:u8 flags:u8 palette[2]:u16,
+//        padded to INDEX_RECORD_SIZE
+#define INDEX_MAGIC "A2BINDEX"
+#define INDEX_VERSION (1)
+#define INDEX_HEADER_SIZE (64)
+#define INDEX_RECORD_SIZE (64)
+#define INDEX_FLAG_SHARED (0x01)
+
+#define FNV64_INIT (0xcbf29ce484222325ULL)
+#define FNV64_PRIME (0x100000001b3ULL)
+
+static uint8_t *put_le(uint8_t *p, uint64_t v, int bytes)
+{
+    for (int k = 0; k < bytes; k++, v >>= 8)
+        *p++ = (uint8_t)v;
+    return p;
+}
+
+//Size, palette entries and FNV-1a hash of a PNG file, 0 for the palette of a RGBA one.
+static int index_png(const char *fname, uint32_t *size, uint16_t *palette, uint64_t *hash)
+{
+    uint8_t buf[16384];
+    size_t len;
+    FILE *fp = fopen(fname, "rb");
+
+    if (fp == NULL) {
+        a2b_log(A2B_LOG_ERROR, "index: cannot open %s.", fname);
+        return A2B_ERR_XML;
+    }
+
+    //The chunks before IDAT, PLTE is among them with a palette.
+    *palette = 0;
+    if (fseek(fp, 8, SEEK_SET) == 0) {
+        while (fread(buf, 1, 8, fp) == 8 && memcmp(buf + 4, "IDAT", 4)) {
+            const uint32_t clen = (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+
+            if (!memcmp(buf + 4, "PLTE", 4)) {
+                *palette = clen / 3;
+                break;
+            }
+            if (fseek(fp, (long)clen + 4, SEEK_CUR))
+                break;
+        }
+    }
+
+    rewind(fp);
+    *size = 0;
+    *hash = FNV64_INIT;
+    while ((len = fread(buf, 1, sizeof(buf), fp)) > 0) {
+        for (size_t k = 0; k < len; k++)
+            *hash = (*hash ^ buf[k]) * FNV64_PRIME;
+        *size += len;
+    }
+    fclose(fp);
+    return A2B_OK;
+}
+
+//Index file of a BDN XML: the .xml extension replaced by .idx.
+static void index_name(char *buf, size_t size, const char *bdnfile)
+{
+    const char *ext = strrchr(bdnfile, '.');
+
+    if (ext == NULL || strchr(ext, '/') || strcmp(ext, ".xml"))
+        ext = bdnfile + strlen(bdnfile);
+    snprintf(buf, size, "%.*s.idx", (int)(ext - bdnfile), bdnfile);
+}
+
+//Geometry and timing of every event for the tools that would otherwise parse the BDN XML
+//and open the PNGs. The events are sorted by time, consumers may binary search the records.
+static int write_index(eventlist_t *evlist, frate_t *frate, const char *bdnfile, const opts_t *args,
+                       int x_margin, int y_margin)
+{
+    const char *dir = args->outdir ? args->outdir : "";
+    const char *sep = (dir[0] && dir[strlen(dir)-1] != '/') ? "/" : "";
+    char fname[FILENAME_MAX];
+    uint8_t (*records)[INDEX_RECORD_SIZE];
+    uint8_t header[INDEX_HEADER_SIZE] = {0}, *p;
+    int i, ret = A2B_OK;
+    FILE *of;
+
+    records = calloc(evlist->nmemb, INDEX_RECORD_SIZE);
+    if (records == NULL)
+        return A2B_ERR_ALLOC;
+
+    for (i = 0; i < evlist->nmemb && ret == A2B_OK; i++) {
+        const image_t *img = evlist->events[i];
+        const int split = !(img->crops[0].x1 & 0xFF000000);
+        const int png = i - (int)img->ref + args->index_base;
+        BoundingBox_t gfx[2] = {{img->subx1, img->subx2, img->suby1, img->suby2}};
+        uint32_t size[2] = {0, 0};
+        uint16_t palette[2] = {0, 0};
+        uint64_t hash = FNV64_INIT, part_hash;
+
+        if (split)
+            memcpy(gfx, img->crops, sizeof(gfx));
+
+        //A shared PNG of this list was indexed with its own event.
+        if (img->ref && img->ref <= (uint32_t)i) {
+            memcpy(records[i], records[i - img->ref], INDEX_RECORD_SIZE);
+        } else {
+            for (int k = 0; k <= split && ret == A2B_OK; k++) {
+                if (split)
+                    snprintf(fname, sizeof(fname), "%s%s%08d_%d.png", dir, sep, png, k);
+                else
+                    snprintf(fname, sizeof(fname), "%s%s%08d.png", dir, sep, png);
+                if ((ret = index_png(fname, &size[k], &palette[k], &part_hash)) == A2B_OK)
+                    hash = (hash ^ part_hash) * FNV64_PRIME;
+            }
+            p = put_le(records[i] + 16, hash, 8);
+            p = put_le(p, png, 4);
+            p = put_le(p, size[0], 4);
+            p = put_le(p, size[1], 4);
+            p = records[i] + 54;
+            p = put_le(p, palette[0], 2);
+            p = put_le(p, palette[1], 2);
+        }
+
+        p = put_le(records[i], img->in + args->offset - 1, 8);
+        p = put_le(p, img->out + args->offset - 1, 8);
+        p = records[i] + 36;
+        for (int k = 0; k < 2; k++) {
+            const int used = k <= split;
+            p = put_le(p, used ? gfx[k].x1 + x_margin : 0, 2);
+            p = put_le(p, used ? gfx[k].y1 + y_margin : 0, 2);
+            p = put_le(p, used ? gfx[k].x2 - gfx[k].x1 + 1 : 0, 2);
+            p = put_le(p, used ? gfx[k].y2 - gfx[k].y1 + 1 : 0, 2);
+        }
+        *p++ = 1 + split;
+        *p++ = img->ref ? INDEX_FLAG_SHARED : 0;
+    }
+
+    if (ret == A2B_OK) {
+        memcpy(header, INDEX_MAGIC, 8);
+        p = put_le(header + 8, INDEX_VERSION, 2);
+        p = put_le(p, INDEX_HEADER_SIZE, 2);
+        p = put_le(p, INDEX_RECORD_SIZE, 2);
+        p = put_le(p, 0, 2);
+        p = put_le(p, evlist->nmemb, 4);
+        p = put_le(p, args->index_base, 4);
+        p = put_le(p, frate->num, 8);
+        p = put_le(p, frate->denom, 8);
+        p = put_le(p, (uint64_t)args->offset, 8);
+        p = put_le(p, args->frame_w, 2);
+        p = put_le(p, args->frame_h, 2);
+
+        index_name(fname, sizeof(fname), bdnfile ? bdnfile : "bdn.xml");
+        of = fopen(fname, "wb");
+        if (of == NULL || fwrite(header, INDEX_HEADER_SIZE, 1, of) != 1 ||
+            fwrite(records, INDEX_RECORD_SIZE, evlist->nmemb, of) != (size_t)evlist->nmemb) {
+            a2b_log(A2B_LOG_ERROR, "Error writing event index file: %s.", strerror(errno));
+            ret = A2B_ERR_XML;
+        }
+        if (of && fclose(of) && ret == A2B_OK) {
+            a2b_log(A2B_LOG_ERROR, "Error writing event index file: %s.", strerror(errno));
+            ret = A2B_ERR_XML;
+        }
+    }
+    free(records);
+    return ret;
+}
+
+int write_xml(eventlist_t *evlist, vfmt_t *vfmt, frate_t *frate, const char *bdnfile,
+              const char *track_name, const char *language, opts_t *args)
+{
+    int x_margin = args->render_w < args->frame_w ? (args->frame_w-args->render_w) >> 1 : 0;
+    int y_margin = args->render_h < args->frame_h ? (args->frame_h-args->render_h) >> 1 : 0;
+
+    int i, ret = A2B_OK;
+    char buf_in[12], buf_out[12];
+    FILE *of;
+
+    if (evlist->nmemb == 0) {
+        a2b_log(A2B_LOG_ERROR, "no event to write.");
+        return A2B_ERR_XML;
+    }
+
+    if (bdnfile == NULL) {
+        of = fopen("bdn.xml", "w");
+    } else {
+        of = fopen(bdnfile, "w");
+    }
+
+    if (of == NULL) {
+        a2b_log(A2B_LOG_ERROR, "Error opening output XML file: %s.", strerror(errno));
+        return A2B_ERR_XML;
+    }
+
+    if (frame_to_tc(evlist->events[0]->in + args->offset, frate, buf_in) ||
+        frame_to_tc(evlist->events[evlist->nmemb - 1]->out + args->offset, frate, buf_out)) {
+        fclose(of);
+        return A2B_ERR_XML;
+    }
+
+    fprintf(of, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                "<BDN Version=\"0.93\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:noNamespaceSchemaLocation=\"BD-03-006-0093b BDN File Format.xsd\">\n"
+                "  <Description>\n"
+                "    <Name Title=\"%s\" Content=\"\"/>\n"
+                "    <Language Code=\"%s\"/>\n"
+                "    <Format VideoFormat=\"%s\" FrameRate=\"%s\" DropFrame=\"False\"/>\n"
+                "    <Events LastEventOutTC=\"%s\" FirstEventInTC=\"%s\" ",
+            track_name, language, vfmt->name, frate->name, buf_out, buf_in);
+
+    //No idea what this ContentInTC truly means.
+    if (args->offset > 0)
+        frame_to_tc(1 + args->offset, frate, buf_in);
+
+    fprintf(of, "ContentInTC=\"%s\" ContentOutTC=\"%s\" NumberofEvents=\"%d\" Type=\"Graphic\"/>\n"
+                "  </Description>\n"
+                "  <Events>\n", buf_in, buf_out, evlist->nmemb);
+
+    for (i = 0; i < evlist->nmemb; i++) {
+        image_t *img = evlist->events[i];
+        if (frame_to_tc(img->in + args->offset, frate, buf_in) ||
+            frame_to_tc(img->out + args->offset, frate, buf_out)) {
+            ret = A2B_ERR_XML;
+            break;
+        }
+
+        fprintf(of, "    <Event Forced=\"False\" InTC=\"%s\" OutTC=\"%s\">\n",
+                buf_in, buf_out);
+        if (img->crops[0].x1 & 0xFF000000) {
+            fprintf(of, "      <Graphic Width=\"%d\" Height=\"%d\" X=\"%d\" Y=\"%d\">%08d.png</Graphic>\n",
+                    img->subx2 - img->subx1 + 1, img->suby2 - img->suby1 + 1,
+                    img->subx1+x_margin, img->suby1+y_margin, i - (int)img->ref + args->index_base);
+        } else {
+            for (uint8_t ki = 0; ki < 2; ki++) {
+                fprintf(of, "      <Graphic Width=\"%d\" Height=\"%d\" X=\"%d\" Y=\"%d\">%08d_%d.png</Graphic>\n",
+                    img->crops[ki].x2 - img->crops[ki].x1 + 1, img->crops[ki].y2 - img->crops[ki].y1 + 1,
+                    img->crops[ki].x1+x_margin, img->crops[ki].y1+y_margin, i - (int)img->ref + args->index_base, ki);
+            }
+        }
+        fprintf(of, "    </Event>\n");
+    }
+
+    fprintf(of, "  </Events>\n</BDN>\n");
+    fclose(of);
+
+    if (ret == A2B_OK && args->bdn_index)
+        ret = write_index(evlist, frate, bdnfile, args, x_margin, y_margin);
+    return ret;
+}
+
+//BDN fragments merge
+
+#define BDN_LINE_LENGTH (1024)
+
+typedef struct bdn_graphic_s {
+    int w, h, x, y;
+    char name[FILENAME_MAX];
+} bdn_graphic_t;
+
+typedef struct bdn_event_s {
+    char forced[8];
+    char in[12], out[12];
+    int frag;
+    int ngfx;
+    bdn_graphic_t gfx[2];
+} bdn_event_t;
+
+static void frag_dir(const char *path, char *dir)
+{
+    const char *slash = strrchr(path, '/');
+    const char *bslash = strrchr(path, '\\');
+
+    if (bslash > slash)
+        slash = bslash;
+    if (slash == NULL) {
+        dir[0] = 0;
+    } else {
+        snprintf(dir, FILENAME_MAX, "%.*s", (int)(slash - path + 1), path);
+    }
+}
+
+//Byte comparison of two PNGs, 1 if identical.
+static int same_file(const char *dir_a, const char *name_a, const char *dir_b, const char *name_b)
+{
+    char path[FILENAME_MAX];
+    char buf_a[4096], buf_b[4096];
+    size_t len_a, len_b;
+    FILE *fa, *fb;
+    int same = 1;
+
+    snprintf(path, sizeof(path), "%s%s", dir_a, name_a);
+    fa = fopen(path, "rb");
+    snprintf(path, sizeof(path), "%s%s", dir_b, name_b);
+    fb = fopen(path, "rb");
+
+    if (fa == NULL || fb == NULL) {
+        same = 0;
+    } else {
+        do {
+            len_a = fread(buf_a, 1, sizeof(buf_a), fa);
+            len_b = fread(buf_b, 1, sizeof(buf_b), fb);
+            if (len_a != len_b || memcmp(buf_a, buf_b, len_a))
+                same = 0;
+        } while (same && len_a);
+    }
+    if (fa)
+        fclose(fa);
+    if (fb)
+        fclose(fb);
+    return same;
+}
+
+static int same_graphics(const bdn_event_t *a, const char *dir_a, const bdn_event_t *b, const char *dir_b)
+{
+    if (a->ngfx != b->ngfx || strcmp(a->forced, b->forced))
+        return 0;
+    for (int k = 0; k < a->ngfx; k++) {
+        const bdn_graphic_t *ga = &a->gfx[k], *gb = &b->gfx[k];
+        if (ga->w != gb->w || ga->h != gb->h || ga->x != gb->x || ga->y != gb->y)
+            return 0;
+        if (!same_file(dir_a, ga->name, dir_b, gb->name))
+            return 0;
+    }
+    return 1;
+}
+
+//Concatenate BDN XML fragments rendered over consecutive slices of the same track.
+//Events of consecutive fragments that meet at the slice boundary with identical
+//graphics are joined. Graphics are referenced by name: the PNGs of all fragments
+//are expected in the directory of the merged BDN.
+int merge_xml(const char *bdnfile, const char **fragments, int nfrags)
+{
+    char line[BDN_LINE_LENGTH];
+    char header[3][BDN_LINE_LENGTH];
+    char content_in[12] = "";
+    char dirs[2][FILENAME_MAX];
+    bdn_event_t *events = NULL, *ev = NULL;
+    int nmemb = 0, size = 0, frag_first;
+    int ret = A2B_OK;
+    FILE *fp, *of;
+
+    memset(header, 0, sizeof(header));
+
+    for (int f = 0; f < nfrags && ret == A2B_OK; f++) {
+        fp = fopen(fragments[f], "r");
+        if (fp == NULL) {
+            a2b_log(A2B_LOG_ERROR, "Error opening BDN fragment: %s.", strerror(errno));
+            ret = A2B_ERR_XML;
+            break;
+        }
+        frag_first = nmemb;
+        ev = NULL;
+
+        while (fgets(line, sizeof(line), fp)) {
+            char *tag = line + strspn(line, " \t");
+
+            if (!strncmp(tag, "<Name ", 6) || !strncmp(tag, "<Language ", 10) || !strncmp(tag, "<Format ", 8)) {
+                int k = tag[1] == 'N' ? 0 : (tag[1] == 'L' ? 1 : 2);
+                if (f == 0) {
+                    snprintf(header[k], sizeof(header[k]), "%s", tag);
+                } else if (k == 2 && strcmp(header[k], tag)) {
+                    a2b_log(A2B_LOG_ERROR, "merge: %s has a different video format or frame rate.", fragments[f]);
+                    ret = A2B_ERR_XML;
+                    break;
+                }
+            } else if (!strncmp(tag, "<Events ", 8)) {
+                char *cin = strstr(tag, "ContentInTC=\"");
+                if (f == 0 && cin)
+                    sscanf(cin, "ContentInTC=\"%11[^\"]", content_in);
+            } else if (!strncmp(tag, "<Event ", 7)) {
+                if (nmemb == size) {
+                    size = size ? size * 2 : 256;
+                    bdn_event_t *tmp = realloc(events, size * sizeof(bdn_event_t));
+                    if (tmp == NULL) {
+                        ret = A2B_ERR_ALLOC;
+                        break;
+                    }
+                    events = tmp;
+                }
+                ev = &events[nmemb];
+                memset(ev, 0, sizeof(bdn_event_t));
+                ev->frag = f;
+                if (sscanf(tag, "<Event Forced=\"%7[^\"]\" InTC=\"%11[^\"]\" OutTC=\"%11[^\"]\">", ev->forced, ev->in, ev->out) != 3) {
+                    a2b_log(A2B_LOG_ERROR, "merge: invalid event in %s: %.*s", fragments[f], (int)strcspn(tag, "\r\n"), tag);
+                    ret = A2B_ERR_XML;
+                    break;
+                }
+                //TCs are zero-padded and fixed length, ordering is lexicographic
+                if (nmemb && strcmp(ev->in, events[nmemb-1].out) < 0) {
+                    a2b_log(A2B_LOG_ERROR, "merge: %s overlaps the previous fragment or is out of order (%s < %s).",
+                            fragments[f], ev->in, events[nmemb-1].out);
+                    ret = A2B_ERR_XML;
+                    break;
+                }
+                nmemb++;
+            } else if (!strncmp(tag, "<Graphic ", 9) && ev) {
+                bdn_graphic_t *gfx = &ev->gfx[ev->ngfx];
+                if (ev->ngfx >= 2 || sscanf(tag, "<Graphic Width=\"%d\" Height=\"%d\" X=\"%d\" Y=\"%d\">%[^<]",
+                                            &gfx->w, &gfx->h, &gfx->x, &gfx->y, gfx->name) != 5) {
+                    a2b_log(A2B_LOG_ERROR, "merge: invalid graphic in %s: %.*s", fragments[f], (int)strcspn(tag, "\r\n"), tag);
+                    ret = A2B_ERR_XML;
+                    break;
+                }
+                ev->ngfx++;
+            }
+        }
+        fclose(fp);
+
+        //Join the events that were cut at the boundary between this fragment and the previous.
+        if (ret == A2B_OK && frag_first > 0 && frag_first < nmemb) {
+            bdn_event_t *prev = &events[frag_first - 1], *next = &events[frag_first];
+
+            frag_dir(fragments[prev->frag], dirs[0]);
+            frag_dir(fragments[f], dirs[1]);
+            if (!strcmp(prev->out, next->in) && same_graphics(prev, dirs[0], next, dirs[1])) {
+                memcpy(prev->out, next->out, sizeof(prev->out));
+                memmove(next, next + 1, (nmemb - frag_first - 1) * sizeof(bdn_event_t));
+                nmemb--;
+            }
+        }
+    }
+
+    if (ret == A2B_OK && nmemb == 0) {
+        a2b_log(A2B_LOG_ERROR, "merge: no event to write.");
+        ret = A2B_ERR_XML;
+    }
+
+    if (ret == A2B_OK) {
+        of = fopen(bdnfile, "w");
+        if (of == NULL) {
+            a2b_log(A2B_LOG_ERROR, "Error opening output XML file: %s.", strerror(errno));
+            ret = A2B_ERR_XML;
+        }
+    }
+
+    if (ret == A2B_OK) {
+        fprintf(of, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                    "<BDN Version=\"0.93\" xmlns:xsi=\"http://www.w3.org/2001/XMLSchema-instance\" xsi:noNamespaceSchemaLocation=\"BD-03-006-0093b BDN File Format.xsd\">\n"
+                    "  <Description>\n"
+                    "    %s"
+                    "    %s"
+                    "    %s"
+                    "    <Events LastEventOutTC=\"%s\" FirstEventInTC=\"%s\" "
+                    "ContentInTC=\"%s\" ContentOutTC=\"%s\" NumberofEvents=\"%d\" Type=\"Graphic\"/>\n"
+                    "  </Description>\n"
+                    "  <Events>\n", header[0], header[1], header[2], events[nmemb-1].out, events[0].in,
+                    content_in[0] ? content_in : events[0].in, events[nmemb-1].out, nmemb);
+
+        for (int i = 0; i < nmemb; i++) {
+            fprintf(of, "    <Event Forced=\"%s\" InTC=\"%s\" OutTC=\"%s\">\n", events[i].forced, events[i].in, events[i].out);
+            for (int k = 0; k < events[i].ngfx; k++) {
+                bdn_graphic_t *gfx = &events[i].gfx[k];
+                fprintf(of, "      <Graphic Width=\"%d\" Height=\"%d\" X=\"%d\" Y=\"%d\">%s</Graphic>\n",
+                        gfx->w, gfx->h, gfx->x, gfx->y, gfx->name);
+            }
+            fprintf(of, "    </Event>\n");
+        }
+        fprintf(of, "  </Events>\n</BDN>\n");
+        fclose(of);
+        a2b_log(A2B_LOG_INFO, "merged %d fragment(s) into %d event(s).", nfrags, nmemb);
+    }
+    free(events);
+    return ret;
+}
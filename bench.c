@@ -0,0 +1,424 @@
+/* Copyright © 2024, cubicibo
+ * The same agreement notice as ass2bdnxml.c applies.
+ */
+
+//Kernel microbenchmark. The renderer is included as a whole to reach its static kernels.
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "render.c"
+
+#define BENCH_HEADER "# ass2bdnxml bench v1"
+#define BENCH_MIN_SAMPLES (5)
+#define BENCH_MAX_SAMPLES (1000)
+#define BENCH_MAX_INPUTS (16)
+#define BENCH_GLYPH_W (40)
+#define BENCH_GLYPH_H (56)
+
+typedef struct bench_s {
+    const char *name;
+    image_t *frame;
+    image_t *prev;
+    ASS_Image *images;
+    opts_t args;
+    liqopts_t liqargs;
+    a2b_enc_t enc;
+    a2b_pal_t pal;
+    a2b_lut_t lut;
+    a2b_comp_t comp;
+    ASS_Image *karaoke;
+    char pngfile[FILENAME_MAX_LENGTH];
+    uint64_t min_ns;
+    FILE *out;
+} bench_t;
+
+typedef void (*bench_fn_t)(bench_t *b);
+
+//Results of the pure kernels, so the calls are not optimised out.
+static volatile uint32_t bench_sink;
+
+static const struct {
+    const char *name;
+    int w, h;
+} bench_sizes[] = {
+    {"720p", 1280, 720},
+    {"1080p", 1920, 1080},
+    {"2160p", 3840, 2160},
+};
+
+//Share of the frame area covered by glyphs, in percent.
+static const int bench_densities[] = {2, 10, 40};
+
+static uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+//Run a kernel until both the minimum sample count and time are reached, one result line per kernel.
+static void bench_run(bench_t *b, const char *kernel, bench_fn_t fn, uint64_t pixels)
+{
+    uint64_t samples[BENCH_MAX_SAMPLES];
+    uint64_t total = 0, t0;
+    int n = 0;
+
+    fn(b); //warm-up
+    while (n < BENCH_MAX_SAMPLES && (n < BENCH_MIN_SAMPLES || total < b->min_ns)) {
+        t0 = bench_now_ns();
+        fn(b);
+        samples[n] = bench_now_ns() - t0;
+        total += samples[n++];
+    }
+    qsort(samples, n, sizeof(uint64_t), cmp_u64);
+
+    const uint64_t median = samples[n/2];
+    fprintf(b->out, "kernel %s input %s pixels %" PRIu64 " samples %d median_ns %" PRIu64 " min_ns %" PRIu64
+            " ns_per_pixel %.4f mpix_per_s %.2f\n", kernel, b->name, pixels, n, median, samples[0],
+            median/(double)MAX(1, pixels), pixels*1000.0/(double)MAX(1, median));
+    fflush(b->out);
+}
+
+static uint32_t bench_rand(uint32_t *state)
+{
+    *state = *state*1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+//Anti-aliased blob standing for a glyph: coverage falls off over one pixel at the edge.
+static uint8_t *bench_glyph(int w, int h, int grow, uint32_t *seed)
+{
+    uint8_t *bitmap = malloc(w*h);
+    const float rx = w/2.0f - 1.0f, ry = h/2.0f - 1.0f;
+    const float hole = 0.25f + (bench_rand(seed) % 100)/400.0f;
+
+    if (bitmap == NULL)
+        return NULL;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const float dx = (x - w/2.0f + 0.5f)/rx, dy = (y - h/2.0f + 0.5f)/ry;
+            const float d = sqrtf(dx*dx + dy*dy);
+            float cov = (1.0f - d)*MIN(rx, ry) + 0.5f;
+            //Counters of the glyph, filled by the border only.
+            if (!grow)
+                cov = MIN(cov, (d - hole)*MIN(rx, ry) + 0.5f);
+            bitmap[y*w + x] = (uint8_t)(255.0f*MAX(0.0f, MIN(1.0f, cov)));
+        }
+    }
+    return bitmap;
+}
+
+static void bench_free_images(ASS_Image *img)
+{
+    while (img) {
+        ASS_Image *next = img->next;
+        free(img->bitmap);
+        free(img);
+        img = next;
+    }
+}
+
+static int bench_count_images(const ASS_Image *img)
+{
+    int n = 0;
+
+    for (; img; img = img->next)
+        n++;
+    return n;
+}
+
+//Lines of glyphs from the bottom of the frame up, each glyph has a border and a fill image.
+static ASS_Image *bench_images(int w, int h, int density)
+{
+    const int scale = MAX(1, h/720);
+    const int gw = BENCH_GLYPH_W*scale, gh = BENCH_GLYPH_H*scale, border = 3*scale;
+    const uint64_t target = (uint64_t)w*h*density/100;
+    uint64_t covered = 0;
+    uint32_t seed = 0x2024;
+    ASS_Image *head = NULL, **tail = &head;
+
+    for (int y = h - gh - 2*border; y >= border && covered < target; y -= gh + 2*border) {
+        for (int x = w/16; x + gw + 2*border < w - w/16 && covered < target; x += gw + border) {
+            for (int layer = 0; layer < 2; layer++) {
+                ASS_Image *img = calloc(1, sizeof(ASS_Image));
+                if (img == NULL)
+                    return head;
+                img->w = layer ? gw : gw + 2*border;
+                img->h = layer ? gh : gh + 2*border;
+                img->stride = img->w;
+                img->dst_x = layer ? x + border : x;
+                img->dst_y = layer ? y + border : y;
+                img->color = layer ? 0xF0F0F000 : 0x10101040;
+                img->bitmap = bench_glyph(img->w, img->h, !layer, &seed);
+                *tail = img;
+                tail = &img->next;
+            }
+            covered += (uint64_t)(gw + border)*(gh + 2*border);
+        }
+    }
+    return head;
+}
+
+//Alpha plane, spans and event area of a captured bitmap, as blend() computes them.
+static void bench_bbox(image_t *frame)
+{
+    for (int y = 0; y < frame->height; y++) {
+        for (int x = 0; x < frame->width; x++)
+            frame->alpha[y*frame->width + x] = frame->buffer[y*frame->stride + x*4 + 3];
+        image_span_scan(frame, y);
+    }
+    image_span_bbox(frame);
+    if (frame->subx1 < 0) {
+        frame->subx1 = frame->suby1 = 0;
+        frame->subx2 = MIN(8, frame->width - 1);
+        frame->suby2 = MIN(8, frame->height - 1);
+    }
+}
+
+//32-bit RGBA PNG, e.g. the output of --full-bitmaps, as a frame.
+static image_t *bench_load_png(const char *fname)
+{
+    png_image png;
+    image_t *frame;
+
+    memset(&png, 0, sizeof(png));
+    png.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_file(&png, fname)) {
+        printf("Failed to read %s: %s.\n", fname, png.message);
+        return NULL;
+    }
+    png.format = PNG_FORMAT_BGRA;
+    frame = image_init(png.width, png.height);
+    if (frame == NULL ||
+        !png_image_finish_read(&png, NULL, frame->buffer, frame->stride, NULL)) {
+        printf("Failed to decode %s.\n", fname);
+        png_image_free(&png);
+        return NULL;
+    }
+    bench_bbox(frame);
+    return frame;
+}
+
+static void k_blend_single(bench_t *b)
+{
+    image_reset(b->frame);
+    for (ASS_Image *img = b->images; img; img = img->next)
+        blend_single(b->frame, img);
+}
+
+static void k_blend(bench_t *b)
+{
+    blend(b->frame, b->images, &b->args, &b->lut);
+}
+
+//Karaoke: the fill of one glyph changes colour at every frame.
+static void k_blend_incremental(bench_t *b)
+{
+    b->karaoke->color ^= 0x00FFFF00;
+    blend_incremental(&b->comp, b->frame, b->images, &b->args, &b->lut);
+}
+
+static void k_diff_frames(bench_t *b)
+{
+    bench_sink += diff_frames(b->frame, b->prev);
+}
+
+static void k_find_split(bench_t *b)
+{
+    bench_sink += find_split(b->frame, &b->args);
+}
+
+static void k_palette_exact(bench_t *b)
+{
+    palette_exact(&b->args, b->frame, &b->pal);
+}
+
+static void k_quantize_event(bench_t *b)
+{
+    liq_image *img = NULL;
+    liq_result *res = NULL;
+
+    quantize_event(&b->enc, b->frame, &img, &res);
+    liq_result_destroy(res);
+    liq_image_destroy(img);
+}
+
+static void k_write_png_palette(bench_t *b)
+{
+    write_png_palette(&b->enc, 0, b->frame, &b->pal, 0);
+}
+
+static void k_write_png(bench_t *b)
+{
+    uint64_t digest;
+    write_png(&b->enc, b->pngfile, b->frame, &digest);
+}
+
+//Kernels that only need the blended frame, shared by synthetic and captured inputs.
+static void bench_frame(bench_t *b)
+{
+    image_t *frame = b->frame;
+    const uint64_t area = (uint64_t)(frame->subx2 - frame->subx1 + 1)*(frame->suby2 - frame->suby1 + 1);
+    const uint64_t rows = (uint64_t)frame->width*(frame->suby2 - frame->suby1 + 1);
+    char kernel[32];
+
+    b->prev = image_init(frame->width, frame->height);
+    if (b->prev == NULL) {
+        printf("Failed to allocate frame.\n");
+        exit(1);
+    }
+    memcpy(b->prev->buffer, frame->buffer, (size_t)frame->stride*frame->height);
+    memcpy(b->prev->alpha, frame->alpha, (size_t)frame->width*frame->height);
+    memcpy(b->prev->spans, frame->spans, 2*sizeof(int)*frame->height);
+    memcpy(b->prev, frame, offsetof(image_t, out));
+    //Identical frames: the whole event area is compared.
+    bench_run(b, "diff_frames", k_diff_frames, area);
+
+    for (int split = 1; split <= 4; split++) {
+        b->args.split = split;
+        snprintf(kernel, sizeof(kernel), "find_split_%d", split);
+        bench_run(b, kernel, k_find_split, area);
+    }
+    b->args.split = 0;
+
+    //Scalar unique colour count of the lossless path, it stops at the first colour over the budget.
+    b->pal.bitmap = malloc(rows);
+    b->pal.zero = -1;
+    b->pal.shifted = 0;
+    if (b->pal.bitmap)
+        bench_run(b, "palette_exact_scalar", k_palette_exact, area);
+    bench_run(b, "quantize_event", k_quantize_event, rows);
+
+    //Palette of the event once, the writer alone is measured.
+    liq_image *img = NULL;
+    liq_result *res = NULL;
+    if (b->pal.bitmap && !quantize_event(&b->enc, frame, &img, &res)) {
+        palette_liq(&b->args, frame, img, res, b->liqargs.dither, &b->pal);
+        bench_run(b, "write_png_palette", k_write_png_palette, area);
+    }
+    liq_result_destroy(res);
+    liq_image_destroy(img);
+    free(b->pal.bitmap);
+
+    bench_run(b, "write_png", k_write_png, area);
+
+    image_free(b->prev);
+}
+
+static void die_usage(const char *name)
+{
+    printf("usage: %s [-t min_ms] [-o outdir] [-r results] [-i capture.png ...]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *inputs[BENCH_MAX_INPUTS];
+    const char *resultfile = NULL;
+    int ninputs = 0, opt;
+    char name[64];
+    bench_t b;
+
+    memset(&b, 0, sizeof(b));
+    b.min_ns = 200*1000000ULL;
+    b.args.quantize = 255;
+    b.args.dim_flag = 1;
+    b.args.dimf = 0.7f;
+    b.args.outdir = ".";
+    b.liqargs.dither = 1.0f;
+    b.liqargs.speed = 4;
+    b.liqargs.max_quality = 99;
+
+    while ((opt = getopt(argc, argv, "t:o:r:i:")) != -1) {
+        switch (opt) {
+            case 't':
+                b.min_ns = strtoull(optarg, NULL, 10)*1000000ULL;
+                break;
+            case 'o':
+                b.args.outdir = optarg;
+                break;
+            case 'r':
+                resultfile = optarg;
+                break;
+            case 'i':
+                if (ninputs == BENCH_MAX_INPUTS) {
+                    printf("Too many captured inputs.\n");
+                    exit(1);
+                }
+                inputs[ninputs++] = optarg;
+                break;
+            default:
+                die_usage(argv[0]);
+        }
+    }
+
+    b.out = resultfile ? fopen(resultfile, "w") : stdout;
+    if (b.out == NULL) {
+        perror("Error opening result file.");
+        exit(1);
+    }
+    lut_setup(&b.lut, &b.args);
+    b.enc.args = &b.args;
+    b.enc.liqargs = &b.liqargs;
+    b.enc.attr = liq_attr_setup(&b.args, &b.liqargs);
+    if (b.enc.attr == NULL)
+        exit(1);
+    image_fname(b.pngfile, &b.args, 0, -1);
+
+    fprintf(b.out, BENCH_HEADER "\n");
+    for (size_t s = 0; s < sizeof(bench_sizes)/sizeof(bench_sizes[0]); s++) {
+        for (size_t d = 0; d < sizeof(bench_densities)/sizeof(bench_densities[0]); d++) {
+            const uint64_t pixels = (uint64_t)bench_sizes[s].w*bench_sizes[s].h;
+
+            snprintf(name, sizeof(name), "%s-d%d", bench_sizes[s].name, bench_densities[d]);
+            b.name = name;
+            b.frame = image_init(bench_sizes[s].w, bench_sizes[s].h);
+            b.images = bench_images(bench_sizes[s].w, bench_sizes[s].h, bench_densities[d]);
+            if (b.frame == NULL || b.images == NULL) {
+                printf("Failed to set up input %s.\n", name);
+                exit(1);
+            }
+            //Both include clearing the frame, blend() adds the bounding box and dimming pass.
+            bench_run(&b, "blend_single", k_blend_single, pixels);
+            bench_run(&b, "blend", k_blend, pixels);
+            b.karaoke = b.images;
+            for (int k = 0; k < bench_count_images(b.images)/2 + 1 && b.karaoke->next; k++)
+                b.karaoke = b.karaoke->next;
+            if (comp_init(&b.comp, bench_sizes[s].w, bench_sizes[s].h, &b.lut)) {
+                printf("Failed to set up input %s.\n", name);
+                exit(1);
+            }
+            bench_run(&b, "blend_incremental", k_blend_incremental, pixels);
+            comp_free(&b.comp);
+            bench_frame(&b);
+
+            bench_free_images(b.images);
+            image_free(b.frame);
+        }
+    }
+
+    for (int k = 0; k < ninputs; k++) {
+        const char *base = strrchr(inputs[k], '/');
+        b.name = base ? base + 1 : inputs[k];
+        b.frame = bench_load_png(inputs[k]);
+        if (b.frame == NULL)
+            exit(1);
+        bench_frame(&b);
+        image_free(b.frame);
+    }
+
+    remove(b.pngfile);
+    liq_attr_destroy(b.enc.attr);
+    arena_free(&b.enc.arena);
+    if (resultfile)
+        fclose(b.out);
+    return 0;
+}
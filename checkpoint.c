@@ -0,0 +1,218 @@
+/* Copyright © 2024, cubicibo
+ * The same agreement notice as ass2bdnxml.c applies.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "checkpoint.h"
+
+#define CHECKPOINT_HEADER "# ass2bdnxml checkpoint v1"
+#define CHECKPOINT_LINE_LENGTH (1024)
+#define CHECKPOINT_SYNC_S (5)
+
+#define FNV64_INIT (0xcbf29ce484222325ULL)
+#define FNV64_PRIME (0x100000001b3ULL)
+
+static uint64_t fnv64(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = (const uint8_t *)data;
+    while (len--)
+        h = (h ^ *p++) * FNV64_PRIME;
+    return h;
+}
+
+//Options that change the output, a checkpoint may only be resumed with the same ones.
+static uint64_t opts_hash(const opts_t *args)
+{
+    uint64_t h = FNV64_INIT;
+    uint32_t flags = args->split | args->rle_optimise << 4 | args->anamorphic << 5 | args->fullscreen << 6 |
+                     args->square_px << 7 | args->downsampled << 8 | args->full_bitmaps << 12 | args->keep_dupes << 13 |
+                     args->colorspace << 14;
+
+    h = fnv64(h, &args->par, sizeof(args->par));
+    h = fnv64(h, &args->dimf, sizeof(args->dimf));
+    h = fnv64(h, &args->frame_w, sizeof(int)*6);
+    h = fnv64(h, &args->quantize, sizeof(args->quantize));
+    h = fnv64(h, args->splitmargin, sizeof(args->splitmargin));
+    h = fnv64(h, &args->merge_threshold, sizeof(args->merge_threshold));
+    h = fnv64(h, &args->merge_max, sizeof(args->merge_max));
+    h = fnv64(h, &args->index_base, sizeof(args->index_base));
+    h = fnv64(h, &args->rle_budget, sizeof(args->rle_budget));
+    h = fnv64(h, &args->nits, sizeof(args->nits));
+    h = fnv64(h, &flags, sizeof(flags));
+    return h;
+}
+
+static void png_name(char *fname, size_t len, const opts_t *args, int index, int part)
+{
+    const char *dir = args->outdir ? args->outdir : "";
+    const char *sep = (dir[0] && dir[strlen(dir)-1] != '/') ? "/" : "";
+
+    if (part < 0)
+        snprintf(fname, len, "%s%s%08d.png", dir, sep, index + args->index_base);
+    else
+        snprintf(fname, len, "%s%s%08d_%d.png", dir, sep, index + args->index_base, part);
+}
+
+//Hash of the PNG file(s) of an event, 0 if one is missing.
+static uint64_t event_files_hash(const opts_t *args, const image_t *ev, int index)
+{
+    char fname[FILENAME_MAX];
+    uint8_t buf[16384];
+    uint64_t h = FNV64_INIT;
+    int split = !(ev->crops[0].x1 & 0xFF000000);
+    size_t len;
+
+    for (int part = split ? 0 : -1; part < (split ? 2 : 0); part++) {
+        png_name(fname, sizeof(fname), args, index - (int)ev->ref, part);
+        FILE *fp = fopen(fname, "rb");
+        if (fp == NULL)
+            return 0;
+        while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+            h = fnv64(h, buf, len);
+        fclose(fp);
+    }
+    return h;
+}
+
+static void write_event(FILE *fp, const image_t *ev, int index, uint64_t files)
+{
+    fprintf(fp, "event %d %" PRIu64 " %" PRIu64 " %d %d %d %d", index, ev->in, ev->out,
+            ev->subx1, ev->suby1, ev->subx2, ev->suby2);
+    for (int k = 0; k < 2; k++)
+        fprintf(fp, " %d %d %d %d", ev->crops[k].x1, ev->crops[k].x2, ev->crops[k].y1, ev->crops[k].y2);
+    fprintf(fp, " %016" PRIx64 " %016" PRIx64 " %016" PRIx64 " %u\n", ev->digest[0], ev->digest[1], files, ev->ref);
+}
+
+static int write_header(FILE *fp, const char *subfile, const opts_t *args)
+{
+    return fprintf(fp, CHECKPOINT_HEADER "\ninput %s\nopts %016" PRIx64 "\n", subfile, opts_hash(args)) < 0;
+}
+
+int checkpoint_load(const char *cpfile, const char *subfile, const opts_t *args, eventlist_t *evlist)
+{
+    char line[CHECKPOINT_LINE_LENGTH], input[CHECKPOINT_LINE_LENGTH];
+    uint64_t hash, files = 0, last_files = 0;
+    int index, ret = A2B_OK;
+    image_t ev;
+    FILE *fp = fopen(cpfile, "r");
+
+    //Nothing to resume from
+    if (fp == NULL)
+        return 0;
+
+    if (fgets(line, sizeof(line), fp) == NULL || strncmp(line, CHECKPOINT_HEADER, strlen(CHECKPOINT_HEADER)) ||
+        fgets(input, sizeof(input), fp) == NULL || fgets(line, sizeof(line), fp) == NULL ||
+        sscanf(line, "opts %" SCNx64, &hash) != 1) {
+        printf(A2B_LOG_PREFIX "checkpoint: %s is not a valid checkpoint.\n", cpfile);
+        fclose(fp);
+        return A2B_ERR_ARGS;
+    }
+    input[strcspn(input, "\n")] = 0;
+    if (strcmp(input + 6, subfile) || hash != opts_hash(args)) {
+        printf(A2B_LOG_PREFIX "checkpoint: %s was made for another input or other options.\n", cpfile);
+        fclose(fp);
+        return A2B_ERR_ARGS;
+    }
+
+    //A truncated last line is the sign of an interruption, it is discarded.
+    memset(&ev, 0, sizeof(ev));
+    while (ret == A2B_OK && fgets(line, sizeof(line), fp) && strchr(line, '\n')) {
+        //Checkpoints without the reference count of moved events have own PNGs only.
+        ev.ref = 0;
+        if (sscanf(line, "event %d %" SCNu64 " %" SCNu64 " %d %d %d %d %d %d %d %d %d %d %d %d %" SCNx64 " %" SCNx64 " %" SCNx64 " %u",
+                   &index, &ev.in, &ev.out, &ev.subx1, &ev.suby1, &ev.subx2, &ev.suby2,
+                   &ev.crops[0].x1, &ev.crops[0].x2, &ev.crops[0].y1, &ev.crops[0].y2,
+                   &ev.crops[1].x1, &ev.crops[1].x2, &ev.crops[1].y1, &ev.crops[1].y2,
+                   &ev.digest[0], &ev.digest[1], &files, &ev.ref) < 18 || index != evlist->nmemb)
+            break;
+        ret = eventlist_set(evlist, &ev, index);
+        last_files = files;
+    }
+    fclose(fp);
+    if (ret)
+        return ret;
+
+    //The last event PNGs may have been written partially, it is redone if they do not match.
+    if (evlist->nmemb) {
+        index = evlist->nmemb - 1;
+        if (event_files_hash(args, evlist->events[index], index) != last_files) {
+            printf(A2B_LOG_PREFIX "checkpoint: PNG of event %d does not match, it is rendered again.\n", index);
+            free(evlist->events[index]);
+            evlist->events[index] = NULL;
+            evlist->nmemb--;
+        }
+    }
+    printf(A2B_LOG_PREFIX "checkpoint: resuming after %d event(s).\n", evlist->nmemb);
+    return evlist->nmemb;
+}
+
+int checkpoint_open(checkpoint_t *cp, const char *cpfile, const char *subfile, const opts_t *args, eventlist_t *evlist)
+{
+    char tmpfile[FILENAME_MAX];
+    int i, err = 0;
+
+    memset(cp, 0, sizeof(checkpoint_t));
+    cp->evlist = evlist;
+    cp->args = args;
+    cp->base = evlist->nmemb;
+    cp->last_sync = time(NULL);
+
+    //Rewrite the retained events, then swap, so an interruption never loses the previous checkpoint.
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", cpfile);
+    cp->fp = fopen(tmpfile, "w");
+    if (cp->fp == NULL) {
+        perror("Error opening checkpoint file.");
+        return A2B_ERR_ARGS;
+    }
+    err = write_header(cp->fp, subfile, args);
+    for (i = 0; i < evlist->nmemb && !err; i++)
+        write_event(cp->fp, evlist->events[i], i, event_files_hash(args, evlist->events[i], i));
+
+    if (err || fflush(cp->fp) || fsync(fileno(cp->fp)) || rename(tmpfile, cpfile)) {
+        perror("Error writing checkpoint file.");
+        fclose(cp->fp);
+        cp->fp = NULL;
+        return A2B_ERR_ARGS;
+    }
+    return A2B_OK;
+}
+
+void checkpoint_close(checkpoint_t *cp)
+{
+    if (cp->fp) {
+        fflush(cp->fp);
+        fsync(fileno(cp->fp));
+        fclose(cp->fp);
+        cp->fp = NULL;
+    }
+}
+
+int checkpoint_sink(void *priv, const image_t *ev, int index)
+{
+    checkpoint_t *cp = (checkpoint_t *)priv;
+    time_t now;
+
+    index += cp->base;
+    if (eventlist_set(cp->evlist, ev, index))
+        return A2B_ERR_ALLOC;
+
+    //Events are final once handed to the sink, their PNGs are complete.
+    write_event(cp->fp, ev, index, event_files_hash(cp->args, ev, index));
+    if (fflush(cp->fp))
+        return A2B_ERR_SINK;
+
+    now = time(NULL);
+    if (now - cp->last_sync >= CHECKPOINT_SYNC_S) {
+        fsync(fileno(cp->fp));
+        cp->last_sync = now;
+    }
+    return A2B_OK;
+}
@@ -0,0 +1,24 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "common.h"
+
+//Append-only record of the finalized events of a conversion, to resume it after an interruption.
+typedef struct checkpoint_s {
+    FILE *fp;
+    eventlist_t *evlist;
+    const opts_t *args;
+    int base;
+    time_t last_sync;
+} checkpoint_t;
+
+//Reload the events of an interrupted conversion in evlist, the last one is verified against its PNGs.
+//Returns the number of events kept, to seed the render, or a negative error.
+int checkpoint_load(const char *cpfile, const char *subfile, const opts_t *args, eventlist_t *evlist);
+
+//Start the checkpoint file with the events already in evlist.
+int checkpoint_open(checkpoint_t *cp, const char *cpfile, const char *subfile, const opts_t *args, eventlist_t *evlist);
+void checkpoint_close(checkpoint_t *cp);
+
+//a2b_sink_t callback, priv is a checkpoint_t. Events are stored in its evlist and in the checkpoint.
+int checkpoint_sink(void *priv, const image_t *ev, int index);
@@ -0,0 +1,287 @@
+/* Copyright © 2024, cubicibo
+ * The same agreement notice as ass2bdnxml.c applies.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "common.h"
+#include "pngpar.h"
+
+#define PNGPAR_MAX_BANDS (64)
+#define PNGPAR_MIN_BAND_BYTES (256*1024)
+#define PNGPAR_WINDOW (32768)
+
+typedef struct band_s {
+    //shared
+    const uint8_t *bgra;
+    int stride, w, level;
+    uint8_t *filtered;    //all the filtered rows of the image
+    size_t row_bytes;
+    //band
+    int y0, y1;
+    int first, last;
+    uint8_t *out;
+    size_t out_len;
+    uLong adler;
+    int ret;
+} band_t;
+
+static inline uint8_t paeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return (uint8_t)a;
+    return (uint8_t)(pb <= pc ? b : c);
+}
+
+static inline uint32_t filter_cost(const uint8_t *row, size_t len)
+{
+    uint32_t sum = 0;
+    for (size_t k = 0; k < len; k++)
+        sum += row[k] < 128 ? row[k] : 256 - row[k];
+    return sum;
+}
+
+//Filter a row with the method of lowest sum of absolute differences, like libpng.
+static void filter_row(const uint8_t *cur, const uint8_t *prev, size_t len, uint8_t *out, uint8_t *tmp)
+{
+    uint32_t best_cost, cost;
+    int k;
+
+    out[0] = 0;
+    memcpy(&out[1], cur, len);
+    best_cost = filter_cost(cur, len);
+
+    for (int method = 1; method <= 4; method++) {
+        for (k = 0; k < (int)len; k++) {
+            int a = k >= 4 ? cur[k-4] : 0;
+            int b = prev ? prev[k] : 0;
+            int c = (k >= 4 && prev) ? prev[k-4] : 0;
+            switch (method) {
+                case 1: tmp[k] = cur[k] - a; break;
+                case 2: tmp[k] = cur[k] - b; break;
+                case 3: tmp[k] = cur[k] - ((a + b) >> 1); break;
+                default: tmp[k] = cur[k] - paeth(a, b, c); break;
+            }
+        }
+        cost = filter_cost(tmp, len);
+        if (cost < best_cost) {
+            best_cost = cost;
+            out[0] = (uint8_t)method;
+            memcpy(&out[1], tmp, len);
+        }
+    }
+}
+
+static void bgra_to_rgba(const uint8_t *src, uint8_t *dst, int w)
+{
+    for (int x = 0; x < w*4; x += 4) {
+        dst[x] = src[x+2];
+        dst[x+1] = src[x+1];
+        dst[x+2] = src[x];
+        dst[x+3] = src[x+3];
+    }
+}
+
+static void *filter_band(void *priv)
+{
+    band_t *band = (band_t *)priv;
+    const size_t len = band->w*4;
+    uint8_t *rows = malloc(3*len);
+
+    if (rows == NULL) {
+        band->ret = A2B_ERR_ALLOC;
+        return NULL;
+    }
+    uint8_t *cur = rows, *prev = rows + len, *tmp = rows + 2*len;
+
+    //The row above the band is needed for the first row.
+    if (band->y0 > 0)
+        bgra_to_rgba(band->bgra + (band->y0 - 1)*band->stride, prev, band->w);
+
+    for (int y = band->y0; y < band->y1; y++) {
+        bgra_to_rgba(band->bgra + y*band->stride, cur, band->w);
+        filter_row(cur, y > 0 ? prev : NULL, len, band->filtered + y*band->row_bytes, tmp);
+        uint8_t *swap = prev;
+        prev = cur;
+        cur = swap;
+    }
+    free(rows);
+    return NULL;
+}
+
+//Deflate a band as raw deflate data, primed with the end of the previous band.
+//Bands but the last end on a byte boundary with a sync flush, so they can be concatenated.
+static void *deflate_band(void *priv)
+{
+    band_t *band = (band_t *)priv;
+    const uint8_t *in = band->filtered + band->y0*band->row_bytes;
+    const size_t in_len = (band->y1 - band->y0)*band->row_bytes;
+    z_stream strm;
+    size_t bound;
+
+    memset(&strm, 0, sizeof(strm));
+    if (deflateInit2(&strm, band->level, Z_DEFLATED, -15, 8, Z_FILTERED) != Z_OK) {
+        band->ret = A2B_ERR_ALLOC;
+        return NULL;
+    }
+
+    if (!band->first) {
+        size_t dict_len = MIN(PNGPAR_WINDOW, band->y0*band->row_bytes);
+        deflateSetDictionary(&strm, in - dict_len, (uInt)dict_len);
+    }
+
+    //zlib header on the first band, adler32 trailer on the last
+    bound = deflateBound(&strm, in_len) + 16;
+    band->out = malloc(bound + 2 + 4);
+    if (band->out == NULL) {
+        deflateEnd(&strm);
+        band->ret = A2B_ERR_ALLOC;
+        return NULL;
+    }
+
+    strm.next_in = (Bytef *)in;
+    strm.avail_in = (uInt)in_len;
+    strm.next_out = band->out + 2*band->first;
+    strm.avail_out = (uInt)bound;
+
+    int ret = deflate(&strm, band->last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((band->last && ret != Z_STREAM_END) || (!band->last && (ret != Z_OK || strm.avail_in)))
+        band->ret = A2B_ERR_PNG;
+
+    band->out_len = 2*band->first + bound - strm.avail_out;
+    band->adler = adler32(adler32(0L, Z_NULL, 0), in, (uInt)in_len);
+    deflateEnd(&strm);
+    return NULL;
+}
+
+static void put_u32(uint8_t *buf, uint32_t val)
+{
+    buf[0] = val >> 24;
+    buf[1] = (val >> 16) & 0xFF;
+    buf[2] = (val >> 8) & 0xFF;
+    buf[3] = val & 0xFF;
+}
+
+static int write_chunk(FILE *fp, const char *type, const uint8_t *data, size_t len)
+{
+    uint8_t hdr[8];
+    uLong crc;
+
+    put_u32(hdr, (uint32_t)len);
+    memcpy(&hdr[4], type, 4);
+    crc = crc32(crc32(0L, Z_NULL, 0), &hdr[4], 4);
+    if (len)
+        crc = crc32(crc, data, (uInt)len);
+
+    uint8_t crc_be[4];
+    put_u32(crc_be, (uint32_t)crc);
+    return fwrite(hdr, 1, 8, fp) != 8 || (len && fwrite(data, 1, len, fp) != len) || fwrite(crc_be, 1, 4, fp) != 4;
+}
+
+//Run fn over the bands, one thread per band but the first which runs on the calling thread.
+static void run_bands(band_t *bands, int nbands, void *(*fn)(void *))
+{
+    pthread_t threads[PNGPAR_MAX_BANDS];
+    uint8_t started[PNGPAR_MAX_BANDS] = {0};
+
+    for (int k = 1; k < nbands; k++)
+        started[k] = !pthread_create(&threads[k], NULL, fn, &bands[k]);
+    fn(&bands[0]);
+    for (int k = 1; k < nbands; k++) {
+        if (started[k])
+            pthread_join(threads[k], NULL);
+        else
+            fn(&bands[k]);
+    }
+}
+
+int write_png_parallel(const char *fname, const uint8_t *bgra, int stride, int w, int h, int level, long *size)
+{
+    static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+    band_t bands[PNGPAR_MAX_BANDS];
+    uint8_t ihdr[13];
+    const size_t row_bytes = 1 + (size_t)w*4;
+    int k, nbands, ret = A2B_OK;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uLong adler;
+    FILE *fp;
+
+    nbands = (int)MIN(MIN(MAX(1, ncpu), PNGPAR_MAX_BANDS), MAX(1, (row_bytes*h)/PNGPAR_MIN_BAND_BYTES));
+    nbands = MIN(nbands, h);
+
+    uint8_t *filtered = malloc(row_bytes*h);
+    if (filtered == NULL)
+        return A2B_ERR_ALLOC;
+
+    memset(bands, 0, sizeof(bands));
+    for (k = 0; k < nbands; k++) {
+        bands[k].bgra = bgra;
+        bands[k].stride = stride;
+        bands[k].w = w;
+        bands[k].level = level;
+        bands[k].filtered = filtered;
+        bands[k].row_bytes = row_bytes;
+        bands[k].y0 = (int)(((int64_t)h*k)/nbands);
+        bands[k].y1 = (int)(((int64_t)h*(k+1))/nbands);
+        bands[k].first = k == 0;
+        bands[k].last = k == nbands - 1;
+    }
+
+    //Filtering reads the unfiltered row above, deflate needs the previous band as dictionary:
+    //all bands are filtered before any is deflated.
+    run_bands(bands, nbands, filter_band);
+    for (k = 0; k < nbands && !ret; k++)
+        ret = bands[k].ret;
+    if (ret == A2B_OK) {
+        run_bands(bands, nbands, deflate_band);
+        for (k = 0; k < nbands && !ret; k++)
+            ret = bands[k].ret;
+    }
+
+    if (ret == A2B_OK) {
+        //zlib header: deflate, 32K window, fast compression level
+        bands[0].out[0] = 0x78;
+        bands[0].out[1] = 0x5E;
+        adler = bands[0].adler;
+        for (k = 1; k < nbands; k++)
+            adler = adler32_combine(adler, bands[k].adler, (bands[k].y1 - bands[k].y0)*row_bytes);
+        put_u32(bands[nbands-1].out + bands[nbands-1].out_len, (uint32_t)adler);
+        bands[nbands-1].out_len += 4;
+
+        put_u32(&ihdr[0], (uint32_t)w);
+        put_u32(&ihdr[4], (uint32_t)h);
+        ihdr[8] = 8;  //bit depth
+        ihdr[9] = 6;  //RGBA
+        ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+        fp = fopen(fname, "wb");
+        if (fp == NULL) {
+            a2b_log(A2B_LOG_ERROR, "PNG Error opening %s for writing!", fname);
+            ret = A2B_ERR_PNG;
+        } else {
+            int err = fwrite(signature, 1, sizeof(signature), fp) != sizeof(signature);
+            err |= write_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+            for (k = 0; k < nbands; k++)
+                err |= write_chunk(fp, "IDAT", bands[k].out, bands[k].out_len);
+            err |= write_chunk(fp, "IEND", NULL, 0);
+            *size = ftell(fp);
+            if (fclose(fp) || err) {
+                a2b_log(A2B_LOG_ERROR, "Failed to write %s.", fname);
+                ret = A2B_ERR_PNG;
+            }
+        }
+    }
+
+    for (k = 0; k < nbands; k++)
+        free(bands[k].out);
+    free(filtered);
+    return ret;
+}
@@ -0,0 +1,14 @@
+#ifndef A2B_PNGPAR_H
+#define A2B_PNGPAR_H
+
+#include <stdint.h>
+
+//Images from this size are compressed by several threads.
+#define PNGPAR_MIN_PIXELS (1 << 20)
+
+//Write a BGRA bitmap as an RGBA PNG. Rows are split in bands that are filtered and
+//deflated concurrently, the bands are stitched in a single zlib stream.
+//Returns an a2b_error_t, the file size is stored in size.
+int write_png_parallel(const char *fname, const uint8_t *bgra, int stride, int w, int h, int level, long *size);
+
+#endif
@@ -1,32 +1,228 @@
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <math.h>
 #include <fenv.h>
+#include <time.h>
+#include <pthread.h>
 #include <ass/ass.h>
 #include <png.h>
 #include <libimagequant.h>
 
 #include "common.h"
+#include "pngpar.h"
 
 #define FILENAME_FMT "%08d"
 #define FILENAME_CNT "_%01d"
 #define FILENAME_EXT ".png"
-#define FILENAME_MAX_LENGTH (20)
+#define FILENAME_MAX_LENGTH (4096)
 
 #define BOX_AREA(box) ((box.x2-box.x1)*(box.y2-box.y1))
 
-ASS_Library *ass_library;
-ASS_Renderer *ass_renderer;
-liq_attr *attr;
+//Memory budget: libass library, fonts, libpng and process overhead
+#define MEM_BASE_MB (24)
+#define MEM_MIN_BITMAP_MB (4)
+#define MEM_MAX_BITMAP_MB (128)
+#define MEM_MIN_GLYPHS (500)
+#define MEM_MAX_GLYPHS (10000)
+#define MEM_GLYPH_SIZE (2048)
+//libimagequant working set per pixel (histogram, float remap buffers)
+#define MEM_LIQ_PER_PIXEL (20)
+
+//Colour stage of the blended event area: dimming of the code values, then optionally
+//linearisation, BT.709 to BT.2020 primaries and the output transfer.
+typedef struct a2b_lut_s {
+    uint8_t dim[256];      //dimmed code value, identity without --dim
+    uint32_t dim_mul;      //dim[] as a 16-bit fixed point factor and rounding bias, if one matches it exactly
+    uint32_t dim_bias;
+    int dim_linear;
+    uint16_t linear[256];  //dimmed code value to linear light, 16-bit
+    int32_t matrix[9];     //BT.709 to BT.2020 primaries, 14-bit fixed point
+    uint8_t encode[65536]; //linear light to output code value
+    int active;
+    int convert;
+} a2b_lut_t;
+
+#define COMP_MAX_DIRTY (32)
+
+//Incremental compositor: copy of the last blended ASS_Image chain. Bitmaps are identified
+//by address like libass does to detect changes, so the copy is only valid while libass
+//holds them, i.e. until a frame without images is rendered.
+typedef struct a2b_comp_s {
+    ASS_Image *imgs, *prev; //blended chain, and the one before while blending
+    int count, size;
+    int valid;              //the frame holds the blend of imgs
+    BoundingBox_t box;      //visible pixels of the frame, x1 < 0 if none
+    BoundingBox_t dirty[COMP_MAX_DIRTY];
+    int ndirty;
+    image_t *layer;         //blend before the colour stage, NULL without one
+} a2b_comp_t;
+
+#define REUSE_MIN_SLOTS (1024)
+
+//Encoded event, see opts_t.shared_pngs.
+typedef struct reuse_entry_s {
+    uint64_t key[2];        //hash of the blended event area, 0: empty slot
+    BoundingBox_t area;     //event area of the blend
+    BoundingBox_t box;      //event area and crops as encoded
+    BoundingBox_t crops[2];
+    uint64_t digest[2];
+    uint32_t png;           //number of the PNG, index_base included
+    uint8_t *pixels;        //BGRA rows of the blended event area, compared before the PNGs are reused
+} reuse_entry_t;
+
+//Open addressing map of the encoded events, kept over the render_subs() calls of a context
+//while a2b_configure() leaves the PNGs valid, see reuse_keep().
+typedef struct a2b_reuse_s {
+    reuse_entry_t *slots;
+    uint32_t size;
+    uint32_t count;
+    uint64_t key[2];        //key of the last lookup
+    uint32_t next;          //first PNG number after those recorded
+    char *outdir;           //directory of the recorded PNGs
+} a2b_reuse_t;
+
+#define TRACE_MAX_SPANS (8)
+
+//Spans of a frame or of an event, held until the event index is known.
+typedef struct a2b_spans_s {
+    a2b_span_t span[TRACE_MAX_SPANS];
+    int count;
+    int on;
+} a2b_spans_t;
+
+struct a2b_ctx_s {
+    ASS_Library *ass_library;
+    ASS_Renderer *ass_renderer;
+    liq_attr *attr;
+    opts_t args;
+    liqopts_t liqargs;
+    a2b_stats_t stats;
+    char *fontdir;
+    //libass can return blank ASS_Images, we must remember whenever that happen as the changed
+    //flag returned by libass becomes meaningless, and we would corrupt the event.
+    int prev_invalid;
+    //Number of output variants encoded concurrently.
+    int max_parallel;
+    a2b_lut_t lut;
+    a2b_comp_t comp;
+    //The last new frame is the bitmap of the previous event at another position.
+    int translated;
+    //Events encoded so far, with args.shared_pngs.
+    a2b_reuse_t reuse;
+    //Timing spans, disabled if trace.span is NULL.
+    a2b_trace_t trace;
+    a2b_spans_t spans;
+    //Progress reports, disabled if monitor.progress is NULL.
+    a2b_monitor_t monitor;
+    a2b_progress_t progress;
+    uint64_t progress_ms;
+};
+
+#define SCALE_BITS (12)
+#define SCALE_MAX_TAPS (9)
+#define SCALE_CHECK_MIN_PSNR (30.0)
+
+//Source pixels and weights of one output column or row of a downscale.
+typedef struct scale_taps_s {
+    int start;
+    int count;
+    uint16_t w[SCALE_MAX_TAPS];
+} scale_taps_t;
+
+//Derived format: events are downscaled from the shared render instead of rendered again.
+typedef struct a2b_scale_s {
+    image_t *frame;       //downscaled event
+    scale_taps_t *xtaps;
+    scale_taps_t *ytaps;
+    uint32_t *hrow;       //horizontal pass of one source row, premultiplied
+    uint32_t *acc;        //vertical accumulation of one output row
+    //Native render of the format, compared to the downscale every check_every events.
+    ASS_Renderer *renderer;
+    ASS_Track *track;
+    image_t *native;
+    uint32_t check_every;
+    uint32_t checked;
+    uint32_t diverged;
+    double worst_psnr;
+} a2b_scale_t;
+
+#define ARENA_MAX_BLOCKS (32)
+#define ARENA_MIN_BLOCK (64)
+
+typedef struct arena_block_s {
+    void *ptr;
+    size_t size;
+    int used;
+} arena_block_t;
+
+//Scratch memory of one encoding stage, kept from event to event. The indexed bitmap and
+//the row pointers grow to the largest event, the allocations of libpng and zlib are served
+//from blocks that are returned when the PNG struct is destroyed.
+typedef struct a2b_arena_s {
+    uint8_t *bitmap;
+    size_t bitmap_size;
+    png_byte **rows;
+    int nrows;
+    arena_block_t blocks[ARENA_MAX_BLOCKS];
+    int nblocks;
+} a2b_arena_t;
+
+//Encoding stage of one output variant. All variants are fed by the same render.
+typedef struct a2b_enc_s {
+    const opts_t *args;
+    const liqopts_t *liqargs;
+    liq_attr *attr;
+    a2b_sink_t *sink;
+    a2b_stats_t stats;
+    const image_t *frame; //shared render, read-only while the variants are encoded
+    image_t cur;          //geometry of the frame as encoded by this variant
+    image_t event;        //last known state of the event being built
+    uint32_t count;
+    int ret;
+    a2b_scale_t *scale;   //derived format, NULL if encoded at the render size
+    uint64_t quant_us;    //palette and quantization time of the last event
+    int translated;       //the new event is the previous one moved, see translated_frames()
+    a2b_arena_t arena;
+    a2b_spans_t spans;
+} a2b_enc_t;
+
+static void image_spans_reset(image_t *img, int y1, int y2)
+{
+    for (int y = y1; y <= y2; y++) {
+        img->spans[2*y] = img->width;
+        img->spans[2*y + 1] = -1;
+    }
+}
 
+static void image_free(image_t *img)
+{
+    if (img) {
+        free(img->buffer);
+        free(img->alpha);
+        free(img->spans);
+    }
+    free(img);
+}
+
+//The buffer, alpha plane and spans are allocated together, NULL if any fails.
 static image_t *image_init(int width, int height)
 {
     image_t *img = calloc(1, sizeof(image_t));
+    if (!img)
+        return NULL;
     img->width = width;
     img->height = height;
     img->subx1 = img->suby1 = -1;
     img->stride = width * 4;
     img->buffer = calloc(1, height * width * 4);
+    img->alpha = calloc(1, height * width);
+    img->spans = malloc(2 * height * sizeof(int));
+    if (!img->buffer || !img->alpha || !img->spans) {
+        image_free(img);
+        return NULL;
+    }
+    image_spans_reset(img, 0, height - 1);
     memset(img->crops, 0xFF, sizeof(BoundingBox_t)*2);
     return img;
 }
@@ -36,37 +232,125 @@ static void image_reset(image_t *img)
     img->subx1 = img->suby1 = -1;
     img->subx2 = img->suby2 = 0;
     img->buffer = memset(img->buffer, 0, img->height * img->stride);
+    memset(img->alpha, 0, img->height * img->width);
+    image_spans_reset(img, 0, img->height - 1);
 }
 
-void eventlist_set(eventlist_t *list, image_t *ev, int index)
+//Span of row y from the alpha plane.
+static void image_span_scan(image_t *img, int y)
 {
-    image_t *newev;
+    const uint8_t *row = img->alpha + y*img->width;
+    int x1 = 0, x2 = img->width - 1;
 
-    if (list->nmemb <= index)
-        newev = calloc(1, sizeof(image_t));
-    else
-        newev = list->events[index];
+    while (x1 <= x2 && !row[x1])
+        x1++;
+    if (x1 > x2) {
+        image_spans_reset(img, y, y);
+        return;
+    }
+    while (!row[x2])
+        x2--;
+    img->spans[2*y] = x1;
+    img->spans[2*y + 1] = x2;
+}
+
+//Bounding box of the visible pixels, from the row spans.
+static void image_span_bbox(image_t *img)
+{
+    img->subx1 = img->suby1 = -1;
+    img->subx2 = img->suby2 = 0;
+    for (int y = 0; y < img->height; y++) {
+        const int x1 = img->spans[2*y], x2 = img->spans[2*y + 1];
+
+        if (x1 > x2)
+            continue;
+        /* Some DVD and BD players need the offsets to be on mod2
+         * positions and will misrender subtitles or crash if they
+         * are not. Yeah, really. */
+        if (img->subx1 < 0) img->subx1 = x1 - (x1 % 2);
+        else img->subx1 = MIN(img->subx1, x1 - (x1 % 2));
+
+        if (img->suby1 < 0) img->suby1 = y - (y % 2);
+
+        img->subx2 = MAX(img->subx2, x2);
+        img->suby2 = y;
+    }
+}
 
-    newev->subx1 = ev->subx1;
-    newev->subx2 = ev->subx2;
-    newev->suby1 = ev->suby1;
-    newev->suby2 = ev->suby2;
-    newev->in = ev->in;
-    newev->out = ev->out;
-    memcpy(newev->crops, ev->crops, sizeof(BoundingBox_t)*2);
+//Any visible pixel in [x1, x2] of row y. The span ends are visible, so the
+//plane is only read when the span strictly contains the range.
+static int row_visible(const image_t *img, int y, int x1, int x2)
+{
+    const int s1 = img->spans[2*y], s2 = img->spans[2*y + 1];
+    const uint8_t *row = img->alpha + y*img->width;
+
+    if (s1 > s2 || s1 > x2 || s2 < x1)
+        return 0;
+    if (s1 >= x1 || s2 <= x2)
+        return 1;
+    for (int x = x1; x <= x2; x++)
+        if (row[x])
+            return 1;
+    return 0;
+}
+
+static int col_visible(const image_t *img, int x, int y1, int y2)
+{
+    for (int y = y1; y <= y2; y++)
+        if (img->spans[2*y] <= x && x <= img->spans[2*y + 1] && img->alpha[y*img->width + x])
+            return 1;
+    return 0;
+}
+
+static void event_copy(image_t *dst, const image_t *ev)
+{
+    dst->subx1 = ev->subx1;
+    dst->subx2 = ev->subx2;
+    dst->suby1 = ev->suby1;
+    dst->suby2 = ev->suby2;
+    dst->in = ev->in;
+    dst->out = ev->out;
+    memcpy(dst->crops, ev->crops, sizeof(BoundingBox_t)*2);
+    memcpy(dst->digest, ev->digest, sizeof(ev->digest));
+    dst->rendered = ev->rendered;
+    dst->opaque = ev->opaque;
+    dst->ref = ev->ref;
+}
+
+int eventlist_set(eventlist_t *list, const image_t *ev, int index)
+{
+    image_t *newev;
 
     if (list->size <= index) {
-        list->size = index + 200;
-        image_t **new_list = realloc(list->events, sizeof(image_t*) * list->size);
+        image_t **new_list = realloc(list->events, sizeof(image_t*) * (index + 200));
         if (!new_list) {
-            printf("Can't allocate memory.\n");
-            exit(1);
+            a2b_log(A2B_LOG_ERROR, "Can't allocate memory.");
+            return A2B_ERR_ALLOC;
         }
+        list->size = index + 200;
         list->events = new_list;
     }
 
+    if (list->nmemb <= index) {
+        newev = calloc(1, sizeof(image_t));
+        if (!newev) {
+            a2b_log(A2B_LOG_ERROR, "Can't allocate memory.");
+            return A2B_ERR_ALLOC;
+        }
+    } else {
+        newev = list->events[index];
+    }
+
+    event_copy(newev, ev);
+
     list->events[index] = newev;
     list->nmemb = MAX(list->nmemb, index + 1);
+    return A2B_OK;
+}
+
+int eventlist_sink(void *priv, const image_t *ev, int index)
+{
+    return eventlist_set((eventlist_t *)priv, ev, index);
 }
 
 void eventlist_free(eventlist_t *list)
@@ -81,72 +365,430 @@ void eventlist_free(eventlist_t *list)
     free(list);
 }
 
+#define FNV64_INIT (0xcbf29ce484222325ULL)
+#define FNV64_PRIME (0x100000001b3ULL)
+
+//Hash of the decoded pixels, in RGBA order.
+static inline uint64_t fnv64_rgba(uint64_t h, uint8_t r, uint8_t g, uint8_t b, uint8_t a)
+{
+    h = (h ^ r) * FNV64_PRIME;
+    h = (h ^ g) * FNV64_PRIME;
+    h = (h ^ b) * FNV64_PRIME;
+    return (h ^ a) * FNV64_PRIME;
+}
+
+//part is the graphic index of a split event, negative otherwise.
+static void image_fname(char *fname, const opts_t *args, uint32_t count, int part)
+{
+    const char *dir = args->outdir ? args->outdir : "";
+    size_t len = strlen(dir);
+    const char *sep = (len && dir[len-1] != '/' && dir[len-1] != '\\') ? "/" : "";
+
+    count += args->index_base;
+
+    if (part < 0)
+        snprintf(fname, FILENAME_MAX_LENGTH, "%s%s" FILENAME_FMT FILENAME_EXT, dir, sep, count);
+    else
+        snprintf(fname, FILENAME_MAX_LENGTH, "%s%s" FILENAME_FMT FILENAME_CNT FILENAME_EXT, dir, sep, count, part);
+}
+
 static void msg_callback(int level, const char *fmt, va_list va, void *data)
 {
+    char msg[512];
+
     if (level > 6)
         return;
-    printf("libass: ");
-    vprintf(fmt, va);
-    printf("\n");
+    vsnprintf(msg, sizeof(msg), fmt, va);
+    a2b_log(level <= 1 ? A2B_LOG_ERROR : (level <= 4 ? A2B_LOG_WARN : A2B_LOG_INFO), "libass: %s", msg);
 }
 
-static void write_png_palette(uint32_t count, image_t* restrict rgba_img, liq_image **img, liq_result **res, opts_t *args, uint8_t is_split, float dither_val)
+//Indexed bitmap of an event and its palette, entry zero is reserved when RLE optimised.
+typedef struct a2b_pal_s {
+    png_color colors[257];
+    png_byte trans[257];
+    int count;
+    int zero;  //bitmap index moved to entry zero when RLE optimised, -1: entry zero unused
+    int shifted; //bitmap indices already offset by the reserved entry zero
+    uint8_t *bitmap;
+} a2b_pal_t;
+
+static uint8_t *arena_bitmap(a2b_arena_t *arena, size_t size)
 {
-    FILE *fp;
-    png_structp png_ptr;
-    png_infop info_ptr;
+    if (size > arena->bitmap_size) {
+        free(arena->bitmap);
+        arena->bitmap = malloc(size);
+        arena->bitmap_size = arena->bitmap ? size : 0;
+    }
+    return arena->bitmap;
+}
 
-    int k, w, h;
-    int h_margin, w_margin;
-    char fname[FILENAME_MAX_LENGTH];
+static png_byte **arena_rows(a2b_arena_t *arena, int h)
+{
+    if (h > arena->nrows) {
+        free(arena->rows);
+        arena->rows = malloc(h * sizeof(png_byte *));
+        arena->nrows = arena->rows ? h : 0;
+    }
+    return arena->rows;
+}
 
-    w = rgba_img->subx2 - rgba_img->subx1 + 1;
-    h = rgba_img->suby2 - rgba_img->suby1 + 1;
-    h_margin = 0;
-    uint8_t rle_optimise = (args->rle_optimise > 0) & 0x01;
+//Smallest free block that fits, new blocks are rounded up to a power of two so that rows
+//of different widths share them. Past ARENA_MAX_BLOCKS, allocations go to malloc.
+static png_voidp arena_png_malloc(png_structp png_ptr, png_alloc_size_t size)
+{
+    a2b_arena_t *arena = (a2b_arena_t *)png_get_mem_ptr(png_ptr);
+    arena_block_t *block = NULL;
+    size_t bsize = ARENA_MIN_BLOCK;
+
+    for (int k = 0; k < arena->nblocks; k++) {
+        if (!arena->blocks[k].used && arena->blocks[k].size >= size &&
+            (block == NULL || arena->blocks[k].size < block->size))
+            block = &arena->blocks[k];
+    }
+    if (block == NULL) {
+        if (arena->nblocks == ARENA_MAX_BLOCKS)
+            return malloc(size);
+        while (bsize < size)
+            bsize <<= 1;
+        block = &arena->blocks[arena->nblocks];
+        block->ptr = malloc(bsize);
+        if (block->ptr == NULL)
+            return NULL;
+        block->size = bsize;
+        arena->nblocks++;
+    }
+    block->used = 1;
+    return block->ptr;
+}
 
-    //Get palette from LIQ
-    const liq_palette *liq_pal = liq_get_palette(*res);
-    png_color* palette = (png_color*)malloc((liq_pal->count + rle_optimise)*sizeof(png_color));
-    if (palette == NULL) {
-        printf("Failed to allocate palette array for " FILENAME_FMT".\n", count);
-        return;
+static void arena_png_free(png_structp png_ptr, png_voidp ptr)
+{
+    a2b_arena_t *arena = (a2b_arena_t *)png_get_mem_ptr(png_ptr);
+
+    for (int k = 0; k < arena->nblocks; k++) {
+        if (arena->blocks[k].ptr == ptr) {
+            arena->blocks[k].used = 0;
+            return;
+        }
     }
+    free(ptr);
+}
 
-    png_byte* trans = (png_byte*)malloc(liq_pal->count + rle_optimise);
-    if (trans == NULL) {
-        free(palette);
-        printf("Failed to allocate alpha array for " FILENAME_FMT ".\n", count);
-        return;
+static png_structp arena_png_create(a2b_arena_t *arena)
+{
+    return png_create_write_struct_2(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL,
+                                     arena, arena_png_malloc, arena_png_free);
+}
+
+static void arena_free(a2b_arena_t *arena)
+{
+    free(arena->bitmap);
+    free(arena->rows);
+    for (int k = 0; k < arena->nblocks; k++)
+        free(arena->blocks[k].ptr);
+    memset(arena, 0, sizeof(*arena));
+}
+
+#define EXACT_HASH_SIZE (1024)
+//Transparent pixels never enter the hash set, a transparent key marks empty slots.
+#define EXACT_HASH_EMPTY (0)
+#define EXACT_TRANSPARENT (0xFF)
+
+static inline uint32_t exact_hash(uint32_t key)
+{
+    key *= 0x9E3779B1u;
+    return key >> 22; //10 bits, EXACT_HASH_SIZE
+}
+
+//Build the palette and bitmap losslessly when the event has few enough colours.
+//Unique colours are counted by a scalar open addressing hash set that skips runs of one colour.
+//Returns 1 on success, 0 if the colours exceed the budget and quantization is required.
+static int palette_exact(const opts_t *args, const image_t* restrict rgba_img, a2b_pal_t *pal)
+{
+    const uint8_t rle_optimise = (args->rle_optimise > 0) & 0x01;
+    const int h = rgba_img->suby2 - rgba_img->suby1 + 1;
+    //One entry is always kept for the transparent colour, which goes last.
+    const int max_opaque = args->quantize - 1;
+    uint32_t keys[EXACT_HASH_SIZE];
+    uint8_t values[EXACT_HASH_SIZE];
+    uint32_t prev_key = EXACT_HASH_EMPTY;
+    uint8_t prev_idx = EXACT_TRANSPARENT;
+    uint32_t transparent_key = 0;
+    int n = 0;
+
+    memset(keys, EXACT_HASH_EMPTY, sizeof(keys));
+    //Pixels outside of the event area are transparent.
+    memset(pal->bitmap, EXACT_TRANSPARENT, rgba_img->width*h);
+
+    for (int y = 0; y < h; y++) {
+        const uint32_t *row = (const uint32_t *)(rgba_img->buffer + (y + rgba_img->suby1)*rgba_img->stride);
+        uint8_t *out = pal->bitmap + y*rgba_img->width;
+
+        for (int x = rgba_img->subx1; x <= rgba_img->subx2; x++) {
+            uint32_t key = row[x];
+
+            //Runs of the same colour are frequent in fills and outlines.
+            if (key == prev_key) {
+                out[x] = prev_idx;
+                continue;
+            }
+            prev_key = key;
+
+            //Invisible pixels all share the transparent entry.
+            if (((const uint8_t *)&row[x])[3] == 0) {
+                transparent_key = key;
+                prev_idx = out[x] = EXACT_TRANSPARENT;
+                continue;
+            }
+
+            uint32_t slot = exact_hash(key);
+            while (keys[slot] != EXACT_HASH_EMPTY && keys[slot] != key)
+                slot = (slot + 1) & (EXACT_HASH_SIZE - 1);
+
+            if (keys[slot] == EXACT_HASH_EMPTY) {
+                if (n >= max_opaque)
+                    return 0;
+                const uint8_t *bgra = (const uint8_t *)&row[x];
+                keys[slot] = key;
+                values[slot] = (uint8_t)n;
+                pal->colors[n + rle_optimise].red = bgra[2];
+                pal->colors[n + rle_optimise].green = bgra[1];
+                pal->colors[n + rle_optimise].blue = bgra[0];
+                pal->trans[n + rle_optimise] = bgra[3];
+                n++;
+            }
+            prev_idx = out[x] = values[slot];
+        }
+    }
+
+    //Transparent entry is last (index n), remap if it is not the placeholder.
+    const uint8_t *bgra = (const uint8_t *)&transparent_key;
+    pal->colors[n + rle_optimise].red = bgra[2];
+    pal->colors[n + rle_optimise].green = bgra[1];
+    pal->colors[n + rle_optimise].blue = bgra[0];
+    pal->trans[n + rle_optimise] = 0;
+    pal->count = n + 1;
+    if (n != EXACT_TRANSPARENT) {
+        for (int k = 0; k < rgba_img->width*h; k++) {
+            if (pal->bitmap[k] == EXACT_TRANSPARENT)
+                pal->bitmap[k] = (uint8_t)n;
+        }
+    }
+    return 1;
+}
+
+#define REMAP_CACHE_SIZE (4096)
+
+static inline uint32_t remap_hash(uint32_t key)
+{
+    key *= 0x9E3779B1u;
+    return key >> 20; //12 bits, REMAP_CACHE_SIZE
+}
+
+//Nearest palette entry of a BGRA pixel, compared on premultiplied components.
+//Palette components are stored per channel so the distance loop vectorizes.
+static uint8_t remap_nearest(const int16_t pm[4][256], int count, const uint8_t *bgra)
+{
+    int32_t dist[256];
+    const int16_t a = bgra[3];
+    const int16_t r = (bgra[2]*a) >> 8;
+    const int16_t g = (bgra[1]*a) >> 8;
+    const int16_t b = (bgra[0]*a) >> 8;
+    int best = 0;
+
+    for (int k = 0; k < count; k++) {
+        const int32_t dr = pm[0][k] - r, dg = pm[1][k] - g, db = pm[2][k] - b, da = pm[3][k] - a;
+        dist[k] = dr*dr + dg*dg + db*db + da*da;
+    }
+    for (int k = 1; k < count; k++) {
+        if (dist[k] < dist[best])
+            best = k;
+    }
+    return (uint8_t)best;
+}
+
+//Remap the event area to the palette without dithering, a pure nearest colour search.
+//Colours already seen are memoized and the index offset of entry zero is applied in the same pass.
+static void remap_nodither(const image_t* restrict rgba_img, a2b_pal_t *pal, uint8_t rle_optimise, uint8_t offset)
+{
+    const int h = rgba_img->suby2 - rgba_img->suby1 + 1;
+    int16_t pm[4][256];
+    uint32_t keys[REMAP_CACHE_SIZE];
+    uint8_t values[REMAP_CACHE_SIZE];
+    uint32_t prev_key;
+    uint8_t prev_idx;
+
+    for (int k = 0; k < pal->count; k++) {
+        const png_color *col = &pal->colors[k + rle_optimise];
+        const int16_t a = pal->trans[k + rle_optimise];
+        pm[0][k] = (col->red*a) >> 8;
+        pm[1][k] = (col->green*a) >> 8;
+        pm[2][k] = (col->blue*a) >> 8;
+        pm[3][k] = a;
     }
 
-    for (k = 0; k < liq_pal->count; k++)
+    //Every slot holds the fully transparent black key, so the cache needs no empty marker.
+    prev_key = 0;
+    prev_idx = remap_nearest(pm, pal->count, (const uint8_t *)&prev_key) + offset;
+    for (int k = 0; k < REMAP_CACHE_SIZE; k++)
+        keys[k] = prev_key;
+    memset(values, prev_idx, sizeof(values));
+    //Pixels outside of the event area are never written.
+    memset(pal->bitmap, offset, rgba_img->width*h);
+
+    for (int y = 0; y < h; y++) {
+        const uint32_t *row = (const uint32_t *)(rgba_img->buffer + (y + rgba_img->suby1)*rgba_img->stride);
+        uint8_t *out = pal->bitmap + y*rgba_img->width;
+
+        for (int x = rgba_img->subx1; x <= rgba_img->subx2; x++) {
+            const uint32_t key = row[x];
+
+            if (key != prev_key) {
+                const uint32_t slot = remap_hash(key);
+                if (keys[slot] != key) {
+                    keys[slot] = key;
+                    values[slot] = remap_nearest(pm, pal->count, (const uint8_t *)&row[x]) + offset;
+                }
+                prev_key = key;
+                prev_idx = values[slot];
+            }
+            out[x] = prev_idx;
+        }
+    }
+    pal->shifted = offset > 0;
+}
+
+static void palette_liq(const opts_t *args, const image_t* restrict rgba_img, liq_image *img, liq_result *res, float dither_val, a2b_pal_t *pal)
+{
+    const uint8_t rle_optimise = (args->rle_optimise > 0) & 0x01;
+    const int h = rgba_img->suby2 - rgba_img->suby1 + 1;
+
+    //Get palette from LIQ
+    const liq_palette *liq_pal = liq_get_palette(res);
+    for (int k = 0; k < liq_pal->count; k++)
     {
-        png_color* col = &palette[k+rle_optimise];
+        png_color* col = &pal->colors[k+rle_optimise];
         //palettized as BGR, flip B and R.
         col->red = liq_pal->entries[k].b;
         col->green = liq_pal->entries[k].g;
         col->blue = liq_pal->entries[k].r;
-        trans[k+rle_optimise] = liq_pal->entries[k].a;
+        pal->trans[k+rle_optimise] = liq_pal->entries[k].a;
     }
+    pal->count = liq_pal->count;
 
     //Get bitmap
-    uint8_t* bitmap = (uint8_t*)malloc(rgba_img->width*h);
-    if (bitmap == NULL) {
-        free(palette);
-        free(trans);
-        printf("Failed to allocate bitmap array for " FILENAME_FMT ".\n", count);
-        return;
+    if (dither_val <= 0.0f) {
+        //The RLE budget picks the use of entry zero on the unshifted bitmap.
+        remap_nodither(rgba_img, pal, rle_optimise, rle_optimise && !args->rle_budget);
+    } else {
+        liq_set_dithering_level(res, dither_val);
+        liq_write_remapped_image(res, img, (void*)pal->bitmap, rgba_img->width*h);
+        pal->shifted = 0;
     }
+}
 
-    liq_set_dithering_level(*res, dither_val);
-    liq_write_remapped_image(*res, *img, (void*)bitmap, rgba_img->width*h);
+//Size of the PGS run-length encoding of an indexed area, where the index zero is encoded as entry zero.
+//Entry zero runs take 2 (<64 px) or 3 bytes, other entries take 1 byte per pixel up to 2 px,
+//else 3 (<64 px) or 4 bytes. Every line ends with a 2 bytes marker.
+static uint32_t pgs_rle_size(const uint8_t *bitmap, int stride, int w, int h, int zero)
+{
+    uint32_t size = 0;
+
+    for (int y = 0; y < h; y++) {
+        const uint8_t *row = bitmap + y*stride;
+        int x = 0, run;
+
+        while (x < w) {
+            const uint8_t c = row[x];
+            for (run = 1; x + run < w && row[x + run] == c && run < 16383; run++);
+            if (c == zero)
+                size += run < 64 ? 2 : 3;
+            else
+                size += run < 3 ? run : (run < 64 ? 3 : 4);
+            x += run;
+        }
+        size += 2;
+    }
+    return size;
+}
+
+//Estimated RLE size of the largest object of the event, with the given index as entry zero.
+static uint32_t event_rle_size(const image_t *rgba_img, const a2b_pal_t *pal, uint8_t is_split, int zero)
+{
+    uint32_t size = 0;
+
+    if (is_split) {
+        for (int k = 0; k < 2; k++) {
+            const BoundingBox_t *crop = &rgba_img->crops[k];
+            const uint8_t *start = pal->bitmap + (crop->y1 - rgba_img->suby1)*rgba_img->width + crop->x1;
+            size = MAX(size, pgs_rle_size(start, rgba_img->width, crop->x2 - crop->x1 + 1, crop->y2 - crop->y1 + 1, zero));
+        }
+    } else {
+        size = pgs_rle_size(pal->bitmap + rgba_img->subx1, rgba_img->width, rgba_img->subx2 - rgba_img->subx1 + 1,
+                            rgba_img->suby2 - rgba_img->suby1 + 1, zero);
+    }
+    return size;
+}
+
+//Pick the cheapest use of palette entry zero and return the estimated size of the largest object.
+//With RLE optimisation, entry zero is either left unused or given to the transparent colour,
+//whose long runs are cheaper to encode than those of any other entry.
+static uint32_t rle_layout(const opts_t *args, const image_t *rgba_img, a2b_pal_t *pal, uint8_t is_split)
+{
+    const uint8_t rle_optimise = (args->rle_optimise > 0) & 0x01;
+    uint32_t size, size_zero;
+    int transparent = -1;
+
+    pal->zero = -1;
+    if (!rle_optimise)
+        return event_rle_size(rgba_img, pal, is_split, 0);
+
+    size = event_rle_size(rgba_img, pal, is_split, -1);
+    for (int k = 0; k < pal->count && transparent < 0; k++) {
+        if (pal->trans[k + rle_optimise] == 0)
+            transparent = k;
+    }
+    if (transparent >= 0) {
+        size_zero = event_rle_size(rgba_img, pal, is_split, transparent);
+        if (size_zero < size) {
+            pal->zero = transparent;
+            size = size_zero;
+        }
+    }
+    return size;
+}
+
+static int write_png_palette(a2b_enc_t *enc, uint32_t count, image_t* restrict rgba_img, a2b_pal_t *pal, uint8_t is_split)
+{
+    const opts_t *args = enc->args;
+    FILE *fp;
+    png_structp png_ptr;
+    png_infop info_ptr;
+
+    int k, w, h;
+    int h_margin, w_margin;
+    int ret = A2B_OK;
+    char fname[FILENAME_MAX_LENGTH];
+
+    w = rgba_img->subx2 - rgba_img->subx1 + 1;
+    h = rgba_img->suby2 - rgba_img->suby1 + 1;
+    h_margin = 0;
+    uint8_t rle_optimise = (args->rle_optimise > 0) & 0x01;
+    png_color *palette = pal->colors;
+    png_byte *trans = pal->trans;
+    uint8_t *bitmap = pal->bitmap;
 
     //One pixel of palette entry zero needs at least two bytes to be encoded with PGS.
     //This is an issue whenever the color index changes frequently due to max line coding limit.
     //To avoid RLE line length overshoot, this palette entry may not be used.
-    if (rle_optimise) {
+    if (rle_optimise && pal->zero >= 0) {
+        //Unless it is cheaper to give it to the transparent colour (--rle-budget).
         for (k = 0; k < rgba_img->width*h; k++)
+            bitmap[k] = bitmap[k] == pal->zero ? 0 : bitmap[k] + 1;
+        memcpy(&palette[0], &palette[pal->zero + 1], sizeof(png_color));
+        trans[0] = trans[pal->zero + 1];
+    } else if (rle_optimise) {
+        for (k = 0; !pal->shifted && k < rgba_img->width*h; k++)
             bitmap[k] += 1;
         memcpy(&palette[0], &palette[bitmap[0]], sizeof(png_color));
         trans[0] = trans[bitmap[0]];
@@ -154,27 +796,24 @@ static void write_png_palette(uint32_t count, image_t* restrict rgba_img, liq_im
 
     for (uint8_t split_cnt = 0; split_cnt < MIN(2, 1 + is_split); split_cnt++) {
         if (is_split) {
-            snprintf(fname, FILENAME_MAX_LENGTH, FILENAME_FMT FILENAME_CNT FILENAME_EXT, count, split_cnt);
+            image_fname(fname, args, count, split_cnt);
             w = rgba_img->crops[split_cnt].x2 - rgba_img->crops[split_cnt].x1 + 1;
             h = rgba_img->crops[split_cnt].y2 - rgba_img->crops[split_cnt].y1 + 1;
             w_margin = rgba_img->crops[split_cnt].x1;
             h_margin = rgba_img->crops[split_cnt].y1 - rgba_img->suby1;
         } else {
             w_margin = rgba_img->subx1;
-            snprintf(fname, FILENAME_MAX_LENGTH, FILENAME_FMT FILENAME_EXT, count);
+            image_fname(fname, args, count, -1);
         }
 
-        png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+        png_ptr = arena_png_create(&enc->arena);
         info_ptr = png_create_info_struct(png_ptr);
 
         if (setjmp(png_jmpbuf(png_ptr))) {
             png_destroy_write_struct(&png_ptr, &info_ptr);
             fclose(fp);
-            free(trans);
-            free(palette);
-            free(bitmap);
-            printf("Critical error in libpng while processing %s.\n", fname);
-            return;
+            a2b_log(A2B_LOG_ERROR, "Critical error in libpng while processing %s.", fname);
+            return A2B_ERR_PNG;
         }
 
         fp = fopen(fname, "wb");
@@ -187,28 +826,33 @@ static void write_png_palette(uint32_t count, image_t* restrict rgba_img, liq_im
                          PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
             //Write palette and alpha
-            png_set_PLTE(png_ptr, info_ptr, palette, liq_pal->count + rle_optimise);
-            png_set_tRNS(png_ptr, info_ptr, trans, liq_pal->count + rle_optimise, NULL);
+            png_set_PLTE(png_ptr, info_ptr, palette, pal->count + rle_optimise);
+            png_set_tRNS(png_ptr, info_ptr, trans, pal->count + rle_optimise, NULL);
             png_write_info(png_ptr, info_ptr);
 
             png_byte *row;
+            uint64_t digest = FNV64_INIT;
             for (int k = 0; k < h; k++) {
                 row = (png_byte*)(bitmap + (k + h_margin)*rgba_img->width + w_margin);
                 png_write_row(png_ptr, row);
+                for (int x = 0; args->digest && x < w; x++)
+                    digest = fnv64_rgba(digest, palette[row[x]].red, palette[row[x]].green, palette[row[x]].blue, trans[row[x]]);
             }
+            rgba_img->digest[split_cnt] = digest;
             png_write_end(png_ptr, NULL);
             png_destroy_write_struct(&png_ptr, &info_ptr);
+            enc->stats.images++;
+            enc->stats.bytes += ftell(fp);
             fclose(fp);
         } else {
-            printf("Failed to write %s.\n", fname);
+            a2b_log(A2B_LOG_ERROR, "Failed to write %s.", fname);
+            ret = A2B_ERR_PNG;
         }
     }
-    free(bitmap);
-    free(trans);
-    free(palette);
+    return ret;
 }
 
-static void write_png(char *fname, image_t* restrict img)
+static int write_png(a2b_enc_t *enc, char *fname, image_t* restrict img, uint64_t *digest)
 {
     FILE *fp;
     png_structp png_ptr;
@@ -221,21 +865,45 @@ static void write_png(char *fname, image_t* restrict img)
     w = img->subx2 - img->subx1 + 1;
     h = img->suby2 - img->suby1 + 1;
 
-    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING,
-                                      NULL, NULL, NULL);
+    //Full frame bitmaps are filtered and deflated by bands on all cores.
+    if ((int64_t)w*h >= PNGPAR_MIN_PIXELS) {
+        long size = 0;
+
+        *digest = FNV64_INIT;
+        for (k = 0; enc->args->digest && k < h; k++) {
+            const uint8_t *row = img_s + img->stride * k + img->subx1 * 4;
+            for (int x = 0; x < w*4; x += 4)
+                *digest = fnv64_rgba(*digest, row[x+2], row[x+1], row[x], row[x+3]);
+        }
+        int ret = write_png_parallel(fname, img_s + img->subx1 * 4, img->stride, w, h, 3, &size);
+        if (ret == A2B_OK) {
+            enc->stats.images++;
+            enc->stats.bytes += size;
+        }
+        return ret;
+    }
+
+    row_pointers = arena_rows(&enc->arena, h);
+    if (row_pointers == NULL) {
+        a2b_log(A2B_LOG_ERROR, "Failed to allocate row pointers for %s.", fname);
+        return A2B_ERR_ALLOC;
+    }
+
+    png_ptr = arena_png_create(&enc->arena);
     info_ptr = png_create_info_struct(png_ptr);
     fp = NULL;
 
     if (setjmp(png_jmpbuf(png_ptr))) {
         png_destroy_write_struct(&png_ptr, &info_ptr);
         fclose(fp);
-        return;
+        return A2B_ERR_PNG;
     }
 
     fp = fopen(fname, "wb");
     if (fp == NULL) {
-        printf("PNG Error opening %s for writing!\n", fname);
-        return;
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        a2b_log(A2B_LOG_ERROR, "PNG Error opening %s for writing!", fname);
+        return A2B_ERR_PNG;
     }
 
     png_init_io(png_ptr, fp);
@@ -249,81 +917,292 @@ static void write_png(char *fname, image_t* restrict img)
 
     png_set_bgr(png_ptr);
 
-    row_pointers = (png_byte **) malloc(h * sizeof(png_byte *));
-
     for (k = 0; k < h; k++) {
         row_pointers[k] = img_s + img->stride * k + img->subx1 * 4;
     }
 
     png_write_image(png_ptr, row_pointers);
     png_write_end(png_ptr, info_ptr);
-    png_destroy_write_struct(&png_ptr, &info_ptr);
 
-    free(row_pointers);
+    *digest = FNV64_INIT;
+    for (k = 0; enc->args->digest && k < h; k++) {
+        for (int x = 0; x < w*4; x += 4) {
+            *digest = fnv64_rgba(*digest, row_pointers[k][x+2], row_pointers[k][x+1], row_pointers[k][x], row_pointers[k][x+3]);
+        }
+    }
+    png_destroy_write_struct(&png_ptr, &info_ptr);
 
+    enc->stats.images++;
+    enc->stats.bytes += ftell(fp);
     fclose(fp);
+    return A2B_OK;
 }
 
-static void init(opts_t *args, liqopts_t *liqargs)
+const char *a2b_strerror(int err)
 {
-    if (fesetround(FE_TONEAREST)) {
-        printf(A2B_LOG_PREFIX "failed to set configure rounding method. Bitmaps may suffer from colour drift.\n");
+    switch (err) {
+        case A2B_OK:           return "success";
+        case A2B_ERR_ALLOC:    return "memory allocation failed";
+        case A2B_ERR_ARGS:     return "invalid parameters";
+        case A2B_ERR_LIBASS:   return "libass initialisation failed";
+        case A2B_ERR_TRACK:    return "subtitle track could not be loaded";
+        case A2B_ERR_QUANTIZE: return "quantization failed";
+        case A2B_ERR_PNG:      return "PNG output failed";
+        case A2B_ERR_XML:      return "XML output failed";
+        case A2B_ERR_SINK:     return "event sink aborted";
+        case A2B_ERR_REPORT:   return "report differs from baseline";
+        default:               return "unknown error";
+    }
+}
+
+static void reuse_clear(a2b_reuse_t *reuse)
+{
+    for (uint32_t k = 0; k < reuse->size; k++)
+        free(reuse->slots[k].pixels);
+    free(reuse->slots);
+    free(reuse->outdir);
+    memset(reuse, 0, sizeof(a2b_reuse_t));
+}
+
+void a2b_done(a2b_ctx_t *ctx)
+{
+    if (ctx == NULL)
+        return;
+    if (ctx->attr)
+        liq_attr_destroy(ctx->attr);
+    if (ctx->ass_renderer)
+        ass_renderer_done(ctx->ass_renderer);
+    if (ctx->ass_library)
+        ass_library_done(ctx->ass_library);
+    reuse_clear(&ctx->reuse);
+    free(ctx->fontdir);
+    free(ctx);
+}
+
+#define DIM_COLOR(c, p) (uint8_t)(round(p*(float)c))
+#define LUT_GAMMA (2.4)
+#define LUT_MATRIX_SHIFT (14)
+#define LUT_DIM_SHIFT (16)
+#define LUT_DEFAULT_NITS (203)
+
+//BT.2087 linear light conversion.
+static const double bt709_to_bt2020[9] = {
+    0.627404, 0.329283, 0.043313,
+    0.069097, 0.919540, 0.011362,
+    0.016391, 0.088013, 0.895595,
+};
+
+//Output code value of a linear light level, 1.0 is the graphics white.
+static double lut_transfer(double l, const opts_t *args)
+{
+    const double nits = args->nits ? args->nits : LUT_DEFAULT_NITS;
+
+    switch (args->colorspace) {
+        case A2B_CS_BT2020_PQ:
+        {
+            const double m1 = 2610.0/16384, m2 = 2523.0/4096*128;
+            const double c1 = 3424.0/4096, c2 = 2413.0/4096*32, c3 = 2392.0/4096*32;
+            const double y = pow(l*nits/10000.0, m1);
+            return pow((c1 + c2*y)/(1.0 + c3*y), m2);
+        }
+        case A2B_CS_BT2020_HLG:
+        {
+            const double a = 0.17883277, b = 0.28466892, c = 0.55991073;
+            //Inverse OOTF of the 1000 nits reference display, then the OETF.
+            const double e = pow(MIN(1.0, l*nits/1000.0), 1.0/1.2);
+            return e <= 1.0/12 ? sqrt(3.0*e) : a*log(12.0*e - b) + c;
+        }
+        default:
+            return pow(l, 1.0/LUT_GAMMA);
     }
+}
 
-    ass_library = ass_library_init();
-    if (!ass_library) {
-        printf("ass_library_init failed!\n");
-        exit(1);
+static void lut_setup(a2b_lut_t *lut, const opts_t *args)
+{
+    const long base = lrint((args->dim_flag ? args->dimf : 1.0)*(1 << LUT_DIM_SHIFT));
+
+    lut->convert = args->colorspace != A2B_CS_BT709;
+    lut->active = args->dim_flag || lut->convert;
+
+    for (int c = 0; c < 256; c++) {
+        lut->dim[c] = args->dim_flag ? DIM_COLOR(c, args->dimf) : c;
+        lut->linear[c] = (uint16_t)lrint(pow(lut->dim[c]/255.0, LUT_GAMMA)*65535.0);
     }
+    //DIM_COLOR rounds a float product: the neighbours of the nearest factor are tried too, each
+    //with the range of biases that reproduce every value. A few factors have none.
+    lut->dim_linear = 0;
+    for (long mul = MAX(0, base - 2); mul <= base + 2 && !lut->dim_linear; mul++) {
+        long lo = 0, hi = (1 << LUT_DIM_SHIFT) - 1;
+
+        for (int c = 0; c < 256; c++) {
+            lo = MAX(lo, ((long)lut->dim[c] << LUT_DIM_SHIFT) - c*mul);
+            hi = MIN(hi, (((long)lut->dim[c] + 1) << LUT_DIM_SHIFT) - 1 - c*mul);
+        }
+        if (lo <= hi) {
+            lut->dim_mul = (uint32_t)mul;
+            lut->dim_bias = (uint32_t)lo;
+            lut->dim_linear = 1;
+        }
+    }
+    if (!lut->convert)
+        return;
+    for (int k = 0; k < 9; k++)
+        lut->matrix[k] = (int32_t)lrint(bt709_to_bt2020[k]*(1 << LUT_MATRIX_SHIFT));
+    for (int k = 0; k < 65536; k++)
+        lut->encode[k] = (uint8_t)lrint(255.0*MIN(1.0, lut_transfer(k/65535.0, args)));
+}
 
-    ass_set_message_cb(ass_library, msg_callback, NULL);
+static liq_attr *liq_attr_setup(const opts_t *args, const liqopts_t *liqargs)
+{
+    liq_attr *attr = liq_attr_create();
 
-    // fonts stuff
-    ass_set_extract_fonts(ass_library, 1);
-    if (args->fontdir) {
-        ass_set_fonts_dir(ass_library, args->fontdir);
+    if (attr == NULL) {
+        a2b_log(A2B_LOG_ERROR, "Failed to initialise libimagequant.");
+        return NULL;
     }
+    liq_set_max_colors(attr, args->quantize);
+    liq_set_quality(attr, 0, liqargs->max_quality);
+    liq_set_speed(attr, liqargs->speed);
+
+    //Palette entry 0xFF must always be transparent.
+    if (args->quantize + args->rle_optimise >= 256)
+        liq_set_last_index_transparent(attr, 1);
+
+    a2b_log(A2B_LOG_INFO, "libimagequant: Version %s", LIQ_VERSION_STRING);
+    a2b_log(A2B_LOG_INFO, "libimagequant: Settings: max-colors=%d, max-quality=%d, speed=%d, dithering=%.02f",
+            liq_get_max_colors(attr), liq_get_max_quality(attr), liq_get_speed(attr), liqargs->dither);
+    return attr;
+}
+
+static int same_path(const char *a, const char *b)
+{
+    return (a == NULL && b == NULL) || (a && b && !strcmp(a, b));
+}
+
+//The recorded PNGs stay valid for a configuration writing to the same directory after them.
+static int reuse_keep(const a2b_reuse_t *reuse, const opts_t *args)
+{
+    return args->shared_pngs && same_path(reuse->outdir, args->outdir) && args->index_base >= reuse->next;
+}
 
-    ass_renderer = ass_renderer_init(ass_library);
-    if (!ass_renderer) {
-        printf("ass_renderer_init failed!\n");
-        exit(1);
+int a2b_configure(a2b_ctx_t *ctx, opts_t *args, liqopts_t *liqargs)
+{
+    //A font directory change is the only setting that forces a new font scan.
+    if (!same_path(ctx->fontdir, args->fontdir)) {
+        free(ctx->fontdir);
+        ctx->fontdir = args->fontdir ? strdup(args->fontdir) : NULL;
+        if (args->fontdir && !ctx->fontdir)
+            return A2B_ERR_ALLOC;
+        ass_set_fonts_dir(ctx->ass_library, ctx->fontdir);
+        ass_set_fonts(ctx->ass_renderer, NULL, "sans-serif",
+                      ASS_FONTPROVIDER_AUTODETECT, NULL, 1);
     }
-    ass_set_frame_size(ass_renderer, args->render_w, args->render_h);
+    if (!reuse_keep(&ctx->reuse, args)) {
+        reuse_clear(&ctx->reuse);
+        if (args->shared_pngs && args->outdir && !(ctx->reuse.outdir = strdup(args->outdir)))
+            return A2B_ERR_ALLOC;
+    }
+    ctx->args = *args;
+    ctx->args.fontdir = ctx->fontdir;
+    ctx->liqargs = *liqargs;
+    lut_setup(&ctx->lut, args);
+
+    ass_set_frame_size(ctx->ass_renderer, args->render_w, args->render_h);
     if (args->par > 0) {
-        ass_set_pixel_aspect(ass_renderer, args->par);
+        ass_set_pixel_aspect(ctx->ass_renderer, args->par);
     } else {
-        ass_set_storage_size(ass_renderer, args->storage_w, args->storage_h);
+        ass_set_storage_size(ctx->ass_renderer, args->storage_w, args->storage_h);
     }
 
-    ass_set_fonts(ass_renderer, NULL, "sans-serif",
-                  ASS_FONTPROVIDER_AUTODETECT, NULL, 1);
-
     if (args->hinting >= 0 && args->hinting <= ASS_HINTING_NATIVE) {
-        ass_set_hinting(ass_renderer, (ASS_Hinting)args->hinting);
+        ass_set_hinting(ctx->ass_renderer, (ASS_Hinting)args->hinting);
     } else {
-        printf("Incorrect hinting value.\n");
-        exit(1);
+        a2b_log(A2B_LOG_ERROR, "Incorrect hinting value.");
+        return A2B_ERR_ARGS;
+    }
+
+    if (ctx->attr) {
+        liq_attr_destroy(ctx->attr);
+        ctx->attr = NULL;
     }
 
     if (args->quantize) {
-        attr = liq_attr_create();
-        if (attr == NULL) {
-            printf("Failed to initialise libimagequant.\n");
-            exit(1);
-        }
-        liq_set_max_colors(attr, args->quantize);
-        liq_set_quality(attr, 0, liqargs->max_quality);
-        liq_set_speed(attr, liqargs->speed);
+        ctx->attr = liq_attr_setup(args, liqargs);
+        if (ctx->attr == NULL)
+            return A2B_ERR_QUANTIZE;
+    }
+    return A2B_OK;
+}
 
-        //Palette entry 0xFF must always be transparent.
-        if (args->quantize + args->rle_optimise >= 256)
-            liq_set_last_index_transparent(attr, 1);
+a2b_ctx_t *a2b_init(opts_t *args, liqopts_t *liqargs, int *err)
+{
+    a2b_ctx_t *ctx = calloc(1, sizeof(a2b_ctx_t));
+    *err = A2B_OK;
 
-        printf("libimagequant: Version %s\n", LIQ_VERSION_STRING);
-        printf("libimagequant: Settings: max-colors=%d, max-quality=%d, speed=%d, dithering=%.02f\n",
-                liq_get_max_colors(attr), liq_get_max_quality(attr), liq_get_speed(attr), liqargs->dither);
+    if (ctx == NULL) {
+        *err = A2B_ERR_ALLOC;
+        return NULL;
     }
+
+    ctx->ass_library = ass_library_init();
+    if (!ctx->ass_library) {
+        a2b_log(A2B_LOG_ERROR, "ass_library_init failed!");
+        *err = A2B_ERR_LIBASS;
+        goto fail;
+    }
+
+    ass_set_message_cb(ctx->ass_library, msg_callback, NULL);
+
+    // fonts stuff
+    ass_set_extract_fonts(ctx->ass_library, 1);
+    if (args->fontdir) {
+        ctx->fontdir = strdup(args->fontdir);
+        if (!ctx->fontdir) {
+            *err = A2B_ERR_ALLOC;
+            goto fail;
+        }
+        ass_set_fonts_dir(ctx->ass_library, ctx->fontdir);
+    }
+
+    ctx->ass_renderer = ass_renderer_init(ctx->ass_library);
+    if (!ctx->ass_renderer) {
+        a2b_log(A2B_LOG_ERROR, "ass_renderer_init failed!");
+        *err = A2B_ERR_LIBASS;
+        goto fail;
+    }
+
+    ass_set_fonts(ctx->ass_renderer, NULL, "sans-serif",
+                  ASS_FONTPROVIDER_AUTODETECT, NULL, 1);
+
+    *err = a2b_configure(ctx, args, liqargs);
+    if (*err)
+        goto fail;
+    return ctx;
+
+fail:
+    a2b_done(ctx);
+    return NULL;
+}
+
+void a2b_get_stats(a2b_ctx_t *ctx, a2b_stats_t *stats)
+{
+    *stats = ctx->stats;
+}
+
+void a2b_set_monitor(a2b_ctx_t *ctx, const a2b_monitor_t *monitor)
+{
+    if (monitor)
+        ctx->monitor = *monitor;
+    else
+        memset(&ctx->monitor, 0, sizeof(ctx->monitor));
+}
+
+void a2b_set_trace(a2b_ctx_t *ctx, const a2b_trace_t *trace)
+{
+    if (trace)
+        ctx->trace = *trace;
+    else
+        memset(&ctx->trace, 0, sizeof(ctx->trace));
 }
 
 #define _r(c)  ((c)>>24)
@@ -337,7 +1216,8 @@ static void init(opts_t *args, liqopts_t *liqargs)
 #define ablend(iA, oA, iC, oC, nA) \
     lrint((iA * 255 * iC + (65025 - iA) * oC * oA) / (float)nA)
 
-static void blend_single(image_t* restrict frame, ASS_Image *img)
+//Blend the part of img within clip, inclusive frame coordinates.
+static void blend_area(image_t* restrict frame, const ASS_Image *img, const BoundingBox_t *clip)
 {
     int x, y, c;
     uint32_t outa, k;
@@ -345,15 +1225,25 @@ static void blend_single(image_t* restrict frame, ASS_Image *img)
     uint8_t r = _r(img->color);
     uint8_t g = _g(img->color);
     uint8_t b = _b(img->color);
+    const int x1 = MAX(0, clip->x1 - img->dst_x), x2 = MIN(img->w, clip->x2 + 1 - img->dst_x);
+    const int y1 = MAX(0, clip->y1 - img->dst_y), y2 = MIN(img->h, clip->y2 + 1 - img->dst_y);
 
     uint8_t *src;
     uint8_t *dst;
+    uint8_t *alpha;
+    int *span;
+
+    if (x1 >= x2 || y1 >= y2)
+        return;
+    src = img->bitmap + y1 * img->stride;
+    dst = frame->buffer + (img->dst_y + y1) * frame->stride + img->dst_x * 4;
+    alpha = frame->alpha + (img->dst_y + y1) * frame->width + img->dst_x;
+    span = frame->spans + 2*(img->dst_y + y1);
 
-    src = img->bitmap;
-    dst = frame->buffer + img->dst_y * frame->stride + img->dst_x * 4;
+    for (y = y1; y < y2; y++) {
+        int first = -1, last = -1;
 
-    for (y = 0; y < img->h; y++) {
-        for (x = 0, c = 0; x < img->w; x++, c += 4) {
+        for (x = x1, c = x1*4; x < x2; x++, c += 4) {
             k = src[x] * opacity;
 
             if (k) {
@@ -370,63 +1260,112 @@ static void blend_single(image_t* restrict frame, ASS_Image *img)
                     dst[c+2] = r;
                     dst[c+3] = div255P(k);
                 }
+                //Alpha never decreases, but a faint pixel may still round to 0.
+                alpha[x] = dst[c+3];
+                if (alpha[x]) {
+                    if (first < 0)
+                        first = x;
+                    last = x;
+                }
             }
         }
+        if (first >= 0) {
+            span[0] = MIN(span[0], img->dst_x + first);
+            span[1] = MAX(span[1], img->dst_x + last);
+        }
 
         src += img->stride;
         dst += frame->stride;
+        alpha += frame->width;
+        span += 2;
     }
 }
 
-#define DIM_COLOR(c, p) (uint8_t)(round(p*(float)c))
-
-static void blend(image_t* restrict frame, ASS_Image *img, const opts_t *args)
+static void blend_single(image_t* restrict frame, ASS_Image *img)
 {
-    int x, y, c;
-    uint8_t *buf = frame->buffer;
+    const BoundingBox_t all = {img->dst_x, img->dst_x + img->w - 1, img->dst_y, img->dst_y + img->h - 1};
 
-    image_reset(frame);
+    blend_area(frame, img, &all);
+}
 
-    while (img) {
-        blend_single(frame, img);
-        img = img->next;
+#define COLOR_CHUNK (256)
+
+//Dimming of a row: the channels are scaled by lut->dim_mul without branches so the loop vectorizes.
+//Transparent pixels are left as they are.
+static void color_dim_row(uint8_t* restrict px, int w, uint32_t mul, uint32_t bias)
+{
+    for (int x = 0; x < w; x++, px += 4) {
+        const int keep = px[3] == 0;
+
+        for (int c = 0; c < 3; c++) {
+            const uint8_t v = (uint8_t)((px[c]*mul + bias) >> LUT_DIM_SHIFT);
+            px[c] = keep ? px[c] : v;
+        }
     }
+}
 
-    for (y = 0; y < frame->height; y++) {
-        for (x = 0, c = 0; x < frame->width; x++, c += 4) {
-            uint8_t k = buf[c + 3];
+//Conversion of a row in chunks: table lookups to linear light, the primaries matrix on planar
+//buffers, which vectorizes, then table lookups of the output transfer.
+static void color_convert_row(uint8_t* restrict px, int w, const a2b_lut_t *lut)
+{
+    int32_t rgb[3][COLOR_CHUNK];
+    uint16_t out[3][COLOR_CHUNK];
 
-            if (k) {
-                /* Some DVD and BD players need the offsets to be on mod2
-                 * positions and will misrender subtitles or crash if they
-                 * are not. Yeah, really. */
-                if (frame->subx1 < 0) frame->subx1 = x - (x % 2);
-                else frame->subx1 = MIN(frame->subx1, x - (x % 2));
-
-                if (frame->suby1 < 0) frame->suby1 = y - (y % 2);
-                else frame->suby1 = MIN(frame->suby1, y - (y % 2));
-
-                frame->subx2 = MAX(frame->subx2, x);
-                frame->suby2 = MAX(frame->suby2, y);
-
-                if (args->dim_flag) {
-                    buf[c  ] = DIM_COLOR(buf[c  ], args->dimf);
-                    buf[c+1] = DIM_COLOR(buf[c+1], args->dimf);
-                    buf[c+2] = DIM_COLOR(buf[c+2], args->dimf);
-                }
-            }
+    for (int x0 = 0; x0 < w; x0 += COLOR_CHUNK, px += 4*COLOR_CHUNK) {
+        const int n = MIN(COLOR_CHUNK, w - x0);
+
+        for (int x = 0; x < n; x++) {
+            rgb[0][x] = lut->linear[px[4*x + 2]];
+            rgb[1][x] = lut->linear[px[4*x + 1]];
+            rgb[2][x] = lut->linear[px[4*x]];
         }
+        for (int k = 0; k < 3; k++) {
+            const int32_t m0 = lut->matrix[3*k], m1 = lut->matrix[3*k + 1], m2 = lut->matrix[3*k + 2];
 
-        buf += frame->stride;
+            for (int x = 0; x < n; x++) {
+                const int32_t l = (m0*rgb[0][x] + m1*rgb[1][x] + m2*rgb[2][x] + (1 << (LUT_MATRIX_SHIFT - 1))) >> LUT_MATRIX_SHIFT;
+                out[k][x] = (uint16_t)MAX(0, MIN(65535, l));
+            }
+        }
+        for (int x = 0; x < n; x++) {
+            if (px[4*x + 3] == 0)
+                continue;
+            px[4*x + 2] = lut->encode[out[0][x]];
+            px[4*x + 1] = lut->encode[out[1][x]];
+            px[4*x] = lut->encode[out[2][x]];
+        }
     }
-    if (args->full_bitmaps) {
-        frame->subx1 = frame->suby1 = 0;
-        frame->subx2 = frame->width - 1;
-        frame->suby2 = frame->height - 1;
+}
+
+//Apply the colour stage to the visible pixels of area. Only the table lookups remain per pixel,
+//the arithmetic runs on whole rows.
+static void color_apply(image_t* restrict frame, const a2b_lut_t *lut, const BoundingBox_t *area)
+{
+    const int w = area->x2 - area->x1 + 1;
+
+    for (int y = area->y1; y <= area->y2; y++) {
+        uint8_t *px = frame->buffer + y*frame->stride + area->x1*4;
+
+        if (lut->convert) {
+            color_convert_row(px, w, lut);
+        } else if (lut->dim_linear) {
+            color_dim_row(px, w, lut->dim_mul, lut->dim_bias);
+        } else {
+            for (int x = 0; x < w; x++, px += 4) {
+                if (px[3] == 0)
+                    continue;
+                px[0] = lut->dim[px[0]];
+                px[1] = lut->dim[px[1]];
+                px[2] = lut->dim[px[2]];
+            }
+        }
     }
+}
 
-    //Ensure minimum width and height of 8 pixels.
-    c = (frame->subx2 - frame->subx1) - 8;
+//Ensure minimum width and height of 8 pixels.
+static void image_min_size(image_t *frame)
+{
+    int c = (frame->subx2 - frame->subx1) - 8;
     if (c < 0) {
         c = abs(c);
         if (frame->subx2 + c < frame->width)
@@ -444,49 +1383,426 @@ static void blend(image_t* restrict frame, ASS_Image *img, const opts_t *args)
     }
 }
 
+static void blend(image_t* restrict frame, ASS_Image *img, const opts_t *args, const a2b_lut_t *lut)
+{
+    image_reset(frame);
+
+    while (img) {
+        blend_single(frame, img);
+        img = img->next;
+    }
+
+    image_span_bbox(frame);
+    //Colour work is limited to the event area.
+    if (lut->active && frame->subx1 >= 0) {
+        const BoundingBox_t area = {frame->subx1, frame->subx2, frame->suby1, frame->suby2};
+        color_apply(frame, lut, &area);
+    }
+    if (args->full_bitmaps) {
+        frame->subx1 = frame->suby1 = 0;
+        frame->subx2 = frame->width - 1;
+        frame->suby2 = frame->height - 1;
+    }
+
+    image_min_size(frame);
+}
+
+static int comp_same(const ASS_Image *a, const ASS_Image *b)
+{
+    return a->bitmap == b->bitmap && a->color == b->color && a->dst_x == b->dst_x && a->dst_y == b->dst_y &&
+           a->w == b->w && a->h == b->h && a->stride == b->stride;
+}
+
+//Mark an area to redraw, nested areas are skipped and too many are merged in one.
+static void comp_dirty(a2b_comp_t *comp, int x1, int y1, int x2, int y2)
+{
+    BoundingBox_t *box;
+
+    if (x1 > x2 || y1 > y2)
+        return;
+    for (int k = 0; k < comp->ndirty; k++) {
+        box = &comp->dirty[k];
+        if (box->x1 <= x1 && box->y1 <= y1 && box->x2 >= x2 && box->y2 >= y2)
+            return;
+    }
+    if (comp->ndirty == COMP_MAX_DIRTY) {
+        for (int k = 0; k < comp->ndirty; k++) {
+            x1 = MIN(x1, comp->dirty[k].x1);
+            y1 = MIN(y1, comp->dirty[k].y1);
+            x2 = MAX(x2, comp->dirty[k].x2);
+            y2 = MAX(y2, comp->dirty[k].y2);
+        }
+        comp->ndirty = 0;
+    }
+    box = &comp->dirty[comp->ndirty++];
+    box->x1 = x1; box->y1 = y1;
+    box->x2 = x2; box->y2 = y2;
+}
+
+static int comp_init(a2b_comp_t *comp, int width, int height, const a2b_lut_t *lut)
+{
+    memset(comp, 0, sizeof(*comp));
+    comp->box.x1 = -1;
+    if (lut->active) {
+        comp->layer = image_init(width, height);
+        if (comp->layer == NULL)
+            return A2B_ERR_ALLOC;
+    }
+    return A2B_OK;
+}
+
+static void comp_free(a2b_comp_t *comp)
+{
+    free(comp->imgs);
+    free(comp->prev);
+    image_free(comp->layer);
+    memset(comp, 0, sizeof(*comp));
+}
+
+//blend() for consecutive frames of a renderer: only the areas of the images that differ from
+//the last blended chain are cleared and recomposited, with all the images that cover them.
+//Pixels elsewhere are covered by the same images in the same order and are kept, as is the
+//colour stage applied to them. The spans of the redrawn rows are rescanned from the alpha
+//plane and give the bounding box.
+static void blend_incremental(a2b_comp_t *comp, image_t* restrict frame, ASS_Image *img, const opts_t *args, const a2b_lut_t *lut)
+{
+    image_t *layer = comp->layer ? comp->layer : frame;
+    const BoundingBox_t box = comp->box;
+    ASS_Image *swap;
+    int n = 0, head = 0, tail = 0, k;
+
+    for (ASS_Image *it = img; it; it = it->next)
+        n++;
+    if (n > comp->size) {
+        ASS_Image *prev = realloc(comp->prev, n*sizeof(ASS_Image));
+        ASS_Image *imgs = prev ? realloc(comp->imgs, n*sizeof(ASS_Image)) : NULL;
+
+        if (prev)
+            comp->prev = prev;
+        if (imgs == NULL) {
+            //Full blend, the next frame starts over.
+            blend(frame, img, args, lut);
+            comp->valid = 0;
+            comp->box = (BoundingBox_t){0, frame->width - 1, 0, frame->height - 1};
+            return;
+        }
+        comp->imgs = imgs;
+        comp->size = n;
+    }
+    swap = comp->prev;
+    comp->prev = comp->imgs;
+    comp->imgs = swap;
+    n = 0;
+    for (ASS_Image *it = img; it; it = it->next)
+        comp->imgs[n++] = *it;
+
+    comp->ndirty = 0;
+    if (comp->valid) {
+        const int m = comp->count;
+
+        while (head < MIN(n, m) && comp_same(&comp->imgs[head], &comp->prev[head]))
+            head++;
+        while (tail < MIN(n, m) - head && comp_same(&comp->imgs[n - 1 - tail], &comp->prev[m - 1 - tail]))
+            tail++;
+        for (k = head; k < m - tail; k++)
+            comp_dirty(comp, comp->prev[k].dst_x, comp->prev[k].dst_y,
+                       comp->prev[k].dst_x + comp->prev[k].w - 1, comp->prev[k].dst_y + comp->prev[k].h - 1);
+    } else if (box.x1 >= 0) {
+        comp_dirty(comp, box.x1, box.y1, box.x2, box.y2);
+    }
+    for (k = head; k < n - tail; k++)
+        comp_dirty(comp, comp->imgs[k].dst_x, comp->imgs[k].dst_y,
+                   comp->imgs[k].dst_x + comp->imgs[k].w - 1, comp->imgs[k].dst_y + comp->imgs[k].h - 1);
+    comp->count = n;
+    comp->valid = 1;
+
+    for (int d = 0; d < comp->ndirty; d++) {
+        const BoundingBox_t *area = &comp->dirty[d];
+        const int w = area->x2 - area->x1 + 1;
+
+        for (int y = area->y1; y <= area->y2; y++) {
+            memset(layer->buffer + y*layer->stride + area->x1*4, 0, w*4);
+            memset(layer->alpha + y*layer->width + area->x1, 0, w);
+        }
+        for (k = 0; k < n; k++)
+            blend_area(layer, &comp->imgs[k], area);
+        if (comp->layer) {
+            for (int y = area->y1; y <= area->y2; y++) {
+                memcpy(frame->buffer + y*frame->stride + area->x1*4, layer->buffer + y*layer->stride + area->x1*4, w*4);
+                memcpy(frame->alpha + y*frame->width + area->x1, layer->alpha + y*layer->width + area->x1, w);
+            }
+            color_apply(frame, lut, area);
+        }
+    }
+    //Cleared areas may have held the ends of the spans.
+    for (int d = 0; d < comp->ndirty; d++) {
+        for (int y = comp->dirty[d].y1; y <= comp->dirty[d].y2; y++)
+            image_span_scan(layer, y);
+        if (comp->layer)
+            memcpy(&frame->spans[2*comp->dirty[d].y1], &layer->spans[2*comp->dirty[d].y1],
+                   2*sizeof(int)*(comp->dirty[d].y2 - comp->dirty[d].y1 + 1));
+    }
+
+    image_span_bbox(layer);
+    if (layer->subx1 >= 0)
+        comp->box = (BoundingBox_t){layer->subx1, layer->subx2, layer->suby1, layer->suby2};
+    else
+        comp->box.x1 = -1;
+    frame->subx1 = layer->subx1;
+    frame->suby1 = layer->suby1;
+    frame->subx2 = layer->subx2;
+    frame->suby2 = layer->suby2;
+    if (args->full_bitmaps) {
+        frame->subx1 = frame->suby1 = 0;
+        frame->subx2 = frame->width - 1;
+        frame->suby2 = frame->height - 1;
+    }
+
+    image_min_size(frame);
+}
+
+//Area coverage weights of the source pixels of each output pixel along one axis.
+static void scale_taps(scale_taps_t *taps, int dst_len, int src_len)
+{
+    const double ratio = src_len/(double)dst_len;
+
+    for (int t = 0; t < dst_len; t++) {
+        const double start = t*ratio, end = MIN((t + 1)*ratio, (double)src_len);
+        int sum = 0;
+
+        taps[t].start = (int)start;
+        taps[t].count = 0;
+        for (int i = taps[t].start; i < end && taps[t].count < SCALE_MAX_TAPS; i++) {
+            const double cover = MIN(end, i + 1.0) - MAX(start, (double)i);
+            taps[t].w[taps[t].count] = (uint16_t)lrint(cover/ratio*(1 << SCALE_BITS));
+            sum += taps[t].w[taps[t].count++];
+        }
+        //Weights sum to exactly one, the rounding error goes to the largest.
+        int big = 0;
+        for (int k = 1; k < taps[t].count; k++)
+            big = taps[t].w[k] > taps[t].w[big] ? k : big;
+        taps[t].w[big] += (1 << SCALE_BITS) - sum;
+    }
+}
+
+static a2b_scale_t *scale_init(const image_t *src, int w, int h)
+{
+    a2b_scale_t *scale = calloc(1, sizeof(a2b_scale_t));
+
+    if (scale == NULL)
+        return NULL;
+    scale->frame = image_init(w, h);
+    scale->xtaps = malloc(w*sizeof(scale_taps_t));
+    scale->ytaps = malloc(h*sizeof(scale_taps_t));
+    scale->hrow = malloc(w*4*sizeof(uint32_t));
+    scale->acc = malloc(w*4*sizeof(uint32_t));
+    if (!scale->frame || !scale->xtaps || !scale->ytaps || !scale->hrow || !scale->acc)
+        return scale; //checked by the caller with scale->acc
+    scale_taps(scale->xtaps, w, src->width);
+    scale_taps(scale->ytaps, h, src->height);
+    scale->worst_psnr = INFINITY;
+    return scale;
+}
+
+static void scale_free(a2b_scale_t *scale)
+{
+    if (scale == NULL)
+        return;
+    image_free(scale->frame);
+    free(scale->xtaps);
+    free(scale->ytaps);
+    free(scale->hrow);
+    free(scale->acc);
+    image_free(scale->native);
+    if (scale->track)
+        ass_free_track(scale->track);
+    if (scale->renderer)
+        ass_renderer_done(scale->renderer);
+    free(scale);
+}
+
+//Area average downscale of the event area of the shared render into the derived format.
+//Pixels are averaged premultiplied, so the colour of transparent pixels does not bleed.
+static void downscale_event(a2b_scale_t *scale, image_t* restrict frame)
+{
+    const image_t *src = frame;
+    image_t *dst = scale->frame;
+    const int w4 = dst->width*4;
+    int x1, x2, y1, y2;
+
+    //Only the event area is written, clear the previous one.
+    for (int y = MAX(0, dst->suby1); dst->subx1 >= 0 && y <= dst->suby2; y++) {
+        memset(dst->buffer + y*dst->stride + dst->subx1*4, 0, (dst->subx2 - dst->subx1 + 1)*4);
+        memset(dst->alpha + y*dst->width + dst->subx1, 0, dst->subx2 - dst->subx1 + 1);
+        image_spans_reset(dst, y, y);
+    }
+
+    //Geometry of the event in the derived format, mod2 like blend().
+    x1 = (int)floor(src->subx1*(double)dst->width/src->width);
+    y1 = (int)floor(src->suby1*(double)dst->height/src->height);
+    x1 -= x1 % 2;
+    y1 -= y1 % 2;
+    x2 = MIN(dst->width - 1, (int)ceil((src->subx2 + 1)*(double)dst->width/src->width) - 1);
+    y2 = MIN(dst->height - 1, (int)ceil((src->suby2 + 1)*(double)dst->height/src->height) - 1);
+    dst->subx1 = x1; dst->subx2 = x2;
+    dst->suby1 = y1; dst->suby2 = y2;
+    image_min_size(dst);
+
+    for (int ty = dst->suby1; ty <= dst->suby2; ty++) {
+        const scale_taps_t *yt = &scale->ytaps[ty];
+        uint8_t *out = dst->buffer + ty*dst->stride;
+        uint8_t *alpha = dst->alpha + ty*dst->width;
+
+        memset(&scale->acc[dst->subx1*4], 0, (dst->subx2 - dst->subx1 + 1)*4*sizeof(uint32_t));
+        for (int ky = 0; ky < yt->count; ky++) {
+            const uint8_t *row = src->buffer + (yt->start + ky)*src->stride;
+
+            for (int tx = dst->subx1; tx <= dst->subx2; tx++) {
+                const scale_taps_t *xt = &scale->xtaps[tx];
+                const uint8_t *px = row + xt->start*4;
+                uint32_t b = 0, g = 0, r = 0, a = 0;
+
+                for (int kx = 0; kx < xt->count; kx++, px += 4) {
+                    b += xt->w[kx]*(px[0]*px[3]);
+                    g += xt->w[kx]*(px[1]*px[3]);
+                    r += xt->w[kx]*(px[2]*px[3]);
+                    a += xt->w[kx]*(255*px[3]);
+                }
+                uint32_t *h = &scale->hrow[tx*4];
+                h[0] = (b + (1 << (SCALE_BITS - 1))) >> SCALE_BITS;
+                h[1] = (g + (1 << (SCALE_BITS - 1))) >> SCALE_BITS;
+                h[2] = (r + (1 << (SCALE_BITS - 1))) >> SCALE_BITS;
+                h[3] = (a + (1 << (SCALE_BITS - 1))) >> SCALE_BITS;
+            }
+            for (int k = dst->subx1*4; k < (dst->subx2 + 1)*4 && k < w4; k++)
+                scale->acc[k] += yt->w[ky]*scale->hrow[k];
+        }
+        for (int tx = dst->subx1; tx <= dst->subx2; tx++) {
+            const uint32_t *v = &scale->acc[tx*4];
+            const uint8_t a = (uint8_t)((v[3] + (255 << (SCALE_BITS - 1))) / (255 << SCALE_BITS));
+            uint8_t *px = out + tx*4;
+
+            alpha[tx] = a;
+            if (a == 0) {
+                memset(px, 0, 4);
+                continue;
+            }
+            for (int c = 0; c < 3; c++)
+                px[c] = (uint8_t)MIN(255, ((uint64_t)v[c]*255 + v[3]/2)/v[3]);
+            px[3] = a;
+            dst->spans[2*ty] = MIN(dst->spans[2*ty], tx);
+            dst->spans[2*ty + 1] = tx;
+        }
+    }
+
+    frame->width = dst->width;
+    frame->height = dst->height;
+    frame->stride = dst->stride;
+    frame->buffer = dst->buffer;
+    frame->alpha = dst->alpha;
+    frame->spans = dst->spans;
+    frame->subx1 = dst->subx1; frame->subx2 = dst->subx2;
+    frame->suby1 = dst->suby1; frame->suby2 = dst->suby2;
+}
+
+//Native render of the derived format, with its own track so the collision state of
+//the main render is left untouched.
+static int scale_check_setup(a2b_ctx_t *ctx, a2b_scale_t *scale, const opts_t *args, const char *subfile)
+{
+    scale->renderer = ass_renderer_init(ctx->ass_library);
+    if (scale->renderer == NULL)
+        return A2B_ERR_LIBASS;
+    ass_set_frame_size(scale->renderer, args->render_w, args->render_h);
+    if (ctx->args.par > 0)
+        ass_set_pixel_aspect(scale->renderer, ctx->args.par);
+    else
+        ass_set_storage_size(scale->renderer, args->storage_w, args->storage_h);
+    ass_set_hinting(scale->renderer, (ASS_Hinting)ctx->args.hinting);
+    ass_set_fonts(scale->renderer, NULL, "sans-serif", ASS_FONTPROVIDER_AUTODETECT, NULL, 1);
+
+    scale->track = ass_read_file(ctx->ass_library, (char *)subfile, NULL);
+    if (scale->track == NULL)
+        return A2B_ERR_TRACK;
+    scale->native = image_init(args->render_w, args->render_h);
+    if (scale->native == NULL)
+        return A2B_ERR_ALLOC;
+    return A2B_OK;
+}
+
+//PSNR of the downscaled event against the native render, on premultiplied components
+//over the union of both event areas.
+static double scale_psnr(const image_t *a, const image_t *b)
+{
+    const int x1 = MAX(0, MIN(a->subx1, b->subx1)), x2 = MAX(a->subx2, b->subx2);
+    const int y1 = MAX(0, MIN(a->suby1, b->suby1)), y2 = MAX(a->suby2, b->suby2);
+    uint64_t sse = 0, n = 0;
+
+    for (int y = y1; y <= y2; y++) {
+        const uint8_t *pa = a->buffer + y*a->stride + x1*4;
+        const uint8_t *pb = b->buffer + y*b->stride + x1*4;
+
+        for (int x = x1; x <= x2; x++, pa += 4, pb += 4, n += 4) {
+            for (int c = 0; c < 3; c++) {
+                const int d = (pa[c]*pa[3] - pb[c]*pb[3])/255;
+                sse += d*d;
+            }
+            sse += (pa[3] - pb[3])*(pa[3] - pb[3]);
+        }
+    }
+    if (sse == 0)
+        return INFINITY;
+    return 10.0*log10(255.0*255.0*n/(double)sse);
+}
+
+//Compare a sampled event of a derived format to a native render at the same time.
+static void scale_check(a2b_ctx_t *ctx, a2b_enc_t *enc, long long ms)
+{
+    a2b_scale_t *scale = enc->scale;
+    int changed;
+    double psnr;
+
+    if (enc->count % scale->check_every)
+        return;
+
+    ASS_Image *img = ass_render_frame(scale->renderer, scale->track, ms, &changed);
+    blend(scale->native, img, enc->args, &ctx->lut);
+    psnr = scale_psnr(scale->frame, scale->native);
+    scale->checked++;
+    scale->worst_psnr = MIN(scale->worst_psnr, psnr);
+    if (psnr < SCALE_CHECK_MIN_PSNR) {
+        scale->diverged++;
+        a2b_log(A2B_LOG_WARN, FILENAME_FMT ": %dx%d downscale diverges from a native render (PSNR %.1f dB).",
+                enc->count + enc->args->index_base, scale->frame->width, scale->frame->height, psnr);
+    }
+}
+
 static void find_bbox_ysplit(image_t* restrict frame, int y_start, int y_stop, const int margin, BoundingBox_t *box)
 {
     int pixelExist;
-    int xk, yk;
-
-    //left
-    pixelExist = 0;
-    for (xk = frame->subx1; xk <= frame->subx2 - margin && !pixelExist; xk++) {
-        for (yk = y_start; yk < y_stop; yk++) {
-            pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3] > 0;
-        }
-    }
-    //sub one since inc before cmp !pixelExist
-    box->x1 = MAX(xk-1, frame->subx1);
+    int xmin = frame->width, xmax = -1;
+    int yk;
 
-    //right
-    pixelExist = 0;
-    for (xk = frame->subx2; xk >= frame->subx1 + margin && !pixelExist; xk--) {
-        for (yk = y_start; yk < y_stop; yk++) {
-            pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3] > 0;
-        }
+    //left and right, the first visible columns are the extremes of the row spans
+    for (yk = y_start; yk < y_stop; yk++) {
+        xmin = MIN(xmin, frame->spans[2*yk]);
+        xmax = MAX(xmax, frame->spans[2*yk + 1]);
     }
-    box->x2 = MIN(xk+1, frame->subx2);
+    box->x1 = MAX(MIN(xmin, frame->subx2 - margin), frame->subx1);
+    box->x2 = MIN(MAX(xmax, frame->subx1 + margin), frame->subx2);
 
     if (y_start == frame->suby1) {
         box->y1 = frame->suby1;
 
         pixelExist = 0;
-        for (yk = y_stop; yk >= y_start + margin && !pixelExist; yk--) {
-            for (xk = box->x1; xk <= box->x2; xk++) {
-                pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3] > 0;
-            }
-        }
+        for (yk = y_stop; yk >= y_start + margin && !pixelExist; yk--)
+            pixelExist = row_visible(frame, yk, box->x1, box->x2);
         box->y2 = MIN(yk+1, y_stop);
     } else {
         box->y2 = frame->suby2;
 
         pixelExist = 0;
-        for (yk = y_start; yk < y_stop - margin && !pixelExist; yk++) {
-            for (xk = box->x1; xk <= box->x2; xk++) {
-                pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3] > 0;
-            }
-        }
+        for (yk = y_start; yk < y_stop - margin && !pixelExist; yk++)
+            pixelExist = row_visible(frame, yk, box->x1, box->x2);
         box->y1 = MAX(yk-1, y_start);
     }
 }
@@ -498,46 +1814,34 @@ static void find_bbox_xsplit(image_t* restrict frame, int x_start, int x_stop, c
 
     //top
     pixelExist = 0;
-    for (yk = frame->suby1; (yk <= frame->suby2 - margin) && !pixelExist; yk++) {
-        for (xk = x_start; xk < x_stop; xk++) {
-            pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3] > 0;
-        }
-    }
+    for (yk = frame->suby1; (yk <= frame->suby2 - margin) && !pixelExist; yk++)
+        pixelExist = row_visible(frame, yk, x_start, x_stop - 1);
     box->y1 = MAX(yk-1, frame->suby1);
 
     //bottom
     pixelExist = 0;
-    for (yk = frame->suby2; (yk >= frame->suby1 + margin) && !pixelExist; yk--) {
-        for (xk = x_start; xk < x_stop; xk++) {
-            pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3] > 0;
-        }
-    }
+    for (yk = frame->suby2; (yk >= frame->suby1 + margin) && !pixelExist; yk--)
+        pixelExist = row_visible(frame, yk, x_start, x_stop - 1);
     box->y2 = MIN(yk+1, frame->suby2);
 
     if (x_start == frame->subx1) {
         box->x1 = frame->subx1;
 
         pixelExist = 0;
-        for (xk = x_stop; xk >= x_start + margin && !pixelExist; xk--) {
-            for (yk = box->y1; yk <= box->y2; yk++) {
-                pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3] > 0;
-            }
-        }
+        for (xk = x_stop; xk >= x_start + margin && !pixelExist; xk--)
+            pixelExist = col_visible(frame, xk, box->y1, box->y2);
         box->x2 = MIN(xk+1, x_stop);
     } else {
         box->x2 = frame->subx2;
 
         pixelExist = 0;
-        for (xk = x_start; xk <= x_stop - margin && !pixelExist; xk++) {
-            for (yk = box->y1; yk <= box->y2; yk++) {
-                pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3] > 0;
-            }
-        }
+        for (xk = x_start; xk <= x_stop - margin && !pixelExist; xk++)
+            pixelExist = col_visible(frame, xk, box->y1, box->y2);
         box->x1 = MAX(xk-1, x_start);
     }
 }
 
-static int find_split(image_t* restrict frame, opts_t *args)
+static int find_split(image_t* restrict frame, const opts_t *args)
 {
     const int margin = 8;
     const int step = (args->split < 4) ? 8 : 1;
@@ -553,10 +1857,7 @@ static int find_split(image_t* restrict frame, opts_t *args)
     if (frame->suby2 - frame->suby1 > margin*2) {
         //Search for a horizontal split
         for (yk = frame->suby1 + margin; yk <= frame->suby2 - margin; yk+=step) {
-            pixelExist = 0;
-            for (xk = frame->subx1; xk <= frame->subx2 && !pixelExist; xk++) {
-                pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3];
-            }
+            pixelExist = row_visible(frame, yk, frame->subx1, frame->subx2);
 
             //Line is used by data, skip to the next split.
             if (pixelExist && args->split < 4) {
@@ -577,10 +1878,7 @@ static int find_split(image_t* restrict frame, opts_t *args)
         if (args->split >= 3 || (args->split == 2 && (frame->suby2 - frame->suby1) > frame->height/2.5)) {
             //Search for a vertical split
             for (xk = frame->subx1 + margin; xk <= frame->subx2 - margin; xk+=step) {
-                pixelExist = 0;
-                for (yk = frame->suby1; yk <= frame->suby2 && !pixelExist; yk++) {
-                    pixelExist |= frame->buffer[yk*frame->stride + xk*4 + 3];
-                }
+                pixelExist = col_visible(frame, xk, frame->suby1, frame->suby2);
 
                 //Line is used by data, skip to the next split.
                 if (pixelExist && args->split < 4) {
@@ -612,36 +1910,152 @@ static uint8_t diff_frames(image_t* restrict current, image_t *prev)
     if (0 != memcmp(current, prev, offsetof(image_t, out)))
         return 1;
 
-    //header match, compare active vertical bitmap area
+    //header match, the row spans differ more often than the pixels within them
+    if (0 != memcmp(&current->spans[2*current->suby1], &prev->spans[2*current->suby1],
+                    2*sizeof(int)*(current->suby2 - current->suby1 + 1)))
+        return 1;
+
+    //compare active vertical bitmap area
     return (0 != memcmp(&current->buffer[current->stride*current->suby1],
                         &prev->buffer[current->stride*current->suby1],
                         current->stride*(current->suby2 - current->suby1 + 1)));
 }
 
-static int get_frame(ASS_Renderer *renderer, ASS_Track *track, image_t* restrict prev_frame,
-                     image_t* restrict frame, uint64_t frame_cnt, frate_t *frate, opts_t *args)
+//Pure translation of the previous event: same cropped size and pixels at another position.
+//Blend areas start on mod2 positions, so only even offsets can match.
+static int translated_frames(const image_t* restrict current, const image_t* restrict prev)
 {
-    //libass can return blank ASS_Images, we must remember whenever that happen as the changed
-    //flag returned by libass becomes meaningless, and we would corrupt the event.
-    static int prev_invalid = 0;
+    const int w = current->subx2 - current->subx1 + 1, h = current->suby2 - current->suby1 + 1;
+
+    if (prev->subx1 < 0 || prev->subx2 - prev->subx1 + 1 != w || prev->suby2 - prev->suby1 + 1 != h ||
+        (prev->subx1 == current->subx1 && prev->suby1 == current->suby1))
+        return 0;
+
+    //The row spans move with the pixels.
+    for (int y = 0; y < h; y++) {
+        const int *a = &current->spans[2*(current->suby1 + y)], *b = &prev->spans[2*(prev->suby1 + y)];
+
+        if ((a[0] > a[1]) != (b[0] > b[1]) ||
+            (a[0] <= a[1] && (a[0] - current->subx1 != b[0] - prev->subx1 || a[1] - current->subx1 != b[1] - prev->subx1)))
+            return 0;
+    }
+    for (int y = 0; y < h; y++) {
+        if (memcmp(&current->buffer[(current->suby1 + y)*current->stride + current->subx1*4],
+                   &prev->buffer[(prev->suby1 + y)*prev->stride + prev->subx1*4], w*4))
+            return 0;
+    }
+    return 1;
+}
+
+//Tolerance test of two frames with the same geometry: alpha weighted colour and alpha
+//deltas must stay within the threshold. Returns 1 if the frames are close enough.
+static int similar_frames(const image_t* restrict current, const image_t* restrict prev, int threshold)
+{
+    const int limit = threshold*255;
+
+    if (0 != memcmp(current, prev, offsetof(image_t, out)))
+        return 0;
+
+    for (int y = current->suby1; y <= current->suby2; y++) {
+        const uint8_t *a = &current->buffer[y*current->stride + current->subx1*4];
+        const uint8_t *b = &prev->buffer[y*current->stride + current->subx1*4];
+
+        for (int x = 0; x <= (current->subx2 - current->subx1)*4; x += 4) {
+            if (abs(a[x+3] - b[x+3]) > threshold)
+                return 0;
+            for (int c = 0; c < 3; c++) {
+                if (abs(a[x+c]*a[x+3] - b[x+c]*b[x+3]) > limit)
+                    return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static uint64_t monotonic_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+//Start of a span, the clock is only read when tracing.
+static inline uint64_t trace_clock(const a2b_spans_t *spans)
+{
+    return spans->on ? monotonic_us() : 0;
+}
+
+static void trace_push(a2b_spans_t *spans, a2b_stage_t stage, uint64_t start_us, const image_t *img)
+{
+    a2b_span_t *span;
+
+    if (!spans->on || spans->count == TRACE_MAX_SPANS)
+        return;
+    span = &spans->span[spans->count++];
+    span->start_us = start_us;
+    span->dur_us = (uint32_t)(monotonic_us() - start_us);
+    span->stage = stage;
+    span->w = img && img->subx1 >= 0 ? img->subx2 - img->subx1 + 1 : 0;
+    span->h = img && img->subx1 >= 0 ? img->suby2 - img->suby1 + 1 : 0;
+}
+
+static void trace_flush(const a2b_trace_t *trace, a2b_spans_t *spans, uint64_t frame, int event, int variant)
+{
+    for (int k = 0; spans->on && k < spans->count; k++) {
+        spans->span[k].frame = frame;
+        spans->span[k].event = event;
+        spans->span[k].variant = variant;
+        trace->span(trace->priv, &spans->span[k]);
+    }
+    spans->count = 0;
+}
+
+//New event test of a visible frame, see diff_frames() and similar_frames().
+static int frame_changed(a2b_ctx_t *ctx, image_t* restrict frame, image_t* restrict prev_frame, uint64_t frame_cnt)
+{
+    const opts_t *args = &ctx->args;
+    const uint64_t start_us = trace_clock(&ctx->spans);
+    const int changed = diff_frames(frame, prev_frame) &&
+                        !(args->merge_threshold && (!args->merge_max || frame_cnt - frame->in < args->merge_max) &&
+                          similar_frames(frame, prev_frame, args->merge_threshold));
+
+    if (changed)
+        ctx->translated = translated_frames(frame, prev_frame);
+    trace_push(&ctx->spans, A2B_STAGE_DIFF, start_us, frame);
+    return changed;
+}
+
+static int get_frame(a2b_ctx_t *ctx, ASS_Track *track, image_t* restrict prev_frame,
+                     image_t* restrict frame, uint64_t frame_cnt, frate_t *frate)
+{
+    opts_t *args = &ctx->args;
     int changed;
+    uint64_t start_us = trace_clock(&ctx->spans);
 
     uint64_t ms = frame_to_realtime_ms(frame_cnt, frate);
-    ASS_Image *img = ass_render_frame(renderer, track, ms, &changed);
+    ASS_Image *img = ass_render_frame(ctx->ass_renderer, track, ms, &changed);
+    ctx->stats.frames++;
+    trace_push(&ctx->spans, A2B_STAGE_RENDER, start_us, NULL);
 
     if (changed && img) {
-        blend(frame, img, args);
+        start_us = trace_clock(&ctx->spans);
+        blend_incremental(&ctx->comp, frame, img, args, &ctx->lut);
+        trace_push(&ctx->spans, A2B_STAGE_BLEND, start_us, frame);
+        ctx->translated = 0;
 
         if (frame->subx1 > -1 && frame->suby1 > -1) {
             //frame differ from the previous?
             if (NULL == prev_frame) {
                 frame->in = frame_cnt;
-            } else if (diff_frames(frame, prev_frame)) {
+            } else if (frame_changed(ctx, frame, prev_frame, frame_cnt)) {
                 frame->in = frame_cnt;
                 memcpy(prev_frame, frame, offsetof(image_t, out));
                 memcpy(prev_frame->buffer, frame->buffer, frame->stride*frame->height);
+                memcpy(prev_frame->alpha, frame->alpha, frame->width*frame->height);
+                memcpy(prev_frame->spans, frame->spans, 2*sizeof(int)*frame->height);
             } else {
-                // img exists and is identical to prev.
+                // img exists and is identical (or close enough) to prev.
+                // prev_frame is left untouched: the tolerance applies to the bitmap of the event.
                 ++frame->out;
                 return 1;
             }
@@ -649,30 +2063,36 @@ static int get_frame(ASS_Renderer *renderer, ASS_Track *track, image_t* restrict
         } else {
             //Sometime sampling time is on an active event but the blended image is transparent
             // because the composition coefficients are weak -> discard
-            prev_invalid = 1;
+            ctx->prev_invalid = 1;
             if (prev_frame)
                 prev_frame->in = (uint64_t)(-1);
             return 2;
         }
-        prev_invalid = 0;
+        ctx->prev_invalid = 0;
 
         return 3;
     } else if (!changed && img) {
-        if (prev_invalid)
+        if (ctx->prev_invalid)
             return 2;
         ++frame->out;
         return 1;
     } else {
+        //No event, libass may now release the bitmaps of the last blend.
+        if (!img)
+            ctx->comp.valid = 0;
         //No event, change prev_frame content
         if (prev_frame)
             prev_frame->in = (uint64_t)(-1);
-        prev_invalid = 0;
+        ctx->prev_invalid = 0;
         return 0;
     }
 }
 
-static int quantize_event(image_t* restrict frame, liq_image **img, liq_result **qtz_res, opts_t *args)
+static int quantize_event(a2b_enc_t *enc, image_t* restrict frame, liq_image **img, liq_result **qtz_res)
 {
+    liq_attr *attr = enc->attr;
+    const opts_t *args = enc->args;
+
     *img = liq_image_create_rgba(attr, &frame->buffer[frame->stride*frame->suby1], frame->width, frame->suby2-frame->suby1+1, 0);
     if (NULL == *img)
         return -1;
@@ -700,73 +2120,706 @@ static int quantize_event(image_t* restrict frame, liq_image **img, liq_result *
     return ret;
 }
 
-eventlist_t *render_subs(char *subfile, frate_t *frate, opts_t *args, liqopts_t *liqargs)
+#define RLE_MIN_COLORS (16)
+
+//Give up dithering, then colours, until the largest PGS object of the event fits args->rle_budget.
+//Events palettized losslessly are quantized on demand, in which case *img is NULL on entry.
+static int rle_budget_fit(a2b_enc_t *enc, image_t* restrict frame, a2b_pal_t *pal, uint8_t is_split, liq_image **img, liq_result **res)
 {
-    long long tm = 0;
-    int count = 0, fres = 0, img_cnt = 0;
-    uint64_t frame_cnt = 1;
+    const opts_t *args = enc->args;
+    uint32_t size = rle_layout(args, frame, pal, is_split);
+    const uint32_t estimate = size;
+    float dither = enc->liqargs->dither;
+    int colors = args->quantize;
+
+    if (size <= args->rle_budget)
+        return 0;
+
+    if (*img == NULL) {
+        //Exact palette: there is no dithering to remove, reduce colours right away.
+        if (quantize_event(enc, frame, img, res))
+            return -1;
+        dither = 0.0f;
+        colors = pal->count;
+    }
+
+    while (size > args->rle_budget) {
+        if (dither > 0.0f) {
+            dither = dither > 0.5f ? 0.5f : 0.0f;
+        } else if (colors/2 >= RLE_MIN_COLORS) {
+            const int max_colors = liq_get_max_colors(enc->attr);
+            liq_error err;
+
+            colors /= 2;
+            liq_result_destroy(*res);
+            *res = NULL;
+            liq_set_max_colors(enc->attr, colors);
+            err = liq_image_quantize(*img, enc->attr, res);
+            liq_set_max_colors(enc->attr, max_colors);
+            if (err != LIQ_OK)
+                return -1;
+        } else {
+            break;
+        }
+        palette_liq(args, frame, *img, *res, dither, pal);
+        size = rle_layout(args, frame, pal, is_split);
+    }
+    if (size > args->rle_budget)
+        a2b_log(A2B_LOG_WARN, FILENAME_FMT ": estimated RLE size %u exceeds the budget of %u bytes (%d colours, dither %.1f).",
+                enc->count + args->index_base, size, args->rle_budget, pal->count, dither);
+    else
+        a2b_log(A2B_LOG_INFO, FILENAME_FMT ": estimated RLE size %u > %u bytes, encoded with %d colours and dither %.1f (%u bytes).",
+                enc->count + args->index_base, estimate, args->rle_budget, pal->count, dither, size);
+    return 0;
+}
+
+//Show the PNGs of the previous event at the new position, the event bitmap is unchanged.
+static int translate_event(a2b_enc_t *enc)
+{
+    image_t *frame = &enc->cur;
+    const int dx = enc->frame->subx1 - frame->subx1, dy = enc->frame->suby1 - frame->suby1;
+
+    //Resampling is not translation invariant.
+    if (enc->scale)
+        return 0;
+
+    frame->subx1 += dx;
+    frame->subx2 += dx;
+    frame->suby1 += dy;
+    frame->suby2 += dy;
+    if (!(frame->crops[0].x1 & 0xFF000000)) {
+        for (int k = 0; k < 2; k++) {
+            frame->crops[k].x1 += dx;
+            frame->crops[k].x2 += dx;
+            frame->crops[k].y1 += dy;
+            frame->crops[k].y2 += dy;
+        }
+    }
+    frame->ref++;
+    enc->quant_us = 0;
+    return 1;
+}
+
+static void reuse_key(const image_t* restrict frame, uint64_t key[2])
+{
+    uint64_t h1 = FNV64_INIT, h2 = 0x9E3779B97F4A7C15ULL;
+
+    for (int y = frame->suby1; y <= frame->suby2; y++) {
+        const uint8_t *row = frame->buffer + y*frame->stride + frame->subx1*4;
+
+        for (int x = 0; x <= frame->subx2 - frame->subx1; x++) {
+            uint32_t px;
+
+            memcpy(&px, row + x*4, 4);
+            h1 = (h1 ^ px) * FNV64_PRIME;
+            h2 = (h2 + px) * 0xC2B2AE3D27D4EB4FULL;
+            h2 ^= h2 >> 31;
+        }
+    }
+    key[0] = h1;
+    key[1] = h2 | 1;
+}
+
+static int reuse_same_pixels(const reuse_entry_t *e, const image_t* restrict frame)
+{
+    size_t w = (size_t)(frame->subx2 - frame->subx1 + 1)*4;
+    const uint8_t *pixels = e->pixels;
+
+    for (int y = frame->suby1; y <= frame->suby2; y++, pixels += w) {
+        if (memcmp(pixels, frame->buffer + y*frame->stride + frame->subx1*4, w))
+            return 0;
+    }
+    return 1;
+}
+
+static reuse_entry_t *reuse_slot(const a2b_reuse_t *reuse, const uint64_t key[2], const image_t *frame)
+{
+    uint32_t k = (uint32_t)key[0] & (reuse->size - 1);
+
+    for (; reuse->slots[k].key[1]; k = (k + 1) & (reuse->size - 1)) {
+        const reuse_entry_t *e = &reuse->slots[k];
+        if (e->key[0] == key[0] && e->key[1] == key[1] && e->area.x1 == frame->subx1 && e->area.x2 == frame->subx2 &&
+            e->area.y1 == frame->suby1 && e->area.y2 == frame->suby2)
+            break;
+    }
+    return &reuse->slots[k];
+}
+
+//A new event identical to one encoded before is given its PNGs, no encoding is done.
+//Returns 1 if the event was found.
+static int reuse_lookup(a2b_reuse_t *reuse, a2b_enc_t *enc, const image_t* restrict frame, uint32_t count)
+{
+    const reuse_entry_t *e;
+    image_t *cur = &enc->cur;
+
+    reuse_key(frame, reuse->key);
+    if (reuse->count == 0)
+        return 0;
+    e = reuse_slot(reuse, reuse->key, frame);
+    if (e->key[1] == 0 || !reuse_same_pixels(e, frame))
+        return 0;
+
+    memcpy(cur, frame, sizeof(image_t));
+    cur->subx1 = e->box.x1;
+    cur->subx2 = e->box.x2;
+    cur->suby1 = e->box.y1;
+    cur->suby2 = e->box.y2;
+    memcpy(cur->crops, e->crops, sizeof(e->crops));
+    memcpy(cur->digest, e->digest, sizeof(e->digest));
+    cur->ref = count + enc->args->index_base - e->png;
+    enc->quant_us = 0;
+    return 1;
+}
+
+//Record the event just encoded under the key of the last lookup.
+static int reuse_insert(a2b_reuse_t *reuse, const a2b_enc_t *enc, const image_t* restrict frame, uint32_t count)
+{
+    const image_t *cur = &enc->cur;
+    size_t w = (size_t)(frame->subx2 - frame->subx1 + 1)*4;
+    uint8_t *pixels = malloc(w*(frame->suby2 - frame->suby1 + 1));
+    reuse_entry_t *e;
+
+    if (pixels == NULL)
+        return A2B_ERR_ALLOC;
+    for (int y = frame->suby1; y <= frame->suby2; y++)
+        memcpy(pixels + (y - frame->suby1)*w, frame->buffer + y*frame->stride + frame->subx1*4, w);
+
+    if (2*(reuse->count + 1) > reuse->size) {
+        a2b_reuse_t grown = {.size = MAX(REUSE_MIN_SLOTS, 2*reuse->size), .count = reuse->count};
+
+        grown.slots = calloc(grown.size, sizeof(reuse_entry_t));
+        if (grown.slots == NULL) {
+            free(pixels);
+            return A2B_ERR_ALLOC;
+        }
+        for (uint32_t k = 0; k < reuse->size; k++) {
+            if (reuse->slots[k].key[1]) {
+                const reuse_entry_t *old = &reuse->slots[k];
+                const image_t area = {.subx1 = old->area.x1, .subx2 = old->area.x2, .suby1 = old->area.y1, .suby2 = old->area.y2};
+                *reuse_slot(&grown, old->key, &area) = *old;
+            }
+        }
+        free(reuse->slots);
+        reuse->slots = grown.slots;
+        reuse->size = grown.size;
+    }
+    //A key collision with other pixels replaces the entry.
+    e = reuse_slot(reuse, reuse->key, frame);
+    if (e->key[1] == 0)
+        reuse->count++;
+    free(e->pixels);
+    e->pixels = pixels;
+    memcpy(e->key, reuse->key, sizeof(e->key));
+    e->area = (BoundingBox_t){frame->subx1, frame->subx2, frame->suby1, frame->suby2};
+    e->box = (BoundingBox_t){cur->subx1, cur->subx2, cur->suby1, cur->suby2};
+    memcpy(e->crops, cur->crops, sizeof(e->crops));
+    memcpy(e->digest, cur->digest, sizeof(e->digest));
+    e->png = count - cur->ref + enc->args->index_base;
+    reuse->next = MAX(reuse->next, count + enc->args->index_base + 1);
+    return A2B_OK;
+}
+
+static int encode_event(a2b_enc_t *enc)
+{
+    const opts_t *args = enc->args;
+    image_t *frame = &enc->cur;
     char imgfile[FILENAME_MAX_LENGTH];
+    int img_cnt, ret = A2B_OK;
+    uint8_t is_split;
+
+    liq_result *res = NULL;
+    liq_image *img = NULL;
+    a2b_pal_t pal;
+    const uint64_t encode_us = trace_clock(&enc->spans);
+    uint64_t start_us;
+
+    if (enc->translated && translate_event(enc)) {
+        trace_push(&enc->spans, A2B_STAGE_ENCODE, encode_us, &enc->cur);
+        return A2B_OK;
+    }
+
+    //Crops and sub-rectangles are per variant, the bitmap is shared.
+    memcpy(frame, enc->frame, sizeof(image_t));
+    if (enc->scale)
+        downscale_event(enc->scale, frame);
+    start_us = trace_clock(&enc->spans);
+    is_split = args->split && find_split(frame, args);
+    if (args->split)
+        trace_push(&enc->spans, A2B_STAGE_SPLIT, start_us, frame);
+
+    enc->quant_us = 0;
+    if (args->quantize) {
+        const uint64_t quant_start = monotonic_us();
+
+        pal.bitmap = arena_bitmap(&enc->arena, frame->width*(frame->suby2 - frame->suby1 + 1));
+        if (pal.bitmap == NULL) {
+            a2b_log(A2B_LOG_ERROR, "Failed to allocate bitmap array for " FILENAME_FMT ".", enc->count);
+            return A2B_ERR_ALLOC;
+        }
+        pal.zero = -1;
+        pal.shifted = 0;
+        //Events with few colours are palettized losslessly, libimagequant is only used beyond the budget.
+        if (!palette_exact(args, frame, &pal)) {
+            if (quantize_event(enc, frame, &img, &res))
+                ret = A2B_ERR_QUANTIZE;
+            else
+                palette_liq(args, frame, img, res, enc->liqargs->dither, &pal);
+        }
+        if (!ret && args->rle_budget && rle_budget_fit(enc, frame, &pal, is_split, &img, &res))
+            ret = A2B_ERR_QUANTIZE;
+        liq_result_destroy(res);
+        liq_image_destroy(img);
+        enc->quant_us = monotonic_us() - quant_start;
+        trace_push(&enc->spans, A2B_STAGE_QUANTIZE, quant_start, frame);
+        if (ret) {
+            a2b_log(A2B_LOG_ERROR, "Quantization failed for " FILENAME_FMT FILENAME_EXT ".", enc->count);
+            return ret;
+        }
+    }
+    start_us = trace_clock(&enc->spans);
+    if (is_split) {
+        if (args->quantize) {
+            ret = write_png_palette(enc, enc->count, frame, &pal, 1);
+        } else {
+            //The event keeps its area, translate_event() and the reuse map need it.
+            for (img_cnt = 0; img_cnt < 2 && !ret; img_cnt++) {
+                image_t part = *frame;
+
+                part.subx1 = frame->crops[img_cnt].x1;
+                part.subx2 = frame->crops[img_cnt].x2;
+                part.suby1 = frame->crops[img_cnt].y1;
+                part.suby2 = frame->crops[img_cnt].y2;
+                image_fname(imgfile, args, enc->count, img_cnt);
+                ret = write_png(enc, imgfile, &part, &frame->digest[img_cnt]);
+            }
+        }
+    } else {
+        if (args->quantize) {
+            ret = write_png_palette(enc, enc->count, frame, &pal, 0);
+        } else {
+            image_fname(imgfile, args, enc->count, -1);
+            ret = write_png(enc, imgfile, frame, &frame->digest[0]);
+        }
+    }
+    trace_push(&enc->spans, A2B_STAGE_WRITE, start_us, frame);
+    trace_push(&enc->spans, A2B_STAGE_ENCODE, encode_us, &enc->cur);
+    return ret;
+}
+
+static void *encode_thread(void *priv)
+{
+    a2b_enc_t *enc = (a2b_enc_t *)priv;
+    enc->ret = encode_event(enc);
+    return NULL;
+}
+
+//Encode a new event with every variant. Up to max_parallel variants are encoded at once,
+//the additional ones in their own thread.
+static int encode_variants(a2b_enc_t *enc, int nenc, int max_parallel, const image_t *frame, uint32_t count,
+                           const a2b_trace_t *trace)
+{
+    pthread_t threads[A2B_MAX_PROFILES];
+    uint8_t started[A2B_MAX_PROFILES] = {0};
+    int k, first, last, ret = A2B_OK;
+
+    for (k = 0; k < nenc; k++) {
+        enc[k].frame = frame;
+        enc[k].count = count;
+    }
+
+    for (first = 0; first < nenc; first = last) {
+        last = MIN(nenc, first + MAX(1, max_parallel));
+        for (k = first + 1; k < last; k++)
+            started[k] = !pthread_create(&threads[k], NULL, encode_thread, &enc[k]);
+        enc[first].ret = encode_event(&enc[first]);
+
+        for (k = first + 1; k < last; k++) {
+            if (started[k])
+                pthread_join(threads[k], NULL);
+            else
+                enc[k].ret = encode_event(&enc[k]);
+        }
+    }
+    for (k = 0; k < nenc; k++)
+        trace_flush(trace, &enc[k].spans, frame->in, count, k);
+    for (k = 0; k < nenc && !ret; k++)
+        ret = enc[k].ret;
+    return ret;
+}
+
+//Analysis only: the event geometry is kept, nothing is encoded.
+static void analyze_event(a2b_enc_t *enc, int nenc, const image_t* restrict frame)
+{
+    uint32_t opaque = 0;
+
+    for (int y = frame->suby1; y <= frame->suby2; y++) {
+        const uint8_t *row = &frame->alpha[y*frame->width];
+        for (int x = frame->subx1; x <= frame->subx2; x++)
+            opaque += row[x] > 0;
+    }
+    for (int k = 0; k < nenc; k++) {
+        memcpy(&enc[k].cur, frame, sizeof(image_t));
+        enc[k].cur.opaque = opaque;
+    }
+}
+
+static int emit_event(a2b_enc_t *enc, int nenc, int index)
+{
+    for (int k = 0; k < nenc; k++) {
+        a2b_sink_t *sink = enc[k].sink;
+        if (sink && sink->event && sink->event(sink->priv, &enc[k].event, index))
+            return A2B_ERR_SINK;
+    }
+    return A2B_OK;
+}
+
+//Fit the frame buffers, the in-flight encodes and the libass caches in the memory limit.
+//Concurrency and caches are reduced first, the conversion is never refused.
+static void apply_memory_limit(a2b_ctx_t *ctx, const a2b_enc_t *enc, int nenc)
+{
+    const opts_t *args = &ctx->args;
+    const int64_t pixels = (int64_t)args->render_w * args->render_h;
+    int64_t frames, enc_cost = 0, remaining;
+    int k, bitmap_mb, glyphs;
+
+    ctx->max_parallel = nenc;
+    if (args->memory_limit == 0)
+        return;
+
+    //current and previous frames, BGRA and the alpha plane, and the layer blended before a colour stage
+    frames = pixels * 5 * ((args->keep_dupes ? 1 : 2) + (ctx->lut.active ? 1 : 0));
+    for (k = 0; k < nenc; k++)
+        enc_cost = MAX(enc_cost, pixels * (enc[k].args->quantize ? 1 + MEM_LIQ_PER_PIXEL : 1));
+
+    remaining = ((int64_t)args->memory_limit - MEM_BASE_MB) * 1024 * 1024 - frames;
+    while (ctx->max_parallel > 1 && remaining - ctx->max_parallel * enc_cost < MEM_MIN_BITMAP_MB * 1024 * 1024 * 2)
+        ctx->max_parallel--;
+    remaining -= ctx->max_parallel * enc_cost;
+
+    //libass sizes its composite cache after the bitmap cache, a third is left to the glyphs.
+    bitmap_mb = (int)MIN(MEM_MAX_BITMAP_MB, MAX(MEM_MIN_BITMAP_MB, remaining / (3 * 1024 * 1024)));
+    glyphs = (int)MIN(MEM_MAX_GLYPHS, MAX(MEM_MIN_GLYPHS, remaining / (3 * MEM_GLYPH_SIZE)));
+    ass_set_cache_limits(ctx->ass_renderer, glyphs, bitmap_mb);
+
+    if (remaining < MEM_MIN_BITMAP_MB * 1024 * 1024 * 2)
+        a2b_log(A2B_LOG_WARN, "memory limit of %u MiB is too low for %dx%d, running with minimal caches.",
+                args->memory_limit, args->render_w, args->render_h);
+    a2b_log(A2B_LOG_INFO, "memory limit %u MiB: glyph cache %d, bitmap cache %d MiB, %d encoder(s) in parallel.",
+            args->memory_limit, glyphs, bitmap_mb, ctx->max_parallel);
+}
+
+static uint64_t monotonic_ms(void)
+{
+    return monotonic_us()/1000;
+}
+
+//Frame at which the last event of the track ends.
+static uint64_t track_end_frame(ASS_Track *track, frate_t *frate)
+{
+    long long end_ms = 0;
+
+    for (int k = 0; k < track->n_events; k++)
+        end_ms = MAX(end_ms, track->events[k].Start + track->events[k].Duration);
+    return 1 + (uint64_t)round((end_ms*frate->num)/(1000.0*frate->denom));
+}
+
+//Send a progress report if the interval elapsed. Until done, the counters
+//of the encoders are not yet summed in the context.
+static void report_progress(a2b_ctx_t *ctx, const a2b_enc_t *enc, int nenc, uint64_t frame_cnt, int done)
+{
+    const uint64_t now = monotonic_ms();
+    a2b_progress_t *progress = &ctx->progress;
+
+    if (!done && now - ctx->progress_ms < ctx->monitor.interval_ms)
+        return;
+    ctx->progress_ms = now;
+
+    progress->frame = frame_cnt;
+    progress->stats = ctx->stats;
+    progress->done = done;
+    for (int k = 0; k < nenc && !done; k++) {
+        progress->stats.images += enc[k].stats.images;
+        progress->stats.bytes += enc[k].stats.bytes;
+    }
+    ctx->monitor.progress(ctx->monitor.priv, progress);
+}
+
+#define BUDGET_QUALITY_STEP (5)
+#define BUDGET_MIN_EVENTS (3)
+#define BUDGET_AVG_SHIFT (2)
+
+//Quantizer effort control of args->time_budget. Level 0 is the configured effort,
+//each level raises the speed by one up to max_speed, then lowers the quality.
+typedef struct a2b_budget_s {
+    uint64_t start_us;
+    uint64_t deadline_us;
+    long long *starts;    //start times of the lines of the timeline, sorted
+    int lines;
+    uint64_t quant_us;    //quantization time so far, slowest variant of each event
+    uint64_t avg_us;      //moving average of the quantization time per event at the current level
+    uint64_t events;
+    uint32_t level_events; //events encoded at the current level
+    uint64_t reduced;     //events quantized below the configured effort
+    int level;
+    int max_level;
+} a2b_budget_t;
+
+static void budget_effort(const liqopts_t *liqargs, int level, int *speed, int *quality)
+{
+    const int faster = MIN(level, liqargs->max_speed - liqargs->speed);
+
+    *speed = liqargs->speed + faster;
+    *quality = MAX(liqargs->min_quality, liqargs->max_quality - (level - faster)*BUDGET_QUALITY_STEP);
+}
+
+static void budget_apply(a2b_budget_t *budget, a2b_enc_t *enc, int nenc, int level)
+{
+    int speed, quality;
+
+    budget->level = level;
+    budget->level_events = 0;
+    for (int k = 0; k < nenc; k++) {
+        if (enc[k].attr == NULL)
+            continue;
+        budget_effort(enc[k].liqargs, level, &speed, &quality);
+        liq_set_speed(enc[k].attr, speed);
+        liq_set_quality(enc[k].attr, 0, quality);
+    }
+}
+
+static int cmp_ms(const void *a, const void *b)
+{
+    const long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+//Progress is measured in subtitle lines rather than frames as they are rarely spread evenly
+//over the timeline. The start times of the lines within [first_ms, last_ms) are sorted once.
+static int budget_init(a2b_budget_t *budget, const opts_t *args, a2b_enc_t *enc, int nenc, ASS_Track *track,
+                       long long first_ms, long long last_ms)
+{
+    memset(budget, 0, sizeof(*budget));
+    budget->start_us = monotonic_us();
+    budget->deadline_us = budget->start_us + (uint64_t)args->time_budget*1000;
+    budget->starts = malloc(MAX(1, track->n_events)*sizeof(*budget->starts));
+    if (budget->starts == NULL)
+        return A2B_ERR_ALLOC;
+    for (int k = 0; k < track->n_events; k++) {
+        const ASS_Event *line = &track->events[k];
+
+        if (line->Start + line->Duration > first_ms && line->Start < last_ms)
+            budget->starts[budget->lines++] = line->Start;
+    }
+    qsort(budget->starts, budget->lines, sizeof(*budget->starts), cmp_ms);
+    for (int k = 0; k < nenc; k++) {
+        const liqopts_t *liqargs = enc[k].liqargs;
+        const int levels = liqargs->max_speed - liqargs->speed +
+                           (liqargs->max_quality - liqargs->min_quality + BUDGET_QUALITY_STEP - 1)/BUDGET_QUALITY_STEP;
+
+        if (enc[k].attr)
+            budget->max_level = MAX(budget->max_level, levels);
+    }
+    return A2B_OK;
+}
+
+//Subtitle lines of the timeline started at or before ms, and all of them.
+static void budget_lines(const a2b_budget_t *budget, long long ms, uint64_t *started, uint64_t *total)
+{
+    int lo = 0, hi = budget->lines;
+
+    while (lo < hi) {
+        const int mid = lo + (hi - lo)/2;
+
+        if (budget->starts[mid] <= ms)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *started = lo;
+    *total = budget->lines;
+}
+
+//Pick the effort of the next event: the quantization of the remaining events, at the average
+//cost and rate of events so far, must fit the time left once the rest of the pipeline is paid.
+static void budget_update(a2b_budget_t *budget, a2b_enc_t *enc, int nenc, long long ms, int count)
+{
+    const uint64_t now = monotonic_us();
+    uint64_t done, left;
+    int level = budget->level;
+
+    budget_lines(budget, ms, &done, &left);
+    left -= done;
+
+    //A new level is held until its cost is known.
+    if (budget->level_events < BUDGET_MIN_EVENTS || done == 0)
+        return;
+
+    if (now >= budget->deadline_us) {
+        level = budget->max_level;
+    } else {
+        const double other_us = (double)(now - budget->start_us - MIN(budget->quant_us, now - budget->start_us))*left/done;
+        const double quant_us = (double)budget->avg_us*budget->events*left/done;
+        const double avail_us = (double)(budget->deadline_us - now) - other_us;
+
+        if (quant_us > avail_us && level < budget->max_level)
+            level++;
+        else if (quant_us < avail_us/2 && level > 0)
+            level--;
+    }
+
+    if (level != budget->level) {
+        int speed, quality;
+
+        budget_apply(budget, enc, nenc, level);
+        budget_effort(enc[0].liqargs, level, &speed, &quality);
+        a2b_log(A2B_LOG_INFO, FILENAME_FMT ": time budget, quantizing at effort level %d/%d (speed %d, max quality %d).",
+                count + enc[0].args->index_base, level, budget->max_level, speed, quality);
+    }
+}
+
+//Account the event just encoded, the variants run in parallel so the slowest one counts.
+static void budget_account(a2b_budget_t *budget, const a2b_enc_t *enc, int nenc)
+{
+    uint64_t quant_us = 0;
+
+    for (int k = 0; k < nenc; k++)
+        quant_us = MAX(quant_us, enc[k].quant_us);
+    budget->quant_us += quant_us;
+    budget->avg_us = budget->level_events ? budget->avg_us + ((int64_t)quant_us - (int64_t)budget->avg_us)/(1 << BUDGET_AVG_SHIFT) : quant_us;
+    budget->level_events++;
+    budget->events++;
+    budget->reduced += budget->level > 0;
+}
 
-    liq_result *res;
-    liq_image *img;
+static void budget_done(a2b_budget_t *budget, a2b_enc_t *enc, int nenc)
+{
+    const int64_t margin_ms = ((int64_t)budget->deadline_us - (int64_t)monotonic_us())/1000;
+
+    a2b_log(A2B_LOG_INFO, "time budget: %u of %u events quantized below the configured effort, %s by %.1f s.",
+            (uint32_t)budget->reduced, (uint32_t)budget->events, margin_ms >= 0 ? "finished early" : "overran", llabs(margin_ms)/1000.0);
+    //The attributes outlive the conversion.
+    budget_apply(budget, enc, nenc, 0);
+    free(budget->starts);
+}
+
+static int render_encode(a2b_ctx_t *ctx, const char *subfile, frate_t *frate, a2b_enc_t *enc, int nenc)
+{
+    long long tm = 0;
+    int count = 0, fres = 0, k;
+    int ret = A2B_OK;
+    uint64_t event_frames = 0;
+    uint64_t frame_cnt = MAX(1, ctx->args.start_frame);
+    opts_t *args = &ctx->args;
+    a2b_budget_t budget;
+    //The PNGs of a single variant at the render size are shared.
+    const int shared = args->shared_pngs && nenc == 1 && enc[0].scale == NULL;
 
-    eventlist_t *evlist = calloc(1, sizeof(eventlist_t));
+    image_t *frame = NULL, *prev_frame = NULL;
+
+    if (fesetround(FE_TONEAREST)) {
+        a2b_log(A2B_LOG_WARN, "failed to set configure rounding method. Bitmaps may suffer from colour drift.");
+    }
 
-    init(args, liqargs);
-    ASS_Track *track = ass_read_file(ass_library, subfile, NULL);
+    ASS_Track *track = ass_read_file(ctx->ass_library, (char *)subfile, NULL);
 
     if (!track) {
-        printf("track init failed!\n");
-        exit(1);
+        a2b_log(A2B_LOG_ERROR, "track init failed!");
+        return A2B_ERR_TRACK;
+    }
+
+    a2b_log(A2B_LOG_INFO, "BDN format: (%dx%d), rendering at (%dx%d) for (%dx%d) display.", args->frame_w, args->frame_h,
+            args->render_w, args->render_h, (args->par > 0 ? (int)round(args->storage_w/args->par) : args->storage_w), args->storage_h);
+
+    apply_memory_limit(ctx, enc, nenc);
+    ctx->prev_invalid = 0;
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+    ctx->spans.on = ctx->trace.span != NULL;
+    ctx->spans.count = 0;
+    for (k = 0; k < nenc; k++) {
+        memset(&enc[k].stats, 0, sizeof(enc[k].stats));
+        memset(&enc[k].event, 0, sizeof(enc[k].event));
+        enc[k].spans.on = ctx->spans.on;
+        enc[k].spans.count = 0;
+    }
+    if (args->time_budget && !args->analyze &&
+        budget_init(&budget, args, enc, nenc, track, frame_to_realtime_ms(frame_cnt, frate),
+                    args->end_frame ? (long long)frame_to_realtime_ms(args->end_frame, frate) : LLONG_MAX)) {
+        ass_free_track(track);
+        return A2B_ERR_ALLOC;
     }
 
-    printf(A2B_LOG_PREFIX "BDN format: (%dx%d), rendering at (%dx%d) for (%dx%d) display.\n", args->frame_w, args->frame_h,
-           args->render_w, args->render_h, (args->par > 0 ? (int)round(args->storage_w/args->par) : args->storage_w), args->storage_h);
+    frame = image_init(args->render_w, args->render_h);
+    if (!args->keep_dupes)
+        prev_frame = image_init(args->render_w, args->render_h);
 
-    image_t *frame = image_init(args->render_w, args->render_h);
-    image_t *prev_frame;
-    prev_frame = args->keep_dupes ? NULL : image_init(args->render_w, args->render_h);
+    if (!frame || (!args->keep_dupes && !prev_frame) ||
+        comp_init(&ctx->comp, args->render_w, args->render_h, &ctx->lut)) {
+        ret = A2B_ERR_ALLOC;
+        goto finish;
+    }
+
+    if (ctx->monitor.progress) {
+        ctx->progress.first = frame_cnt;
+        ctx->progress.last = args->end_frame ? args->end_frame : track_end_frame(track, frate);
+        ctx->progress_ms = monotonic_ms();
+    }
 
     while (1) {
+        if (ctx->monitor.progress)
+            report_progress(ctx, enc, nenc, frame_cnt, 0);
+
         if (fres && fres != 2 && count) {
-            eventlist_set(evlist, frame, count - 1);
+            for (k = 0; k < nenc; k++) {
+                event_copy(&enc[k].event, &enc[k].cur);
+                enc[k].event.in = frame->in;
+                enc[k].event.out = frame->out;
+                enc[k].event.rendered = (uint32_t)(ctx->stats.frames - event_frames);
+            }
         }
 
-        fres = get_frame(ass_renderer, track, prev_frame, frame, frame_cnt, frate, args);
+        //End of the slice, the last event is clamped to it.
+        if (args->end_frame && frame_cnt >= args->end_frame)
+            goto finish;
+
+        const uint64_t frame_us = trace_clock(&ctx->spans);
+        fres = get_frame(ctx, track, prev_frame, frame, frame_cnt, frate);
+        if (ctx->spans.on) {
+            //New event, or frame of the last one.
+            trace_push(&ctx->spans, A2B_STAGE_FRAME, frame_us, fres == 3 || fres == 1 ? frame : NULL);
+            trace_flush(&ctx->trace, &ctx->spans, frame_cnt, fres == 3 ? count : (fres == 1 ? count - 1 : -1), -1);
+        }
 
         switch (fres) {
             case 3:
             {
-                if (args->quantize && quantize_event(frame, &img, &res, args)) {
-                    printf("Quantization failed for " FILENAME_FMT FILENAME_EXT ".\n", count);
-                    exit(1);
+                //The previous event can no longer be extended.
+                if (count && emit_event(enc, nenc, count - 1)) {
+                    ret = A2B_ERR_SINK;
+                    goto finish;
                 }
-                if (args->split && find_split(frame, args)) {
-                    if (args->quantize) {
-                        write_png_palette(count, frame, &img, &res, args, 1, liqargs->dither);
-                    } else {
-                        for (img_cnt = 0; img_cnt < 2; img_cnt++) {
-                            frame->subx1 = frame->crops[img_cnt].x1;
-                            frame->subx2 = frame->crops[img_cnt].x2;
-                            frame->suby1 = frame->crops[img_cnt].y1;
-                            frame->suby2 = frame->crops[img_cnt].y2;
-                            snprintf(imgfile, FILENAME_MAX_LENGTH, FILENAME_FMT FILENAME_CNT FILENAME_EXT, count, img_cnt);
-                            write_png(imgfile, frame);
-                        }
-                    }
+                event_frames = ctx->stats.frames - 1;
+                if (args->analyze) {
+                    analyze_event(enc, nenc, frame);
                 } else {
-                    if (args->quantize) {
-                        write_png_palette(count, frame, &img, &res, args, 0, liqargs->dither);
-                    } else {
-                        snprintf(imgfile, FILENAME_MAX_LENGTH, FILENAME_FMT FILENAME_EXT, count);
-                        write_png(imgfile, frame);
+                    if (args->time_budget)
+                        budget_update(&budget, enc, nenc, frame_to_realtime_ms(frame_cnt, frate), count);
+                    for (k = 0; k < nenc; k++)
+                        enc[k].translated = ctx->translated && count > 0;
+                    if (!(shared && reuse_lookup(&ctx->reuse, enc, frame, count))) {
+                        if ((ret = encode_variants(enc, nenc, ctx->max_parallel, frame, count, &ctx->trace)))
+                            goto finish;
+                        if (shared && (ret = reuse_insert(&ctx->reuse, enc, frame, count)))
+                            goto finish;
                     }
+                    if (args->time_budget)
+                        budget_account(&budget, enc, nenc);
                 }
-                if (args->quantize) {
-                    liq_result_destroy(res);
-                    liq_image_destroy(img);
+                for (k = 0; k < nenc; k++) {
+                    if (enc[k].scale && enc[k].scale->check_every && !args->analyze)
+                        scale_check(ctx, &enc[k], frame_to_realtime_ms(frame_cnt, frate));
                 }
                 count++;
+                ctx->stats.events = count;
                 if (args->downsampled) {
                     frame_cnt += args->downsampled;
                     frame->out += args->downsampled;
@@ -796,17 +2849,86 @@ eventlist_t *render_subs(char *subfile, frate_t *frate, opts_t *args, liqopts_t
     }
 
 finish:
-    free(frame->buffer);
-    free(frame);
-    if (prev_frame) {
-        free(prev_frame->buffer);
-        free(prev_frame);
-    }
-    if (args->quantize && attr)
-        liq_attr_destroy(attr);
+    for (k = 0; k < nenc; k++) {
+        if (args->end_frame && enc[k].event.out > args->end_frame)
+            enc[k].event.out = args->end_frame;
+        ctx->stats.images += enc[k].stats.images;
+        ctx->stats.bytes += enc[k].stats.bytes;
+    }
+    if (ret == A2B_OK && count && emit_event(enc, nenc, count - 1))
+        ret = A2B_ERR_SINK;
+    if (ctx->monitor.progress)
+        report_progress(ctx, enc, nenc, frame_cnt, 1);
+    if (args->time_budget && !args->analyze)
+        budget_done(&budget, enc, nenc);
+    for (k = 0; k < nenc; k++)
+        arena_free(&enc[k].arena);
+
+    comp_free(&ctx->comp);
+    image_free(frame);
+    image_free(prev_frame);
     ass_free_track(track);
-    ass_renderer_done(ass_renderer);
-    ass_library_done(ass_library);
 
-    return evlist;
+    return ret;
+}
+
+int render_subs(a2b_ctx_t *ctx, const char *subfile, frate_t *frate, a2b_sink_t *sink)
+{
+    a2b_enc_t enc = {.args = &ctx->args, .liqargs = &ctx->liqargs, .attr = ctx->attr, .sink = sink};
+
+    return render_encode(ctx, subfile, frate, &enc, 1);
+}
+
+int render_subs_profiles(a2b_ctx_t *ctx, const char *subfile, frate_t *frate, a2b_profile_t *profiles, int nprofiles)
+{
+    a2b_enc_t enc[A2B_MAX_PROFILES];
+    int k, ret = A2B_OK;
+
+    if (nprofiles < 1 || nprofiles > A2B_MAX_PROFILES)
+        return A2B_ERR_ARGS;
+
+    memset(enc, 0, sizeof(enc));
+    for (k = 0; k < nprofiles && ret == A2B_OK; k++) {
+        const opts_t *pargs = &profiles[k].args;
+
+        enc[k].args = pargs;
+        enc[k].liqargs = &profiles[k].liqargs;
+        enc[k].sink = profiles[k].sink;
+        if (pargs->quantize) {
+            enc[k].attr = liq_attr_setup(pargs, &profiles[k].liqargs);
+            if (enc[k].attr == NULL)
+                ret = A2B_ERR_QUANTIZE;
+        }
+        //Smaller formats are derived from the render, at most SCALE_MAX_TAPS - 1 times smaller.
+        if (ret == A2B_OK && (pargs->render_w != ctx->args.render_w || pargs->render_h != ctx->args.render_h)) {
+            image_t src = {.width = ctx->args.render_w, .height = ctx->args.render_h};
+
+            if (pargs->render_w > src.width || pargs->render_h > src.height ||
+                pargs->render_w*(SCALE_MAX_TAPS - 1) < src.width || pargs->render_h*(SCALE_MAX_TAPS - 1) < src.height) {
+                a2b_log(A2B_LOG_ERROR, "Cannot derive %dx%d output from a %dx%d render.", pargs->render_w, pargs->render_h, src.width, src.height);
+                ret = A2B_ERR_ARGS;
+                break;
+            }
+            enc[k].scale = scale_init(&src, pargs->render_w, pargs->render_h);
+            if (enc[k].scale == NULL || enc[k].scale->acc == NULL)
+                ret = A2B_ERR_ALLOC;
+            else if ((enc[k].scale->check_every = profiles[k].check_every))
+                ret = scale_check_setup(ctx, enc[k].scale, pargs, subfile);
+        }
+    }
+
+    if (ret == A2B_OK)
+        ret = render_encode(ctx, subfile, frate, enc, nprofiles);
+
+    for (k = 0; k < nprofiles; k++) {
+        if (enc[k].attr)
+            liq_attr_destroy(enc[k].attr);
+        if (enc[k].scale && enc[k].scale->checked) {
+            a2b_log(A2B_LOG_INFO, "%dx%d output: %u events checked against a native render, %u diverging, worst PSNR %.1f dB.",
+                    enc[k].scale->frame->width, enc[k].scale->frame->height, enc[k].scale->checked,
+                    enc[k].scale->diverged, enc[k].scale->worst_psnr);
+        }
+        scale_free(enc[k].scale);
+    }
+    return ret;
 }
@@ -0,0 +1,405 @@
+/* Copyright © 2024, cubicibo
+ * The same agreement notice as ass2bdnxml.c applies.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "common.h"
+#include "report.h"
+
+#define REPORT_HEADER "# ass2bdnxml report v1"
+#define REPORT_LINE_LENGTH (256)
+
+long report_peak_rss_kb(void)
+{
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+    return usage.ru_maxrss;
+}
+
+long report_rss_kb(void)
+{
+    long pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+
+    //Resident set size is the second field, in pages.
+    if (fp == NULL || fscanf(fp, "%*s %ld", &pages) != 1) {
+        if (fp)
+            fclose(fp);
+        return report_peak_rss_kb();
+    }
+    fclose(fp);
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int write_report(eventlist_t *evlist, const opts_t *args, const char *reportfile, uint64_t wall_ms, long peak_rss_kb)
+{
+    FILE *of = fopen(reportfile, "w");
+    int i;
+
+    if (of == NULL) {
+        perror("Error opening report file.");
+        return A2B_ERR_ARGS;
+    }
+
+    fprintf(of, REPORT_HEADER "\n");
+    for (i = 0; i < evlist->nmemb; i++) {
+        image_t *img = evlist->events[i];
+
+        fprintf(of, "event %d in %" PRIu64 " out %" PRIu64 "\n", i, img->in, img->out);
+        if (img->crops[0].x1 & 0xFF000000) {
+            fprintf(of, "image %08d.png %dx%d+%d+%d %016" PRIx64 "\n", i - (int)img->ref + args->index_base,
+                    img->subx2 - img->subx1 + 1, img->suby2 - img->suby1 + 1,
+                    img->subx1, img->suby1, img->digest[0]);
+        } else {
+            for (uint8_t ki = 0; ki < 2; ki++) {
+                fprintf(of, "image %08d_%d.png %dx%d+%d+%d %016" PRIx64 "\n", i - (int)img->ref + args->index_base, ki,
+                        img->crops[ki].x2 - img->crops[ki].x1 + 1, img->crops[ki].y2 - img->crops[ki].y1 + 1,
+                        img->crops[ki].x1, img->crops[ki].y1, img->digest[ki]);
+            }
+        }
+    }
+    fprintf(of, "events %d\n", evlist->nmemb);
+    fprintf(of, "wall_ms %" PRIu64 "\n", wall_ms);
+    fprintf(of, "peak_rss_kb %ld\n", peak_rss_kb);
+    fclose(of);
+    return A2B_OK;
+}
+
+static int read_line(FILE *fp, char *buf)
+{
+    if (fgets(buf, REPORT_LINE_LENGTH, fp) == NULL)
+        return 0;
+    buf[strcspn(buf, "\n")] = 0;
+    return 1;
+}
+
+//Next output line of a report, the resource usage lines met on the way are stored in wall and rss.
+static int read_output_line(FILE *fp, char *buf, double *wall, double *rss)
+{
+    while (read_line(fp, buf)) {
+        if (sscanf(buf, "wall_ms %lf", wall) != 1 && sscanf(buf, "peak_rss_kb %lf", rss) != 1)
+            return 1;
+    }
+    return 0;
+}
+
+//A portable baseline may leave out the geometry and the hash of its image lines, which depend on the
+//libass and FreeType versions: such a line matches any image line with the same PNG name.
+static int same_output_line(const char *line, const char *ref)
+{
+    size_t len = strlen(ref);
+
+    if (!strncmp(ref, "image ", 6) && strchr(ref + 6, ' ') == NULL)
+        return !strncmp(line, ref, len) && (line[len] == ' ' || line[len] == 0);
+    return !strcmp(line, ref);
+}
+
+static int check_metric(const char *name, double ref, double val, double tolerance)
+{
+    double limit = ref * (1.0 + tolerance/100.0);
+
+    if (ref > 0 && val > limit) {
+        printf(A2B_LOG_PREFIX "report: %s regressed, %.0f > %.0f (baseline %.0f, +%.1f%%).\n", name, val, limit, ref, tolerance);
+        return 1;
+    }
+    return 0;
+}
+
+int check_report(const char *reportfile, const char *baselinefile, double tolerance)
+{
+    char line[REPORT_LINE_LENGTH], ref[REPORT_LINE_LENGTH];
+    double wall[2] = {0}, rss[2] = {0};
+    int lineno = 0, mismatches = 0;
+    FILE *fp = fopen(reportfile, "r");
+    FILE *fb = fopen(baselinefile, "r");
+
+    if (fp == NULL || fb == NULL) {
+        perror("Error opening report file.");
+        if (fp)
+            fclose(fp);
+        if (fb)
+            fclose(fb);
+        return A2B_ERR_ARGS;
+    }
+
+    //Output lines must be identical wherever the resource usage lines are, which may vary within the tolerance.
+    while (1) {
+        int has_line = read_output_line(fp, line, &wall[1], &rss[1]);
+        int has_ref = read_output_line(fb, ref, &wall[0], &rss[0]);
+        lineno++;
+
+        if (!has_line && !has_ref)
+            break;
+
+        if (has_line != has_ref || !same_output_line(line, ref)) {
+            if (mismatches++ < 10) {
+                printf(A2B_LOG_PREFIX "report: output line %d differs: \"%s\" (baseline: \"%s\").\n", lineno,
+                       has_line ? line : "", has_ref ? ref : "");
+            }
+        }
+    }
+    fclose(fp);
+    fclose(fb);
+
+    if (mismatches)
+        printf(A2B_LOG_PREFIX "report: %d line(s) differ from the baseline.\n", mismatches);
+
+    mismatches += check_metric("wall time (ms)", wall[0], wall[1], tolerance);
+    mismatches += check_metric("peak RSS (kB)", rss[0], rss[1], tolerance);
+    return mismatches ? A2B_ERR_REPORT : A2B_OK;
+}
+
+//Analysis plan
+
+//Rough encode model, calibrated on dialogue and typesetting at 1080p.
+#define PLAN_RGBA_BYTES_PER_PX (1.1)
+#define PLAN_PAL_BYTES_PER_PX (0.45)
+#define PLAN_EMPTY_BYTES_PER_PX (0.01)
+#define PLAN_PNG_OVERHEAD (120)
+#define PLAN_RGBA_NS_PER_PX (9.0)
+#define PLAN_QUANTIZE_NS_PER_PX (45.0)
+#define PLAN_SPLIT_NS_PER_PX (2.0)
+//Events this short, back to back, are animation
+#define PLAN_ANIMATED_FRAMES (2)
+#define PLAN_ANIMATED_MIN_EVENTS (3)
+
+static void json_string(FILE *of, const char *str)
+{
+    fputc('"', of);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            fputc('\\', of);
+        if ((unsigned char)*str >= 0x20)
+            fputc(*str, of);
+    }
+    fputc('"', of);
+}
+
+static void plan_estimate(const opts_t *args, const image_t *img, double *bytes, double *cost_ms)
+{
+    double area = (double)(img->subx2 - img->subx1 + 1) * (img->suby2 - img->suby1 + 1);
+    double ns = area * (args->quantize ? PLAN_QUANTIZE_NS_PER_PX : PLAN_RGBA_NS_PER_PX);
+
+    if (args->split)
+        ns += area * PLAN_SPLIT_NS_PER_PX;
+    *bytes = PLAN_PNG_OVERHEAD + (area - img->opaque) * PLAN_EMPTY_BYTES_PER_PX +
+             img->opaque * (args->quantize ? PLAN_PAL_BYTES_PER_PX : PLAN_RGBA_BYTES_PER_PX);
+    if (args->quantize)
+        *bytes += 4*args->quantize;
+    *cost_ms = ns / 1e6;
+}
+
+int write_plan(eventlist_t *evlist, const char *planfile, const char *subfile, vfmt_t *vfmt,
+               frate_t *frate, const opts_t *args, const a2b_stats_t *stats)
+{
+    char buf_in[12], buf_out[12];
+    double bytes, cost_ms, total_bytes = 0, total_ms = 0;
+    int i, k, nstretch = 0, ret = A2B_OK;
+    FILE *of = strcmp(planfile, "-") ? fopen(planfile, "w") : stdout;
+
+    if (of == NULL) {
+        perror("Error opening plan file.");
+        return A2B_ERR_ARGS;
+    }
+
+    fprintf(of, "{\n  \"input\": ");
+    json_string(of, subfile);
+    fprintf(of, ",\n  \"video_format\": \"%s\",\n  \"fps\": \"%s\",\n  \"frames_rendered\": %" PRIu64 ",\n  \"events\": [",
+            vfmt->name, frate->name, stats->frames);
+
+    for (i = 0; i < evlist->nmemb && ret == A2B_OK; i++) {
+        image_t *img = evlist->events[i];
+        if (frame_to_tc(img->in + args->offset, frate, buf_in) || frame_to_tc(img->out + args->offset, frate, buf_out)) {
+            ret = A2B_ERR_XML;
+            break;
+        }
+        plan_estimate(args, img, &bytes, &cost_ms);
+        total_bytes += bytes;
+        total_ms += cost_ms;
+        fprintf(of, "%s\n    {\"index\": %d, \"in\": \"%s\", \"out\": \"%s\", \"frames\": %" PRIu64 ", \"rendered\": %u, "
+                    "\"x\": %d, \"y\": %d, \"w\": %d, \"h\": %d, \"opaque\": %u, \"est_bytes\": %.0f, \"est_cost_ms\": %.3f}",
+                i ? "," : "", i, buf_in, buf_out, img->out - img->in, img->rendered,
+                img->subx1, img->suby1, img->subx2 - img->subx1 + 1, img->suby2 - img->suby1 + 1,
+                img->opaque, bytes, cost_ms);
+    }
+
+    //Stretches of short back to back events: animations, the expensive parts of the track.
+    fprintf(of, "\n  ],\n  \"animated\": [");
+    for (i = 0, k = 0; i < evlist->nmemb && ret == A2B_OK; i = k) {
+        for (k = i; k < evlist->nmemb; k++) {
+            image_t *img = evlist->events[k];
+            if (img->out - img->in > PLAN_ANIMATED_FRAMES || (k > i && img->in != evlist->events[k-1]->out))
+                break;
+        }
+        if (k - i >= PLAN_ANIMATED_MIN_EVENTS) {
+            frame_to_tc(evlist->events[i]->in + args->offset, frate, buf_in);
+            frame_to_tc(evlist->events[k-1]->out + args->offset, frate, buf_out);
+            fprintf(of, "%s\n    {\"in\": \"%s\", \"out\": \"%s\", \"first\": %d, \"events\": %d}",
+                    nstretch++ ? "," : "", buf_in, buf_out, i, k - i);
+        }
+        k = MAX(k, i + 1);
+    }
+    fprintf(of, "\n  ],\n  \"total\": {\"events\": %d, \"est_bytes\": %.0f, \"est_cost_ms\": %.1f}\n}\n",
+            evlist->nmemb, total_bytes, total_ms);
+
+    if (of != stdout)
+        fclose(of);
+    return ret;
+}
+
+void progress_init(progress_t *progress, int fd, frate_t *frate, int64_t offset)
+{
+    struct timespec ts;
+
+    memset(progress, 0, sizeof(progress_t));
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    progress->fd = fd;
+    progress->frate = frate;
+    progress->offset = offset;
+    progress->start_ms = progress->last_ms = (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+//a2b_monitor_t callback, one JSON object per line. Writing stops at the first error,
+//a closed pipe must not abort the conversion.
+void progress_write(void *priv, const a2b_progress_t *pr)
+{
+    progress_t *progress = (progress_t *)priv;
+    struct timespec ts;
+    char line[512], tc[12] = "";
+    uint64_t now;
+    double percent = 100.0, fps = 0.0;
+    int len;
+
+    if (progress->fd < 0)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+
+    if (pr->last > pr->first && !pr->done)
+        percent = MIN(100.0, 100.0*(double)(MAX(pr->frame, pr->first) - pr->first)/(double)(pr->last - pr->first));
+    if (now > progress->last_ms)
+        fps = 1000.0*(pr->stats.frames - progress->last_frames)/(double)(now - progress->last_ms);
+    if ((int64_t)pr->frame + progress->offset > 0 && frame_to_tc(pr->frame + progress->offset, progress->frate, tc))
+        tc[0] = 0;
+    progress->last_ms = now;
+    progress->last_frames = pr->stats.frames;
+
+    len = snprintf(line, sizeof(line), "{\"tc\": \"%s\", \"frame_cnt\": %" PRIu64 ", \"percent\": %.2f, \"events\": %" PRIu64
+                   ", \"frames\": %" PRIu64 ", \"fps\": %.2f, \"images\": %" PRIu64 ", \"bytes\": %" PRIu64
+                   ", \"rss_kb\": %ld, \"elapsed_s\": %.1f, \"done\": %s}\n",
+                   tc, pr->frame, percent, pr->stats.events, pr->stats.frames, fps, pr->stats.images, pr->stats.bytes,
+                   report_rss_kb(), (now - progress->start_ms)/1000.0, pr->done ? "true" : "false");
+    for (int off = 0; off < len; ) {
+        ssize_t n = write(progress->fd, line + off, len - off);
+        if (n <= 0) {
+            progress->fd = -1;
+            return;
+        }
+        off += n;
+    }
+}
+
+static void metric(FILE *of, const char *name, const char *type, const char *help, const char *labels, double val)
+{
+    fprintf(of, "# HELP ass2bdnxml_%s %s\n# TYPE ass2bdnxml_%s %s\nass2bdnxml_%s%s %.17g\n", name, help, name, type, name, labels, val);
+}
+
+int write_metrics(const char *metricsfile, const char *subfile, const a2b_stats_t *stats, uint64_t wall_ms, long peak_rss_kb, int err)
+{
+    char tmpfile[4096], labels[1024];
+    const char *base = strrchr(subfile, '/');
+    size_t k = 0;
+    FILE *of;
+
+    //Label value escaping of the exposition format.
+    k += snprintf(labels, sizeof(labels), "{input=\"");
+    for (base = base ? base + 1 : subfile; *base && k < sizeof(labels) - 4; base++) {
+        if (*base == '"' || *base == '\\')
+            labels[k++] = '\\';
+        if (*base == '\n') {
+            labels[k++] = '\\';
+            labels[k++] = 'n';
+        } else {
+            labels[k++] = *base;
+        }
+    }
+    snprintf(labels + k, sizeof(labels) - k, "\"}");
+
+    //Written aside then renamed, so collectors never read a partial snapshot.
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", metricsfile);
+    of = fopen(tmpfile, "w");
+    if (of == NULL) {
+        perror("Error opening metrics file.");
+        return A2B_ERR_REPORT;
+    }
+    metric(of, "success", "gauge", "1 if the last conversion succeeded.", labels, err == A2B_OK);
+    metric(of, "frames", "gauge", "Frames rendered by libass.", labels, stats->frames);
+    metric(of, "events", "gauge", "Events written.", labels, stats->events);
+    metric(of, "images", "gauge", "PNG files written.", labels, stats->images);
+    metric(of, "bytes", "gauge", "Bytes of PNG written.", labels, stats->bytes);
+    metric(of, "wall_seconds", "gauge", "Wall time of the conversion.", labels, wall_ms/1000.0);
+    metric(of, "peak_rss_bytes", "gauge", "Peak resident set size.", labels, peak_rss_kb*1024.0);
+    metric(of, "last_run_timestamp_seconds", "gauge", "Completion time of the conversion.", labels, (double)time(NULL));
+
+    if (fclose(of) || rename(tmpfile, metricsfile)) {
+        perror("Error writing metrics file.");
+        remove(tmpfile);
+        return A2B_ERR_REPORT;
+    }
+    return A2B_OK;
+}
+
+int trace_open(trace_t *trace, const char *tracefile, int nvariants)
+{
+    struct timespec ts;
+
+    memset(trace, 0, sizeof(trace_t));
+    trace->fp = fopen(tracefile, "w");
+    if (trace->fp == NULL) {
+        perror("Error opening trace file.");
+        return A2B_ERR_ARGS;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace->start_us = (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+
+    //Thread 0 is the render, thread k+1 the encoding of output variant k.
+    fprintf(trace->fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n"
+                       "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"render\"}}");
+    for (int k = 0; k < nvariants; k++)
+        fprintf(trace->fp, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"output %d\"}}",
+                k + 1, k);
+    return A2B_OK;
+}
+
+//a2b_trace_t callback, one complete event per span.
+void trace_write(void *priv, const a2b_span_t *span)
+{
+    trace_t *trace = (trace_t *)priv;
+
+    fprintf(trace->fp, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %" PRIu64 ", \"dur\": %u, \"pid\": 1, "
+                       "\"tid\": %d, \"args\": {\"frame\": %" PRIu64 ", \"event\": %d, \"w\": %d, \"h\": %d}}",
+            a2b_stages[span->stage], span->variant < 0 ? "render" : "encode",
+            span->start_us > trace->start_us ? span->start_us - trace->start_us : 0, span->dur_us,
+            span->variant + 1, span->frame, span->event, span->w, span->h);
+    trace->spans++;
+}
+
+int trace_close(trace_t *trace)
+{
+    fprintf(trace->fp, "\n]}\n");
+    if (ferror(trace->fp) | fclose(trace->fp)) {
+        perror("Error writing trace file.");
+        return A2B_ERR_REPORT;
+    }
+    return A2B_OK;
+}
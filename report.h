@@ -0,0 +1,43 @@
+#include <stdio.h>
+
+#include "common.h"
+
+//Run report: event timings, decoded pixel hash of every PNG and resource usage.
+long report_peak_rss_kb(void);
+long report_rss_kb(void);
+int write_report(eventlist_t *evlist, const opts_t *args, const char *reportfile, uint64_t wall_ms, long peak_rss_kb);
+
+//Compare a report to a baseline, wall time and peak RSS may exceed the
+//baseline by at most tolerance percent.
+int check_report(const char *reportfile, const char *baselinefile, double tolerance);
+
+//Analysis plan (--analyze): per event geometry, sampled frames and estimated encode output and cost.
+int write_plan(eventlist_t *evlist, const char *planfile, const char *subfile, vfmt_t *vfmt,
+               frate_t *frate, const opts_t *args, const a2b_stats_t *stats);
+
+//Progress stream (--progress-fd): one JSON line per a2b_monitor_t report.
+typedef struct progress_s {
+    int fd;
+    frate_t *frate;
+    int64_t offset;
+    uint64_t start_ms;
+    uint64_t last_ms;
+    uint64_t last_frames;
+} progress_t;
+
+void progress_init(progress_t *progress, int fd, frate_t *frate, int64_t offset);
+void progress_write(void *priv, const a2b_progress_t *pr);
+
+//Chrome trace event file (--trace), for Perfetto or chrome://tracing.
+typedef struct trace_s {
+    FILE *fp;
+    uint64_t start_us;
+    uint64_t spans;
+} trace_t;
+
+int trace_open(trace_t *trace, const char *tracefile, int nvariants);
+void trace_write(void *priv, const a2b_span_t *span);
+int trace_close(trace_t *trace);
+
+//Final counters as a Prometheus textfile snapshot (--metrics).
+int write_metrics(const char *metricsfile, const char *subfile, const a2b_stats_t *stats, uint64_t wall_ms, long peak_rss_kb, int err);
@@ -0,0 +1,801 @@
+/* Copyright © 2024, cubicibo
+ * The same agreement notice as ass2bdnxml.c applies.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "server.h"
+
+#define LINE_MAX_LENGTH (65536)
+#define REPLY_MAX_LENGTH (4096)
+
+enum json_type_e {
+    JSON_STRING,
+    JSON_NUMBER,
+    JSON_BOOL,
+    JSON_NULL
+};
+
+typedef struct client_s {
+    int fd;
+    int refs;
+    pthread_mutex_t lock;
+} client_t;
+
+typedef struct job_s {
+    struct job_s *next;
+    client_t *client;
+    uint64_t id;
+    char *tag;
+    char *cmd;
+    char *input;
+    char *outdir;
+    char *bdnfile;
+    char *fontdir;
+    char *track_name;
+    char *language;
+    frate_t *frate;
+    vfmt_t *vfmt;
+    uint8_t liq_params;
+    opts_t args;
+    liqopts_t liqargs;
+} job_t;
+
+typedef struct reader_s reader_t;
+
+typedef struct server_s {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    job_t *head, *tail;
+    reader_t *readers;      //connections, joined by serve() before it returns
+    opts_t args;
+    liqopts_t liqargs;
+    int listen_fd;
+    int workers;
+    int quit;
+    uint64_t next_id;
+    uint64_t queued, done, failed;
+} server_t;
+
+struct reader_s {
+    struct reader_s *next;
+    server_t *srv;
+    client_t *client;
+    pthread_t thread;
+    int done;               //the reader released its client, under the server lock
+};
+
+static void client_release(client_t *client)
+{
+    int refs;
+
+    pthread_mutex_lock(&client->lock);
+    refs = --client->refs;
+    pthread_mutex_unlock(&client->lock);
+
+    if (refs == 0) {
+        close(client->fd);
+        pthread_mutex_destroy(&client->lock);
+        free(client);
+    }
+}
+
+static void client_send(client_t *client, const char *fmt, ...)
+{
+    char buf[REPLY_MAX_LENGTH];
+    va_list va;
+    int len;
+
+    va_start(va, fmt);
+    len = vsnprintf(buf, sizeof(buf) - 1, fmt, va);
+    va_end(va);
+    if (len < 0)
+        return;
+    len = MIN(len, (int)sizeof(buf) - 2);
+    buf[len++] = '\n';
+
+    //The client may have gone away, replies are then dropped silently.
+    pthread_mutex_lock(&client->lock);
+    for (int sent = 0; sent < len; ) {
+        ssize_t k = send(client->fd, buf + sent, len - sent, MSG_NOSIGNAL);
+        if (k <= 0)
+            break;
+        sent += k;
+    }
+    pthread_mutex_unlock(&client->lock);
+}
+
+//Copy a string into buf as a JSON string body.
+static const char *json_escape(const char *str, char *buf, size_t size)
+{
+    size_t k = 0;
+
+    for (; str && *str && k + 7 < size; str++) {
+        if (*str == '"' || *str == '\\') {
+            buf[k++] = '\\';
+            buf[k++] = *str;
+        } else if ((uint8_t)*str < 0x20) {
+            k += snprintf(&buf[k], size - k, "\\u%04x", (uint8_t)*str);
+        } else {
+            buf[k++] = *str;
+        }
+    }
+    buf[k] = 0;
+    return buf;
+}
+
+static char *json_skip_ws(char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    return p;
+}
+
+//Parse a JSON string in place, p points after the opening quote.
+static char *json_string(char *p, char **out)
+{
+    char *w = p;
+    *out = p;
+
+    while (*p && *p != '"') {
+        if (*p == '\\') {
+            p++;
+            switch (*p) {
+                case 'n': *w++ = '\n'; break;
+                case 't': *w++ = '\t'; break;
+                case 'r': *w++ = '\r'; break;
+                case 'b': *w++ = '\b'; break;
+                case 'f': *w++ = '\f'; break;
+                case 'u':
+                {
+                    //Only the ASCII range is meaningful for paths and tags.
+                    unsigned int cp;
+                    if (sscanf(p + 1, "%4x", &cp) != 1 || cp == 0 || cp > 0x7F)
+                        return NULL;
+                    *w++ = (char)cp;
+                    p += 4;
+                    break;
+                }
+                case '"': case '\\': case '/':
+                    *w++ = *p;
+                    break;
+                default:
+                    return NULL;
+            }
+            p++;
+        } else {
+            *w++ = *p++;
+        }
+    }
+    if (*p != '"')
+        return NULL;
+    *w = 0;
+    return p + 1;
+}
+
+static int job_str(char **dst, const char *val)
+{
+    free(*dst);
+    *dst = strdup(val);
+    return *dst == NULL;
+}
+
+static int job_set(job_t *job, const char *key, int type, const char *sval, double nval)
+{
+    opts_t *args = &job->args;
+    liqopts_t *liqargs = &job->liqargs;
+    int i;
+
+    if (type == JSON_NULL)
+        return 0;
+
+    if (type == JSON_STRING) {
+        if (!strcmp(key, "id"))
+            return job_str(&job->tag, sval);
+        if (!strcmp(key, "cmd"))
+            return job_str(&job->cmd, sval);
+        if (!strcmp(key, "input"))
+            return job_str(&job->input, sval);
+        if (!strcmp(key, "output"))
+            return job_str(&job->outdir, sval);
+        if (!strcmp(key, "xml"))
+            return job_str(&job->bdnfile, sval);
+        if (!strcmp(key, "fontdir"))
+            return job_str(&job->fontdir, sval);
+        if (!strcmp(key, "trackname"))
+            return job_str(&job->track_name, sval);
+        if (!strcmp(key, "language"))
+            return job_str(&job->language, sval);
+        if (!strcmp(key, "fps")) {
+            for (i = 0, job->frate = NULL; frates[i].name != NULL; i++)
+                if (!strcasecmp(frates[i].name, sval))
+                    job->frate = &frates[i];
+            return job->frate == NULL;
+        }
+        if (!strcmp(key, "video-format")) {
+            for (i = 0, job->vfmt = NULL; vfmts[i].name != NULL; i++)
+                if (!strcasecmp(vfmts[i].name, sval))
+                    job->vfmt = &vfmts[i];
+            return job->vfmt == NULL;
+        }
+        if (!strcmp(key, "colorspace")) {
+            for (i = 0; colorspaces[i] != NULL; i++)
+                if (!strcasecmp(colorspaces[i], sval))
+                    break;
+            args->colorspace = colorspaces[i] ? i : 0;
+            return colorspaces[i] == NULL;
+        }
+        if (!strcmp(key, "splitmargin")) {
+            args->splitmargin[0] = args->splitmargin[1] = 0;
+            return sscanf(sval, "%hux%hu", &args->splitmargin[0], &args->splitmargin[1]) < 1;
+        }
+        return 1;
+    }
+
+    if (type == JSON_BOOL) {
+        if (!strcmp(key, "rleopt"))
+            args->rle_optimise = nval > 0;
+        else if (!strcmp(key, "anamorphic"))
+            args->anamorphic = nval > 0;
+        else if (!strcmp(key, "fullscreen"))
+            args->fullscreen = nval > 0;
+        else if (!strcmp(key, "squarepx"))
+            args->square_px = nval > 0;
+        else if (!strcmp(key, "hinting"))
+            args->hinting = nval > 0;
+        else if (!strcmp(key, "keep-dupes"))
+            args->keep_dupes = nval > 0;
+        else if (!strcmp(key, "full-bitmaps"))
+            args->full_bitmaps = nval > 0;
+        else if (!strcmp(key, "event-index"))
+            args->bdn_index = nval > 0;
+        else
+            return 1;
+        return 0;
+    }
+
+    if (!strcmp(key, "par")) {
+        args->par = nval;
+        return nval != 0 && (nval < 0.1 || nval > 10);
+    } else if (!strcmp(key, "dim")) {
+        if (nval < 0.0 || nval > 100.0)
+            return 1;
+        args->dim_flag = nval > 0.0;
+        args->dimf = MAX(0.0f, MIN(1.0f, 1.0f - ((float)nval/100.0f)));
+    } else if (!strcmp(key, "nits")) {
+        if (nval < 48 || nval > 1000)
+            return 1;
+        args->nits = (uint16_t)nval;
+    } else if (!strcmp(key, "offset")) {
+        args->offset = (int64_t)nval;
+    } else if (!strcmp(key, "start")) {
+        if (nval < 0)
+            return 1;
+        args->start_frame = (uint64_t)nval + 1;
+    } else if (!strcmp(key, "end")) {
+        if (nval <= 0)
+            return 1;
+        args->end_frame = (uint64_t)nval + 1;
+    } else if (!strcmp(key, "index-base")) {
+        if (nval < 0 || nval > 9999999)
+            return 1;
+        args->index_base = (uint32_t)nval;
+    } else if (!strcmp(key, "quantize")) {
+        if (nval < 0 || nval > 256)
+            return 1;
+        args->quantize = (uint16_t)MAX(nval, nval == 1 ? 2 : 0);
+    } else if (!strcmp(key, "split")) {
+        if (nval < 0 || nval > 4)
+            return 1;
+        args->split = (uint8_t)nval;
+    } else if (!strcmp(key, "merge-threshold")) {
+        if (nval < 0 || nval > 255)
+            return 1;
+        args->merge_threshold = (uint8_t)nval;
+    } else if (!strcmp(key, "merge-max-frames")) {
+        if (nval <= 0 || nval > 65535)
+            return 1;
+        args->merge_max = (uint16_t)nval;
+    } else if (!strcmp(key, "rle-budget")) {
+        if (nval < 0 || nval > 16777215)
+            return 1;
+        args->rle_budget = (uint32_t)nval;
+    } else if (!strcmp(key, "time-budget")) {
+        if (nval < 0 || nval > 86400)
+            return 1;
+        args->time_budget = (uint32_t)(nval*1000 + 0.5);
+    } else if (!strcmp(key, "downsample")) {
+        if (nval < 0 || nval > 15)
+            return 1;
+        args->downsampled = (uint8_t)nval;
+    } else if (!strcmp(key, "width-render")) {
+        args->render_w = (int)nval;
+        return args->render_w <= 32 || args->render_w > 4096;
+    } else if (!strcmp(key, "height-render")) {
+        args->render_h = (int)nval;
+        return args->render_h <= 32 || args->render_h > 4096;
+    } else if (!strcmp(key, "width-store")) {
+        args->storage_w = (int)nval;
+        return args->storage_w <= 0 || args->storage_w > 4096;
+    } else if (!strcmp(key, "height-store")) {
+        args->storage_h = (int)nval;
+        return args->storage_h <= 0 || args->storage_h > 4096;
+    } else if (!strcmp(key, "liq-speed")) {
+        liqargs->speed = (uint8_t)nval;
+        job->liq_params = 1;
+        return nval < 1 || nval > 10;
+    } else if (!strcmp(key, "liq-quality")) {
+        liqargs->max_quality = (uint8_t)nval;
+        job->liq_params = 1;
+        return nval < 1 || nval > 100;
+    } else if (!strcmp(key, "liq-max-speed")) {
+        liqargs->max_speed = (uint8_t)nval;
+        job->liq_params = 1;
+        return nval < 1 || nval > 10;
+    } else if (!strcmp(key, "liq-min-quality")) {
+        liqargs->min_quality = (uint8_t)nval;
+        job->liq_params = 1;
+        return nval < 1 || nval > 100;
+    } else if (!strcmp(key, "liq-dither")) {
+        liqargs->dither = (float)nval;
+        job->liq_params = 1;
+        return nval < 0.0 || nval > 1.0;
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+//Parse a flat JSON object, nested objects and arrays are not accepted.
+static const char *job_parse(job_t *job, char *line)
+{
+    static const char *bad_json = "malformed JSON object";
+    char *p = json_skip_ws(line);
+    char *key, *sval;
+    double nval;
+    int type;
+
+    if (*p++ != '{')
+        return bad_json;
+
+    p = json_skip_ws(p);
+    if (*p == '}')
+        return NULL;
+
+    while (1) {
+        p = json_skip_ws(p);
+        if (*p++ != '"' || !(p = json_string(p, &key)))
+            return bad_json;
+        p = json_skip_ws(p);
+        if (*p++ != ':')
+            return bad_json;
+        p = json_skip_ws(p);
+
+        sval = NULL;
+        nval = 0;
+        if (*p == '"') {
+            type = JSON_STRING;
+            if (!(p = json_string(p + 1, &sval)))
+                return bad_json;
+        } else if (!strncmp(p, "true", 4) || !strncmp(p, "false", 5)) {
+            type = JSON_BOOL;
+            nval = *p == 't';
+            p += nval ? 4 : 5;
+        } else if (!strncmp(p, "null", 4)) {
+            type = JSON_NULL;
+            p += 4;
+        } else {
+            char *end;
+            type = JSON_NUMBER;
+            nval = strtod(p, &end);
+            if (end == p)
+                return bad_json;
+            p = end;
+        }
+
+        if (job_set(job, key, type, sval, nval))
+            return "invalid or unknown field";
+
+        p = json_skip_ws(p);
+        if (*p == '}')
+            return NULL;
+        if (*p++ != ',')
+            return bad_json;
+    }
+}
+
+static void job_free(job_t *job)
+{
+    if (job->client)
+        client_release(job->client);
+    free(job->tag);
+    free(job->cmd);
+    free(job->input);
+    free(job->outdir);
+    free(job->bdnfile);
+    free(job->fontdir);
+    free(job->track_name);
+    free(job->language);
+    free(job);
+}
+
+static uint64_t clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static job_t *queue_pop(server_t *srv)
+{
+    job_t *job;
+
+    pthread_mutex_lock(&srv->lock);
+    while (srv->head == NULL && !srv->quit)
+        pthread_cond_wait(&srv->cond, &srv->lock);
+
+    //Pending jobs are still processed on shutdown.
+    job = srv->head;
+    if (job) {
+        srv->head = job->next;
+        if (srv->head == NULL)
+            srv->tail = NULL;
+        srv->queued--;
+    }
+    pthread_mutex_unlock(&srv->lock);
+    return job;
+}
+
+static int run_job(job_t *job, a2b_ctx_t **ctx, int worker)
+{
+    char tag[256], path[4096];
+    const char *bdnfile = job->bdnfile;
+    eventlist_t *evlist = NULL;
+    a2b_sink_t sink = {.event = eventlist_sink};
+    a2b_stats_t stats;
+    uint64_t start = clock_ms();
+    int err;
+
+    json_escape(job->tag, tag, sizeof(tag));
+    client_send(job->client, "{\"job\":%llu,\"id\":\"%s\",\"status\":\"running\",\"worker\":%d}",
+                (unsigned long long)job->id, tag, worker);
+
+    if (job->outdir && mkdir(job->outdir, 0755) && errno != EEXIST) {
+        err = A2B_ERR_PNG;
+        goto done;
+    }
+    if (bdnfile == NULL) {
+        snprintf(path, sizeof(path), "%s%sbdn.xml", job->outdir ? job->outdir : "", job->outdir ? "/" : "");
+        bdnfile = path;
+    }
+
+    //Contexts are kept warm across jobs, only the job options are applied.
+    if (*ctx == NULL)
+        *ctx = a2b_init(&job->args, &job->liqargs, &err);
+    else
+        err = a2b_configure(*ctx, &job->args, &job->liqargs);
+    if (err)
+        goto done;
+
+    evlist = calloc(1, sizeof(eventlist_t));
+    if (evlist == NULL) {
+        err = A2B_ERR_ALLOC;
+        goto done;
+    }
+    sink.priv = evlist;
+
+    err = render_subs(*ctx, job->input, job->frate, &sink);
+    if (err == A2B_OK)
+        err = write_xml(evlist, job->vfmt, job->frate, bdnfile, job->track_name ? job->track_name : "Undefined",
+                        job->language ? job->language : "und", &job->args);
+
+done:
+    if (evlist)
+        eventlist_free(evlist);
+
+    if (err == A2B_OK) {
+        a2b_get_stats(*ctx, &stats);
+        client_send(job->client, "{\"job\":%llu,\"id\":\"%s\",\"status\":\"done\",\"events\":%llu,\"frames\":%llu,"
+                                 "\"images\":%llu,\"bytes\":%llu,\"elapsed_ms\":%llu}",
+                    (unsigned long long)job->id, tag, (unsigned long long)stats.events,
+                    (unsigned long long)stats.frames, (unsigned long long)stats.images,
+                    (unsigned long long)stats.bytes, (unsigned long long)(clock_ms() - start));
+    } else {
+        client_send(job->client, "{\"job\":%llu,\"id\":\"%s\",\"status\":\"failed\",\"error\":\"%s\",\"elapsed_ms\":%llu}",
+                    (unsigned long long)job->id, tag, a2b_strerror(err), (unsigned long long)(clock_ms() - start));
+    }
+    return err;
+}
+
+typedef struct worker_s {
+    server_t *srv;
+    int index;
+} worker_t;
+
+static void *worker_main(void *priv)
+{
+    worker_t *worker = (worker_t *)priv;
+    server_t *srv = worker->srv;
+    a2b_ctx_t *ctx = NULL;
+    job_t *job;
+    int err;
+
+    while ((job = queue_pop(srv)) != NULL) {
+        err = run_job(job, &ctx, worker->index);
+
+        pthread_mutex_lock(&srv->lock);
+        if (err == A2B_OK)
+            srv->done++;
+        else
+            srv->failed++;
+        pthread_mutex_unlock(&srv->lock);
+        job_free(job);
+    }
+    a2b_done(ctx);
+    return NULL;
+}
+
+static void handle_line(server_t *srv, client_t *client, char *line)
+{
+    char tag[256];
+    const char *error;
+    job_t *job = calloc(1, sizeof(job_t));
+
+    if (job == NULL)
+        return;
+
+    job->args = srv->args;
+    job->liqargs = srv->liqargs;
+    job->frate = &frates[0];
+    job->vfmt = &vfmts[0];
+
+    error = job_parse(job, line);
+    json_escape(job->tag, tag, sizeof(tag));
+
+    if (error == NULL && job->cmd) {
+        if (!strcmp(job->cmd, "stats")) {
+            pthread_mutex_lock(&srv->lock);
+            client_send(client, "{\"id\":\"%s\",\"status\":\"stats\",\"workers\":%d,\"queued\":%llu,\"done\":%llu,\"failed\":%llu}",
+                        tag, srv->workers, (unsigned long long)srv->queued,
+                        (unsigned long long)srv->done, (unsigned long long)srv->failed);
+            pthread_mutex_unlock(&srv->lock);
+        } else if (!strcmp(job->cmd, "shutdown")) {
+            client_send(client, "{\"id\":\"%s\",\"status\":\"shutdown\"}", tag);
+            pthread_mutex_lock(&srv->lock);
+            srv->quit = 1;
+            pthread_cond_broadcast(&srv->cond);
+            pthread_mutex_unlock(&srv->lock);
+            shutdown(srv->listen_fd, SHUT_RDWR);
+        } else {
+            error = "unknown command";
+        }
+        if (error == NULL) {
+            job_free(job);
+            return;
+        }
+    }
+
+    if (error == NULL && job->input == NULL)
+        error = "missing input";
+    if (error == NULL) {
+        job->args.fontdir = job->fontdir ? job->fontdir : srv->args.fontdir;
+        job->args.outdir = job->outdir;
+        if (a2b_setup_opts(&job->args, &job->liqargs, job->vfmt, job->liq_params))
+            error = a2b_strerror(A2B_ERR_ARGS);
+    }
+
+    if (error) {
+        client_send(client, "{\"id\":\"%s\",\"status\":\"rejected\",\"error\":\"%s\"}", tag, error);
+        job_free(job);
+        return;
+    }
+
+    pthread_mutex_lock(&client->lock);
+    client->refs++;
+    pthread_mutex_unlock(&client->lock);
+    job->client = client;
+
+    pthread_mutex_lock(&srv->lock);
+    if (srv->quit) {
+        pthread_mutex_unlock(&srv->lock);
+        client_send(client, "{\"id\":\"%s\",\"status\":\"rejected\",\"error\":\"server shutting down\"}", tag);
+        job_free(job);
+        return;
+    }
+    job->id = srv->next_id++;
+    if (srv->tail)
+        srv->tail->next = job;
+    else
+        srv->head = job;
+    srv->tail = job;
+    srv->queued++;
+    client_send(client, "{\"job\":%llu,\"id\":\"%s\",\"status\":\"queued\",\"position\":%llu}",
+                (unsigned long long)job->id, tag, (unsigned long long)srv->queued);
+    pthread_cond_signal(&srv->cond);
+    pthread_mutex_unlock(&srv->lock);
+}
+
+static void *reader_main(void *priv)
+{
+    reader_t *reader = (reader_t *)priv;
+    char *line = malloc(LINE_MAX_LENGTH);
+    size_t len = 0;
+    ssize_t k;
+
+    while (line && (k = recv(reader->client->fd, line + len, LINE_MAX_LENGTH - 1 - len, 0)) > 0) {
+        char *start = line, *nl;
+        len += k;
+        line[len] = 0;
+
+        while ((nl = memchr(start, '\n', len - (start - line))) != NULL) {
+            *nl = 0;
+            if (*json_skip_ws(start))
+                handle_line(reader->srv, reader->client, start);
+            start = nl + 1;
+        }
+        len -= start - line;
+        memmove(line, start, len);
+
+        if (len == LINE_MAX_LENGTH - 1) {
+            client_send(reader->client, "{\"status\":\"rejected\",\"error\":\"line too long\"}");
+            break;
+        }
+    }
+
+    free(line);
+    pthread_mutex_lock(&reader->srv->lock);
+    reader->done = 1;
+    client_release(reader->client);
+    pthread_mutex_unlock(&reader->srv->lock);
+    return NULL;
+}
+
+//Join the readers whose connection ended, or all of them once the workers are joined: the
+//connections still open are then shut down, every job reply has been sent.
+static void readers_join(server_t *srv, int all)
+{
+    reader_t **p = &srv->readers;
+
+    while (*p) {
+        reader_t *reader = *p;
+        int done;
+
+        pthread_mutex_lock(&srv->lock);
+        done = reader->done;
+        if (!done && all)
+            shutdown(reader->client->fd, SHUT_RDWR);
+        pthread_mutex_unlock(&srv->lock);
+        if (!done && !all) {
+            p = &reader->next;
+            continue;
+        }
+        pthread_join(reader->thread, NULL);
+        *p = reader->next;
+        free(reader);
+    }
+}
+
+int serve(const char *sockpath, int workers, opts_t *args, liqopts_t *liqargs)
+{
+    struct sockaddr_un addr;
+    server_t srv;
+    pthread_t *threads;
+    worker_t *wargs;
+    int i, fd;
+
+    if (strlen(sockpath) >= sizeof(addr.sun_path)) {
+        printf(A2B_LOG_PREFIX "socket path too long: %s\n", sockpath);
+        return A2B_ERR_ARGS;
+    }
+
+    memset(&srv, 0, sizeof(srv));
+    srv.workers = workers;
+    srv.args = *args;
+    srv.liqargs = *liqargs;
+
+    srv.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (srv.listen_fd < 0) {
+        perror("socket");
+        return A2B_ERR_ARGS;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockpath);
+    unlink(sockpath);
+
+    if (bind(srv.listen_fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(srv.listen_fd, 16)) {
+        perror("bind");
+        close(srv.listen_fd);
+        return A2B_ERR_ARGS;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    threads = calloc(workers, sizeof(pthread_t));
+    wargs = calloc(workers, sizeof(worker_t));
+    if (!threads || !wargs) {
+        free(threads);
+        free(wargs);
+        close(srv.listen_fd);
+        return A2B_ERR_ALLOC;
+    }
+    pthread_mutex_init(&srv.lock, NULL);
+    pthread_cond_init(&srv.cond, NULL);
+    for (i = 0; i < workers; i++) {
+        wargs[i].srv = &srv;
+        wargs[i].index = i;
+        pthread_create(&threads[i], NULL, worker_main, &wargs[i]);
+    }
+
+    printf(A2B_LOG_PREFIX "serving on %s with %d worker(s).\n", sockpath, workers);
+    fflush(stdout);
+
+    while ((fd = accept(srv.listen_fd, NULL, NULL)) >= 0 || errno == EINTR) {
+        reader_t *reader;
+
+        if (fd < 0)
+            continue;
+        readers_join(&srv, 0);
+        reader = calloc(1, sizeof(reader_t));
+        if (reader)
+            reader->client = calloc(1, sizeof(client_t));
+        if (!reader || !reader->client) {
+            free(reader);
+            close(fd);
+            continue;
+        }
+        reader->srv = &srv;
+        reader->client->fd = fd;
+        reader->client->refs = 1;
+        pthread_mutex_init(&reader->client->lock, NULL);
+
+        if (pthread_create(&reader->thread, NULL, reader_main, reader)) {
+            client_release(reader->client);
+            free(reader);
+            continue;
+        }
+        reader->next = srv.readers;
+        srv.readers = reader;
+
+        pthread_mutex_lock(&srv.lock);
+        i = srv.quit;
+        pthread_mutex_unlock(&srv.lock);
+        if (i)
+            break;
+    }
+
+    pthread_mutex_lock(&srv.lock);
+    srv.quit = 1;
+    pthread_cond_broadcast(&srv.cond);
+    pthread_mutex_unlock(&srv.lock);
+
+    for (i = 0; i < workers; i++)
+        pthread_join(threads[i], NULL);
+    //Lines received from now on are rejected, no thread may use srv past this point.
+    readers_join(&srv, 1);
+
+    close(srv.listen_fd);
+    unlink(sockpath);
+    free(threads);
+    free(wargs);
+    pthread_cond_destroy(&srv.cond);
+    pthread_mutex_destroy(&srv.lock);
+    printf(A2B_LOG_PREFIX "server stopped, %llu job(s) done, %llu failed.\n",
+           (unsigned long long)srv.done, (unsigned long long)srv.failed);
+    return A2B_OK;
+}
@@ -0,0 +1,5 @@
+#include "common.h"
+
+//Serve conversion jobs described as JSON lines on a unix socket, args and
+//liqargs are the defaults of every job.
+int serve(const char *sockpath, int workers, opts_t *args, liqopts_t *liqargs);
@@ -0,0 +1,73 @@
+#!/bin/sh
+# Regression test of distributed rendering: render a corpus file in slices, merge the fragments and check the
+# merged BDN against the full render and the reference.
+# usage: merge.sh BINARY CORPUS REFERENCE TC... [-- OPTIONS...]
+# The slices are cut at the TCs. REFERENCE is the merged BDN XML without the sizes and positions of the graphics.
+# With A2B_UPDATE_REFERENCES=1, the merge becomes the new reference.
+
+abspath() {
+    case "$1" in
+        /*) echo "$1" ;;
+        *) echo "$PWD/$1" ;;
+    esac
+}
+
+strip_xml() {
+    sed -E 's/ Width="[0-9]+" Height="[0-9]+" X="-?[0-9]+" Y="-?[0-9]+"//' "$1"
+}
+
+bin=$(abspath "$1")
+corpus=$(abspath "$2")
+ref=$(abspath "$3")
+shift 3
+cuts=
+while [ $# -gt 0 ] && [ "$1" != -- ]; do
+    cuts="$cuts $1"
+    shift
+done
+[ $# -gt 0 ] && shift
+
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+mkdir "$work/full" "$work/slices" && cd "$work/slices" || exit 1
+
+(cd ../full && "$bin" "$@" "$corpus") > log.txt || { cat log.txt; exit 1; }
+
+# Each slice numbers its PNGs from a multiple of 1000.
+start=
+base=0
+for end in $cuts ""; do
+    "$bin" ${start:+--start "$start"} ${end:+--end "$end"} --index-base "$base" "$@" "$corpus" > log.txt ||
+        { cat log.txt; exit 1; }
+    mv bdn.xml "part$base.xml" || exit 1
+    parts="$parts part$base.xml"
+    start=$end
+    base=$((base + 1000))
+done
+"$bin" --merge bdn.xml $parts > log.txt || { cat log.txt; exit 1; }
+
+# Apart from the PNG names, the merge is the full render.
+strip_xml bdn.xml | sed -E 's/>[^<]+\.png</></' > merged.txt
+strip_xml ../full/bdn.xml | sed -E 's/>[^<]+\.png</></' > full.txt
+if ! cmp -s full.txt merged.txt; then
+    echo "merged BDN differs from the full render:"
+    diff full.txt merged.txt | head -20
+    exit 1
+fi
+
+if [ "${A2B_UPDATE_REFERENCES:-0}" = 1 ]; then
+    strip_xml bdn.xml > "$ref" || exit 1
+    echo "updated $ref"
+    exit 0
+fi
+if [ ! -f "$ref" ]; then
+    echo "no reference $ref, generate it with A2B_UPDATE_REFERENCES=1 meson test --suite regress"
+    exit 1
+fi
+strip_xml bdn.xml > merged.xml
+if ! cmp -s merged.xml "$ref"; then
+    echo "merged BDN differs from $ref:"
+    diff "$ref" merged.xml | head -20
+    exit 1
+fi
+exit 0
@@ -0,0 +1,107 @@
+/* Copyright © 2024, cubicibo
+ * The same agreement notice as ass2bdnxml.c applies.
+ */
+
+//Regression helper: decodes every PNG listed in a --report with libpng and checks its size and
+//pixels against the report. The hashes are those of the pixels handed to the PNG writers.
+//usage: pngcheck REPORT DIRECTORY
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+
+#define FNV64_INIT (0xcbf29ce484222325ULL)
+#define FNV64_PRIME (0x100000001b3ULL)
+
+//Decode to 8-bit RGBA and hash the pixels in RGBA order, as render.c does. 0 on success.
+static int png_digest(const char *fname, int *w, int *h, uint64_t *digest)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_bytep row = NULL;
+    FILE *fp = fopen(fname, "rb");
+
+    if (fp == NULL)
+        return 1;
+
+    png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    info_ptr = png_create_info_struct(png_ptr);
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+        free(row);
+        fclose(fp);
+        return 1;
+    }
+
+    png_init_io(png_ptr, fp);
+    png_read_info(png_ptr, info_ptr);
+    png_set_expand(png_ptr);
+    png_set_strip_16(png_ptr);
+    png_set_gray_to_rgb(png_ptr);
+    png_set_add_alpha(png_ptr, 0xFF, PNG_FILLER_AFTER);
+    png_read_update_info(png_ptr, info_ptr);
+
+    *w = (int)png_get_image_width(png_ptr, info_ptr);
+    *h = (int)png_get_image_height(png_ptr, info_ptr);
+    row = malloc(png_get_rowbytes(png_ptr, info_ptr));
+    if (row == NULL)
+        png_error(png_ptr, "out of memory");
+
+    *digest = FNV64_INIT;
+    for (int y = 0; y < *h; y++) {
+        png_read_row(png_ptr, row, NULL);
+        for (int x = 0; x < *w*4; x++)
+            *digest = (*digest ^ row[x]) * FNV64_PRIME;
+    }
+    png_read_end(png_ptr, NULL);
+    png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+    free(row);
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    char line[256], name[128], path[FILENAME_MAX];
+    int w, h, x, y, dw, dh, images = 0, errors = 0;
+    uint64_t digest, ref;
+    FILE *fp;
+
+    if (argc != 3) {
+        printf("usage: %s REPORT DIRECTORY\n", argv[0]);
+        return 1;
+    }
+    fp = fopen(argv[1], "r");
+    if (fp == NULL) {
+        perror("Error opening report file");
+        return 1;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        if (sscanf(line, "image %127s %dx%d+%d+%d %" SCNx64, name, &w, &h, &x, &y, &ref) != 6)
+            continue;
+        images++;
+        snprintf(path, sizeof(path), "%s/%s", argv[2], name);
+        if (png_digest(path, &dw, &dh, &digest)) {
+            printf("%s: cannot be decoded.\n", name);
+            errors++;
+        } else if (dw != w || dh != h) {
+            printf("%s: %dx%d, the report has %dx%d.\n", name, dw, dh, w, h);
+            errors++;
+        } else if (digest != ref) {
+            printf("%s: decoded pixels hash to %016" PRIx64 ", the report has %016" PRIx64 ".\n", name, digest, ref);
+            errors++;
+        }
+    }
+    fclose(fp);
+
+    if (images == 0) {
+        printf("%s: no image to check.\n", argv[1]);
+        return 1;
+    }
+    printf("%d image(s) checked, %d error(s).\n", images, errors);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,91 @@
+#!/bin/sh
+# Regression test: render a corpus file, check the run against its reference and the PNGs against the run report.
+# usage: regress.sh BINARY PNGCHECK CORPUS REFERENCE TOLERANCE [OPTIONS...]
+# REFERENCE is the path of the reference files without extension:
+#   REFERENCE.report  --check-report baseline with the event timings and the PNG names,
+#   REFERENCE.xml     BDN XML without the sizes and positions of the graphics.
+# Neither depends on the libass and FreeType versions. wall_ms and peak_rss_kb lines added to REFERENCE.report
+# on a reference machine are checked with TOLERANCE percent. A missing reference fails the test.
+# REFERENCE "-" only checks the run and its PNGs, for a corpus whose events depend on the rendering.
+# With A2B_MOVE="DX DY", every event must reuse the PNGs of the previous one moved by DX,DY.
+# With A2B_UPDATE_REFERENCES=1, the run becomes the new reference.
+
+abspath() {
+    case "$1" in
+        /*) echo "$1" ;;
+        *) echo "$PWD/$1" ;;
+    esac
+}
+
+strip_report() {
+    sed -E -e '/^(wall_ms|peak_rss_kb) /d' -e 's/^(image [^ ]+) .*/\1/' "$1"
+}
+
+strip_xml() {
+    sed -E 's/ Width="[0-9]+" Height="[0-9]+" X="-?[0-9]+" Y="-?[0-9]+"//' "$1"
+}
+
+bin=$(abspath "$1")
+pngcheck=$(abspath "$2")
+corpus=$(abspath "$3")
+ref=$4
+[ "$ref" = - ] || ref=$(abspath "$ref")
+tolerance=$5
+shift 5
+
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+if [ "${A2B_UPDATE_REFERENCES:-0}" = 1 ] && [ "$ref" != - ]; then
+    "$bin" --report report.txt "$@" "$corpus" > log.txt || { cat log.txt; exit 1; }
+    strip_report report.txt > "$ref.report" && strip_xml bdn.xml > "$ref.xml" || exit 1
+    echo "updated $ref.report and $ref.xml"
+    exit 0
+fi
+
+if [ "$ref" = - ]; then
+    "$bin" --report report.txt "$@" "$corpus" > log.txt || { cat log.txt; exit 1; }
+else
+    if [ ! -f "$ref.report" ] || [ ! -f "$ref.xml" ]; then
+        echo "no reference $ref.report, generate it with A2B_UPDATE_REFERENCES=1 meson test --suite regress"
+        exit 1
+    fi
+    "$bin" --report report.txt --check-report "$ref.report" --check-tolerance "$tolerance" "$@" "$corpus" > log.txt ||
+        { cat log.txt; exit 1; }
+    strip_xml bdn.xml > bdn.ref.xml
+    if ! cmp -s bdn.ref.xml "$ref.xml"; then
+        echo "BDN XML differs from $ref.xml:"
+        diff "$ref.xml" bdn.ref.xml | head -20
+        exit 1
+    fi
+fi
+
+"$pngcheck" report.txt . || exit 1
+
+# Moved events keep their graphics, including the crops of a split event, at the new position.
+if [ -n "$A2B_MOVE" ]; then
+    awk -v move="$A2B_MOVE" '
+        BEGIN { split(move, d, " ") }
+        /<Event / { if (n) check(); n++; cur = 0 }
+        /<Graphic / {
+            match($0, /Width="[0-9]+" Height="[0-9]+" X="-?[0-9]+" Y="-?[0-9]+">[^<]+/)
+            split(substr($0, RSTART, RLENGTH), f, /"|>/)
+            cur++; w[cur] = f[2]; h[cur] = f[4]; x[cur] = f[6]; y[cur] = f[8]; name[cur] = f[10]
+        }
+        END { if (n) check(); if (n < 2 || bad) exit 1; print n " moved event(s) checked." }
+        function check(   k) {
+            if (n > 1 && cur != prev) { print "event " n-1 ": " cur " graphic(s), " prev " before"; bad = 1 }
+            for (k = 1; k <= cur; k++) {
+                if (n > 1 && (w[k] != pw[k] || h[k] != ph[k] || x[k] != px[k] + d[1] || y[k] != py[k] + d[2] ||
+                              name[k] != pname[k])) {
+                    print "event " n-1 ": " name[k] " " w[k] "x" h[k] "+" x[k] "+" y[k] ", expected " pname[k] " " \
+                          pw[k] "x" ph[k] "+" px[k] + d[1] "+" py[k] + d[2]
+                    bad = 1
+                }
+                pw[k] = w[k]; ph[k] = h[k]; px[k] = x[k]; py[k] = y[k]; pname[k] = name[k]
+            }
+            prev = cur
+        }' bdn.xml || exit 1
+fi
+exit 0
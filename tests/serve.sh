@@ -0,0 +1,74 @@
+#!/bin/sh
+# Regression test of --serve: a client sends a job, stats and shutdown while a second client stays connected
+# and idle after a first stats. The server must complete the job, reply to every line and stop, closing the
+# idle connection.
+# usage: serve.sh BINARY SOCKCLIENT CORPUS REFERENCE [OPTIONS...]
+# REFERENCE is the BDN XML of the corpus without the sizes and positions of the graphics, see regress.sh.
+
+abspath() {
+    case "$1" in
+        /*) echo "$1" ;;
+        *) echo "$PWD/$1" ;;
+    esac
+}
+
+bin=$(abspath "$1")
+client=$(abspath "$2")
+corpus=$(abspath "$3")
+ref=$(abspath "$4")
+shift 4
+
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+cd "$work" || exit 1
+
+"$bin" --serve "$work/a2b.sock" --workers 1 "$@" > server.log 2>&1 &
+server=$!
+
+mkfifo idle.in || exit 1
+"$client" "$work/a2b.sock" < idle.in > idle.log &
+idle=$!
+exec 3> idle.in
+echo '{"id": "idle", "cmd": "stats"}' >&3
+tries=0
+until grep -q '"id":"idle"' idle.log; do
+    tries=$((tries + 1))
+    [ $tries -le 100 ] || { echo "no reply to the idle client"; kill $server; exit 1; }
+    sleep 0.1
+done
+
+"$client" "$work/a2b.sock" > replies.log <<END
+{"id": "dialogue", "input": "$corpus", "output": "$work/out"}
+{"id": "counters", "cmd": "stats"}
+{"id": "stop", "cmd": "shutdown"}
+END
+
+wait $server
+status=$?
+wait $idle
+idle_status=$?
+exec 3>&-
+
+cat replies.log
+if [ $status -ne 0 ]; then
+    echo "server exited with status $status:"
+    cat server.log
+    exit 1
+fi
+for reply in '"id":"dialogue","status":"queued"' '"id":"dialogue","status":"done"' \
+             '"id":"counters","status":"stats"' '"id":"stop","status":"shutdown"'; do
+    grep -q "$reply" replies.log || { echo "missing reply $reply"; exit 1; }
+done
+if [ $idle_status -ne 0 ] || [ "$(wc -l < idle.log)" -ne 1 ]; then
+    echo "idle client exited with status $idle_status:"
+    cat idle.log
+    exit 1
+fi
+
+sed -E 's/ Width="[0-9]+" Height="[0-9]+" X="-?[0-9]+" Y="-?[0-9]+"//' out/bdn.xml > bdn.ref.xml
+if ! cmp -s bdn.ref.xml "$ref"; then
+    echo "BDN XML differs from $ref:"
+    diff "$ref" bdn.ref.xml | head -20
+    exit 1
+fi
+exit 0
@@ -0,0 +1,79 @@
+/* Copyright © 2024, cubicibo
+ * The same agreement notice as ass2bdnxml.c applies.
+ */
+
+//Regression helper: minimal local socket client of --serve. Standard input is sent to the socket
+//and the replies are printed until the server closes the connection.
+//usage: sockclient SOCKET
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define CONNECT_TRIES (100)
+
+int main(int argc, char *argv[])
+{
+    const struct timespec retry = {0, 50*1000*1000};
+    struct sockaddr_un addr;
+    struct pollfd fds[2];
+    char buf[4096];
+    int fd, k;
+
+    if (argc != 2 || strlen(argv[1]) >= sizeof(addr.sun_path)) {
+        printf("usage: %s SOCKET\n", argv[0]);
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, argv[1]);
+
+    //The server may still be starting.
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    for (k = 0; fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)); k++) {
+        if (k == CONNECT_TRIES || (errno != ENOENT && errno != ECONNREFUSED)) {
+            perror("connect");
+            return 1;
+        }
+        nanosleep(&retry, NULL);
+    }
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = STDIN_FILENO;
+    fds[1].events = POLLIN;
+
+    while (poll(fds, 2, -1) >= 0 || errno == EINTR) {
+        ssize_t len;
+
+        if (fds[0].revents & (POLLIN | POLLHUP)) {
+            len = recv(fd, buf, sizeof(buf), 0);
+            if (len <= 0)
+                break;
+            fwrite(buf, 1, len, stdout);
+            fflush(stdout);
+        }
+        if (fds[1].revents & (POLLIN | POLLHUP)) {
+            len = read(STDIN_FILENO, buf, sizeof(buf));
+            if (len <= 0) {
+                //Nothing more to send, the replies are still read.
+                shutdown(fd, SHUT_WR);
+                fds[1].fd = -1;
+            } else if (send(fd, buf, len, MSG_NOSIGNAL) != len) {
+                perror("send");
+                break;
+            }
+        }
+    }
+    close(fd);
+    return 0;
+}